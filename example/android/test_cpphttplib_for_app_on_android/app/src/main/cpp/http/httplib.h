@@ -47,13 +47,21 @@ typedef SOCKET socket_t;
 #else
 #include <arpa/inet.h>
 #include <cstring>
+#include <dirent.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 typedef int socket_t;
 #define INVALID_SOCKET (-1)
@@ -61,10 +69,12 @@ typedef int socket_t;
 
 #include <assert.h>
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
 #include <fcntl.h>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <list>
 #include <map>
 #include <memory>
@@ -77,14 +87,30 @@ typedef int socket_t;
 
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #include <openssl/crypto.h>
 inline const unsigned char *ASN1_STRING_get0_data(const ASN1_STRING *asn1) {
   return M_ASN1_STRING_data(asn1);
 }
+
+inline int X509_STORE_up_ref(X509_STORE *store) {
+  return CRYPTO_add(&store->references, 1, CRYPTO_LOCK_X509_STORE) > 1;
+}
+
+inline int SSL_SESSION_up_ref(SSL_SESSION *session) {
+  return CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION) > 1;
+}
 #endif
 #endif
 
@@ -92,18 +118,63 @@ inline const unsigned char *ASN1_STRING_get0_data(const ASN1_STRING *asn1) {
 #include <zlib.h>
 #endif
 
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+#include <nghttp2/nghttp2.h>
+#endif
+
 /*
  * Configuration
  */
+#ifndef CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND
 #define CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND 5
+#endif
+#ifndef CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND
 #define CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND 0
+#endif
+#ifndef CPPHTTPLIB_KEEPALIVE_MAX_COUNT
 #define CPPHTTPLIB_KEEPALIVE_MAX_COUNT 5
+#endif
 #define CPPHTTPLIB_READ_TIMEOUT_SECOND 5
 #define CPPHTTPLIB_READ_TIMEOUT_USECOND 0
 #define CPPHTTPLIB_REQUEST_URI_MAX_LENGTH 8192
 #define CPPHTTPLIB_PAYLOAD_MAX_LENGTH (std::numeric_limits<size_t>::max)()
 #define CPPHTTPLIB_RECV_BUFSIZ size_t(4096u)
+#define CPPHTTPLIB_SSL_RECV_BUFSIZ size_t(16384u)
+#define CPPHTTPLIB_SEND_BUFSIZ size_t(16384u)
+#define CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH size_t(32u * 1024u * 1024u)
+#define CPPHTTPLIB_SSL_SMALL_RECORD_SIZE size_t(1400u)
+#define CPPHTTPLIB_SSL_SMALL_RECORD_BYTES size_t(65536u)
+#define CPPHTTPLIB_SSL_RECORD_IDLE_MSECOND 1000
 #define CPPHTTPLIB_THREAD_POOL_COUNT 8
+#define CPPHTTPLIB_SSL_SESSION_CACHE_SIZE 20480
+#define CPPHTTPLIB_SSL_POOL_COUNT 4
+#define CPPHTTPLIB_SSL_HANDSHAKE_TIMEOUT_SECOND 5
+#define CPPHTTPLIB_CRYPTO_THREAD_POOL_COUNT 2
+#define CPPHTTPLIB_SSL_SESSION_TIMEOUT_SECOND 300
+#define CPPHTTPLIB_SSL_CLIENT_SESSION_COUNT 4
+#define CPPHTTPLIB_HTTP2_MAX_CONCURRENT_STREAMS 100
+#define CPPHTTPLIB_CLIENT_KEEPALIVE_MAX_IDLE_COUNT 4
+#define CPPHTTPLIB_CLIENT_KEEPALIVE_IDLE_TIMEOUT_SECOND 4
+#define CPPHTTPLIB_TCP_NODELAY true
+#define CPPHTTPLIB_DNS_CACHE_TTL_SECOND 60
+#define CPPHTTPLIB_DNS_CACHE_NEGATIVE_TTL_SECOND 5
+#define CPPHTTPLIB_DNS_CACHE_MAX_ENTRY_COUNT 256
+#define CPPHTTPLIB_CONNECTION_ATTEMPT_DELAY_MSECOND 250
+#define CPPHTTPLIB_ASYNC_CLIENT_THREAD_COUNT 4
+#define CPPHTTPLIB_ASYNC_CLIENT_SETUP_THREAD_COUNT 4
+#define CPPHTTPLIB_BATCH_MAX_CONCURRENCY 4
+#define CPPHTTPLIB_RESPONSE_CACHE_MEMORY_MAX_SIZE size_t(8u * 1024u * 1024u)
+#define CPPHTTPLIB_RESPONSE_CACHE_DISK_MAX_SIZE size_t(64u * 1024u * 1024u)
+#define CPPHTTPLIB_RESPONSE_CACHE_HEURISTIC_MAX_SECOND 86400
+#define CPPHTTPLIB_HEDGING_PERCENTILE 0.95
+#define CPPHTTPLIB_HEDGING_BUDGET 0.05
+#define CPPHTTPLIB_HEDGING_SAMPLE_COUNT 100
+#define CPPHTTPLIB_HEDGING_MIN_SAMPLE_COUNT 20
+#define CPPHTTPLIB_ADAPTIVE_TIMEOUT_RTT_FACTOR 4
+#define CPPHTTPLIB_ADAPTIVE_TIMEOUT_MIN_MSECOND 300
+#define CPPHTTPLIB_ADAPTIVE_FIRST_BYTE_TIMEOUT_FACTOR 10
+#define CPPHTTPLIB_ADAPTIVE_FIRST_BYTE_TIMEOUT_MIN_MSECOND 3000
+#define CPPHTTPLIB_ADAPTIVE_TIMEOUT_MIN_SAMPLE_COUNT 3
 
 namespace httplib {
 
@@ -171,6 +242,9 @@ struct Request {
   Ranges ranges;
   Match matches;
 
+  // Number of requests served on the underlying connection, this one included
+  size_t connection_request_count = 0;
+
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
   const SSL *ssl;
 #endif
@@ -187,6 +261,49 @@ struct Request {
 
   bool has_file(const char *key) const;
   MultipartFile get_file_value(const char *key) const;
+
+  // A client request sends its body from one of these instead of `body`,
+  // without holding it in memory.
+  void set_content_provider(
+      uint64_t length,
+      std::function<void(uint64_t offset, uint64_t length, Out out)> provider);
+  void set_chunked_content_provider(
+      std::function<void(uint64_t offset, Out out, Done done)> provider);
+  // `fd` must stay open until the request is done.
+  void set_content_file(int fd, uint64_t offset, uint64_t length);
+
+  uint64_t content_provider_resource_length = 0;
+  ContentProvider content_provider;
+  int content_fd = -1;
+  uint64_t content_fd_offset = 0;
+};
+
+// How long each phase of a client request took. Unlike curl's
+// CURLINFO_*_TIME, each phase counts on its own rather than from the start.
+// Phases which didn't happen, such as connecting on a reused connection,
+// stay zero.
+struct ResponseTiming {
+  typedef std::chrono::steady_clock::duration Duration;
+
+  Duration dns = Duration::zero();
+  Duration connect = Duration::zero();
+  Duration tls_handshake = Duration::zero();
+  Duration write = Duration::zero();
+  // From when the request was written until the response started.
+  Duration first_byte = Duration::zero();
+  // From then until the response was read.
+  Duration transfer = Duration::zero();
+  // The whole call, also when the response came from a cache or from a
+  // request coalesced with it.
+  Duration total = Duration::zero();
+
+  // Headers included, except over HTTP/2 where they are compressed and only
+  // bodies are counted.
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+
+  bool connection_reused = false;
+  bool tls_session_reused = false;
 };
 
 struct Response {
@@ -195,10 +312,24 @@ struct Response {
   Headers headers;
   std::string body;
 
+  // Filled in by Client.
+  ResponseTiming timing;
+
   ContentReceiver content_receiver;
 
   Progress progress;
 
+  // A client response receives its body into one of these instead of `body`.
+  // The request fails if the body is larger than the buffer. `fd` must stay
+  // open until the request is done.
+  void set_receive_buffer(char *buf, size_t size);
+  void set_receive_file(int fd);
+
+  char *receive_buffer = nullptr;
+  size_t receive_buffer_size = 0;
+  int receive_fd = -1;
+  uint64_t received_length = 0;
+
   bool has_header(const char *key) const;
   std::string get_header_value(const char *key, size_t id = 0) const;
   size_t get_header_value_count(const char *key) const;
@@ -231,6 +362,8 @@ struct Response {
   std::function<void()> content_provider_resource_releaser;
 };
 
+typedef std::function<void(std::shared_ptr<Response> res)> ResponseHandler;
+
 class Stream {
 public:
   virtual ~Stream() {}
@@ -240,6 +373,13 @@ public:
   virtual int write(const std::string &s) = 0;
   virtual std::string get_remote_addr() const = 0;
 
+  // Writes `size1` bytes from `ptr1` followed by `size2` bytes from `ptr2`.
+  virtual bool writev(const char *ptr1, size_t size1, const char *ptr2,
+                      size_t size2);
+
+  // Writes `length` bytes of the file `fd` from `offset`.
+  virtual bool write_file(int fd, uint64_t offset, uint64_t length);
+
   template <typename... Args>
   int write_format(const char *fmt, const Args &... args);
 };
@@ -255,8 +395,31 @@ public:
   virtual int write(const std::string &s);
   virtual std::string get_remote_addr() const;
 
+  virtual bool writev(const char *ptr1, size_t size1, const char *ptr2,
+                      size_t size2);
+  virtual bool write_file(int fd, uint64_t offset, uint64_t length);
+
+  // Reads wait up to `first_byte_msec` for the first byte and `msec` for
+  // each later one, but never past `deadline`; 0 waits without limit.
+  void set_read_timeout(time_t first_byte_msec, time_t msec,
+                        std::chrono::steady_clock::time_point deadline);
+
+  // When the first byte was read, or the clock's epoch until then.
+  std::chrono::steady_clock::time_point get_first_byte_time() const;
+
+  uint64_t get_bytes_read() const;
+  uint64_t get_bytes_written() const;
+
 private:
   socket_t sock_;
+  time_t first_byte_timeout_msec_ = CPPHTTPLIB_READ_TIMEOUT_SECOND * 1000 +
+                                    CPPHTTPLIB_READ_TIMEOUT_USECOND / 1000;
+  time_t read_timeout_msec_ = first_byte_timeout_msec_;
+  std::chrono::steady_clock::time_point deadline_ =
+      (std::chrono::steady_clock::time_point::max)();
+  std::chrono::steady_clock::time_point first_byte_time_;
+  uint64_t bytes_read_ = 0;
+  uint64_t bytes_written_ = 0;
 };
 
 class BufferStream : public Stream {
@@ -282,6 +445,9 @@ public:
   virtual ~TaskQueue() {}
   virtual void enqueue(std::function<void()> fn) = 0;
   virtual void shutdown() = 0;
+
+  // How many tasks run at once, or 0 when there's no fixed limit.
+  virtual size_t get_thread_count() const { return 0; }
 };
 
 #if CPPHTTPLIB_THREAD_POOL_COUNT > 0
@@ -298,6 +464,8 @@ public:
   ThreadPool(const ThreadPool &) = delete;
   virtual ~ThreadPool() {}
 
+  virtual size_t get_thread_count() const override { return threads_.size(); }
+
   virtual void enqueue(std::function<void()> fn) override {
     std::unique_lock<std::mutex> lock(mutex_);
     jobs_.push_back(fn);
@@ -391,6 +559,299 @@ private:
 };
 #endif
 
+namespace detail {
+
+// NOTE: Parks sockets which are waiting for the peer on a single thread and
+// hands them back to the task queue once they are readable or writable, so
+// that no worker blocks on a slow peer.
+class ReadinessLoop {
+public:
+  ReadinessLoop() : task_queue_(nullptr), running_(false) {
+#ifndef _WIN32
+    wakeup_[0] = wakeup_[1] = INVALID_SOCKET;
+#endif
+  }
+
+  ReadinessLoop(const ReadinessLoop &) = delete;
+
+  ~ReadinessLoop() { stop(); }
+
+  void start(TaskQueue &task_queue) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (running_) { return; }
+
+#ifndef _WIN32
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup_) == -1) {
+      wakeup_[0] = wakeup_[1] = INVALID_SOCKET;
+    } else {
+      fcntl(wakeup_[0], F_SETFL, fcntl(wakeup_[0], F_GETFL, 0) | O_NONBLOCK);
+      fcntl(wakeup_[1], F_SETFL, fcntl(wakeup_[1], F_GETFL, 0) | O_NONBLOCK);
+    }
+#endif
+
+    task_queue_ = &task_queue;
+    running_ = true;
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  // Parked sockets which never become ready are cancelled.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (!running_) { return; }
+      running_ = false;
+    }
+
+    wakeup();
+    thread_.join();
+
+    for (auto &entry : entries_) {
+      entry.cancel();
+    }
+    entries_.clear();
+
+#ifndef _WIN32
+    if (wakeup_[0] != INVALID_SOCKET) {
+      close(wakeup_[0]);
+      close(wakeup_[1]);
+      wakeup_[0] = wakeup_[1] = INVALID_SOCKET;
+    }
+#endif
+    task_queue_ = nullptr;
+  }
+
+  // Enqueues `ready` once `sock` is readable (or writable), or calls `cancel`
+  // when it is not within `timeout_sec` or the loop is not running. `ready`
+  // goes to `task_queue` when given, and to the loop's own queue otherwise.
+  void wait(socket_t sock, bool write, time_t timeout_sec,
+            std::function<void()> ready, std::function<void()> cancel,
+            TaskQueue *task_queue = nullptr) {
+    wait(sock, write,
+         std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec),
+         ready, cancel, task_queue);
+  }
+
+  // Like above, but gives up at `deadline`. Returns an id for cancel_wait(),
+  // or 0 when the loop is not running.
+  uint64_t wait(socket_t sock, bool write,
+                std::chrono::steady_clock::time_point deadline,
+                std::function<void()> ready, std::function<void()> cancel,
+                TaskQueue *task_queue = nullptr) {
+    return wait(std::vector<socket_t>(1, sock), write, deadline, ready, cancel,
+                task_queue);
+  }
+
+  // Like above, for whichever of `socks` is ready first.
+  uint64_t wait(const std::vector<socket_t> &socks, bool write,
+                std::chrono::steady_clock::time_point deadline,
+                std::function<void()> ready, std::function<void()> cancel,
+                TaskQueue *task_queue = nullptr) {
+    uint64_t id = 0;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (running_) {
+        Entry entry;
+        entry.id = id = ++last_id_;
+        entry.socks = socks;
+        entry.write = write;
+        entry.deadline = deadline;
+        entry.ready = ready;
+        entry.cancel = cancel;
+        entry.task_queue = task_queue ? task_queue : task_queue_;
+        entries_.push_back(entry);
+        cancel = nullptr;
+      }
+    }
+
+    if (cancel) {
+      cancel();
+    } else {
+      wakeup();
+    }
+    return id;
+  }
+
+  // Calls `fn` at `deadline`, or right away when the loop is not running.
+  uint64_t schedule(std::chrono::steady_clock::time_point deadline,
+                    std::function<void()> fn) {
+    return wait(std::vector<socket_t>(), false, deadline, nullptr, fn);
+  }
+
+  // Takes the wait `id` out of the loop and calls its `cancel`, unless it has
+  // ended already.
+  void cancel_wait(uint64_t id) {
+    std::function<void()> cancel;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->id == id) {
+          cancel = it->cancel;
+          entries_.erase(it);
+          break;
+        }
+      }
+    }
+
+    if (cancel) { cancel(); }
+  }
+
+  // Enqueues `fn` on the loop's queue right away, or calls `cancel` when the
+  // loop is not running.
+  void post(std::function<void()> fn, std::function<void()> cancel) {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (running_) {
+        task_queue_->enqueue(fn);
+        return;
+      }
+    }
+    cancel();
+  }
+
+private:
+  struct Entry {
+    uint64_t id;
+    std::vector<socket_t> socks;
+    bool write;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void()> ready;
+    std::function<void()> cancel;
+    TaskQueue *task_queue;
+  };
+
+  void wakeup() {
+#ifndef _WIN32
+    if (wakeup_[1] != INVALID_SOCKET) {
+      char c = 0;
+      auto ret = ::write(wakeup_[1], &c, 1);
+      (void)ret;
+    }
+#endif
+  }
+
+  void run() {
+    std::vector<struct pollfd> fds;
+    std::vector<uint64_t> ids;
+
+    for (;;) {
+      auto timeout = std::chrono::milliseconds(1000);
+      auto now = std::chrono::steady_clock::now();
+
+      fds.clear();
+      ids.clear();
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!running_) { break; }
+
+        for (const auto &entry : entries_) {
+          for (auto sock : entry.socks) {
+            struct pollfd fd;
+            fd.fd = sock;
+            fd.events = entry.write ? POLLOUT : POLLIN;
+            fd.revents = 0;
+            fds.push_back(fd);
+            ids.push_back(entry.id);
+          }
+
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+              entry.deadline - now);
+          if (left < timeout) { timeout = left; }
+        }
+      }
+
+      auto count = fds.size();
+
+#ifdef _WIN32
+      // Without a wakeup socket, newly parked sockets are picked up on the
+      // next short timeout.
+      if (timeout > std::chrono::milliseconds(10)) {
+        timeout = std::chrono::milliseconds(10);
+      }
+      if (count > 0) {
+        WSAPoll(fds.data(), static_cast<ULONG>(count),
+                static_cast<INT>(timeout.count()));
+      } else {
+        std::this_thread::sleep_for(timeout);
+      }
+#else
+      if (wakeup_[0] != INVALID_SOCKET) {
+        struct pollfd fd;
+        fd.fd = wakeup_[0];
+        fd.events = POLLIN;
+        fd.revents = 0;
+        fds.push_back(fd);
+      } else if (timeout > std::chrono::milliseconds(10)) {
+        timeout = std::chrono::milliseconds(10);
+      }
+
+      if (timeout.count() < 0) { timeout = std::chrono::milliseconds(0); }
+      poll(fds.data(), static_cast<nfds_t>(fds.size()),
+           static_cast<int>(timeout.count()));
+
+      if (fds.size() > count && fds[count].revents) {
+        char buf[64];
+        while (read(wakeup_[0], buf, sizeof(buf)) > 0) {}
+      }
+#endif
+
+      // Entries may have come and gone meanwhile, so they are matched by
+      // their ids, which grow in the order of `entries_`.
+      std::vector<uint64_t> ready_ids;
+      for (size_t i = 0; i < count; i++) {
+        if (fds[i].revents) { ready_ids.push_back(ids[i]); }
+      }
+
+      std::vector<Entry> ready;
+      std::vector<Entry> expired;
+      now = std::chrono::steady_clock::now();
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        size_t j = 0;
+        for (size_t i = 0; i < entries_.size(); i++) {
+          auto &entry = entries_[i];
+          if (std::binary_search(ready_ids.begin(), ready_ids.end(),
+                                 entry.id)) {
+            ready.push_back(entry);
+          } else if (entry.deadline <= now) {
+            expired.push_back(entry);
+          } else {
+            if (i != j) { entries_[j] = entry; }
+            j++;
+          }
+        }
+        entries_.resize(j);
+      }
+
+      for (auto &entry : ready) {
+        entry.task_queue->enqueue(entry.ready);
+      }
+
+      for (auto &entry : expired) {
+        entry.cancel();
+      }
+    }
+  }
+
+  TaskQueue *task_queue_;
+  bool running_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
+  uint64_t last_id_ = 0;
+#ifndef _WIN32
+  socket_t wakeup_[2];
+#endif
+};
+
+} // namespace detail
+
+struct KeepAliveStats {
+  uint64_t connections = 0;        // Accepted connections
+  uint64_t requests = 0;           // Requests served on all connections
+  uint64_t reused_requests = 0;    // Requests served on a reused connection
+  uint64_t active_connections = 0; // Accepted connections not closed yet
+};
+
 class Server {
 public:
   typedef std::function<void(const Request &, Response &)> Handler;
@@ -417,8 +878,15 @@ public:
   void set_logger(Logger logger);
 
   void set_keep_alive_max_count(size_t count);
+  void set_keep_alive_timeout(time_t sec, time_t usec = 0);
+  // Shortens keep-alive as the connections approach `max_connections`, which
+  // is taken from the task queue's thread count when 0. It has no effect
+  // when neither gives a limit, such as with a thread per connection.
+  void set_adaptive_keep_alive(bool enabled, size_t max_connections = 0);
   void set_payload_max_length(uint64_t length);
 
+  KeepAliveStats get_keep_alive_stats() const;
+
   int bind_to_any_port(const char *host, int socket_flags = 0);
   bool listen_after_bind();
 
@@ -434,8 +902,31 @@ protected:
                        bool &connection_close,
                        std::function<void(Request &)> setup_request);
 
+  void get_keep_alive_policy(size_t &max_count, time_t &sec,
+                             time_t &usec) const;
+  bool is_keep_alive_under_pressure() const;
+  size_t get_keep_alive_capacity() const;
+  void count_request(Request &req, size_t &connection_request_count);
+
+  void handle_request(Request &req, Response &res,
+                      std::function<void(Request &)> setup_request);
+  void prepare_response(const Request &req, Response &res,
+                        std::string &boundary, std::string &content_type);
+  bool write_content_with_provider(Stream &strm, const Request &req,
+                                   Response &res, const std::string &boundary,
+                                   const std::string &content_type);
+
   size_t keep_alive_max_count_;
+  time_t keep_alive_timeout_sec_;
+  time_t keep_alive_timeout_usec_;
+  bool adaptive_keep_alive_;
+  size_t adaptive_keep_alive_max_connections_;
+  std::atomic<size_t> task_queue_thread_count_;
   size_t payload_max_length_;
+  std::atomic<uint64_t> active_connection_count_;
+  detail::ReadinessLoop readiness_loop_;
+  Handler error_handler_;
+  Logger logger_;
 
 private:
   typedef std::vector<std::pair<std::regex, Handler>> Handlers;
@@ -452,14 +943,14 @@ private:
   bool parse_request_line(const char *s, Request &req);
   bool write_response(Stream &strm, bool last_connection, const Request &req,
                       Response &res);
-  bool write_content_with_provider(Stream &strm, const Request &req,
-                                   Response &res, const std::string &boundary,
-                                   const std::string &content_type);
 
   virtual bool read_and_close_socket(socket_t sock);
 
   std::atomic<bool> is_running_;
   std::atomic<socket_t> svr_sock_;
+  std::atomic<uint64_t> connection_count_;
+  std::atomic<uint64_t> request_count_;
+  std::atomic<uint64_t> reused_request_count_;
   std::string base_dir_;
   Handler file_request_handler_;
   Handlers get_handlers_;
@@ -468,8 +959,136 @@ private:
   Handlers patch_handlers_;
   Handlers delete_handlers_;
   Handlers options_handlers_;
-  Handler error_handler_;
-  Logger logger_;
+};
+
+// Fills `addrs` with the addresses of `host` to connect to for `port`.
+typedef std::function<bool(const std::string &host, int port,
+                           std::vector<struct sockaddr_storage> &addrs)>
+    Resolver;
+
+namespace detail {
+struct DnsCacheState;
+struct ClientConnection;
+struct ClientTimeouts;
+struct ClientCancellation;
+struct ClientAsyncCall;
+class ClientAsyncCalls;
+class HedgingPolicy;
+struct CoalescedFetch;
+struct CachedResponse;
+} // namespace detail
+
+// Remembers resolved addresses for `ttl_sec` and failed lookups for
+// `negative_ttl_sec`. Concurrent lookups of the same host wait for a single
+// resolution, and entries close to expiry are refreshed in the background.
+// Without a resolver, getaddrinfo is used.
+class DnsCache {
+public:
+  DnsCache(Resolver resolver = nullptr,
+           time_t ttl_sec = CPPHTTPLIB_DNS_CACHE_TTL_SECOND,
+           time_t negative_ttl_sec = CPPHTTPLIB_DNS_CACHE_NEGATIVE_TTL_SECOND,
+           size_t max_entry_count = CPPHTTPLIB_DNS_CACHE_MAX_ENTRY_COUNT);
+
+  bool resolve(const std::string &host, int port,
+               std::vector<struct sockaddr_storage> &addrs);
+  // Whether resolve() would answer without waiting for a lookup.
+  bool is_cached(const std::string &host, int port);
+  void remove(const std::string &host, int port);
+  void clear();
+
+  // The cache used by clients unless set_dns_cache() says otherwise.
+  static std::shared_ptr<DnsCache> default_instance();
+
+private:
+  std::shared_ptr<detail::DnsCacheState> state_;
+};
+
+// Lets identical GET and HEAD requests in flight at the same time share one
+// fetch: a request waits for the response to the same request from any
+// client using this coalescer instead of going to the server. Waiters whose
+// headers differ in one the response varies on share another fetch.
+class RequestCoalescer {
+public:
+  // Calls `fetch` unless a request with `key` is already in flight.
+  bool send(const std::string &key, const Request &req, Response &res,
+            std::function<bool(Response &res)> fetch);
+
+  // A coalescer for clients to share.
+  static std::shared_ptr<RequestCoalescer> default_instance();
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<std::string, std::shared_ptr<detail::CoalescedFetch>> fetches_;
+};
+
+// Keeps responses to GET requests by the rules of RFC 7234 for a private
+// cache. A stale response with a validator is revalidated with If-None-Match
+// or If-Modified-Since, so that an unchanged one costs a 304 instead of its
+// body. Up to `memory_max_size` bytes of responses are kept in memory, least
+// recently used first out. With a `dir`, each response is also kept in a file
+// there, which outlives the process. Those files take up to `disk_max_size`
+// bytes, and are evicted the same way. A URL has a response for each set of
+// values of the request headers it varies on. Responses to requests with an
+// Authorization or Cookie header are only kept in memory.
+class ResponseCache {
+public:
+  ResponseCache(
+      size_t memory_max_size = CPPHTTPLIB_RESPONSE_CACHE_MEMORY_MAX_SIZE,
+      const std::string &dir = std::string(),
+      size_t disk_max_size = CPPHTTPLIB_RESPONSE_CACHE_DISK_MAX_SIZE);
+
+  // Fills `res` from the response stored under `key` if it is fresh for
+  // `req`. Otherwise `conditions` gets the headers to revalidate it with.
+  bool get(const std::string &key, const Request &req, Response &res,
+           Headers &conditions);
+  // Stores `res` as the response to `req` if it can be cached.
+  void put(const std::string &key, const Request &req, const Response &res);
+  // Updates the response to `req` stored under `key` from the 304 in `res`,
+  // and then fills `res` from it.
+  bool refresh(const std::string &key, const Request &req, Response &res);
+  // Removes the responses for the URL which `url_key` is the key of, whatever
+  // the request headers.
+  void remove(const std::string &url_key);
+
+private:
+  // The response stored under `key` which varies the way `req` does.
+  std::shared_ptr<detail::CachedResponse> find(const std::string &key,
+                                               const Request &req);
+  // Reads the response stored under `key` from the file `name`, and keeps it
+  // in memory as well.
+  std::shared_ptr<detail::CachedResponse> load(const std::string &key,
+                                               const std::string &name);
+  void store(std::shared_ptr<detail::CachedResponse> entry);
+  void save(const detail::CachedResponse &entry);
+  std::string get_path(const std::string &name) const;
+  // Records that the file `name` of `size` bytes was just used, and removes
+  // the least recently used files beyond `disk_max_size_`.
+  void use_file(const std::string &name, size_t size);
+
+  size_t memory_max_size_;
+  std::string dir_;
+  std::mutex mutex_;
+  std::list<std::shared_ptr<detail::CachedResponse>> entries_;
+  // By key and vary_key.
+  std::map<std::pair<std::string, std::string>,
+           std::list<std::shared_ptr<detail::CachedResponse>>::iterator>
+      index_;
+  size_t memory_size_ = 0;
+
+  // The files in `dir_` and their sizes, most recently used first.
+  size_t disk_max_size_;
+  std::mutex disk_mutex_;
+  std::list<std::pair<std::string, size_t>> files_;
+  std::map<std::string, std::list<std::pair<std::string, size_t>>::iterator>
+      file_index_;
+  size_t disk_size_ = 0;
+};
+
+// The outcome of one request sent by Client::send_batch.
+struct BatchResult {
+  std::shared_ptr<Response> response; // nullptr when the request failed
+  std::chrono::steady_clock::duration elapsed;
 };
 
 class Client {
@@ -500,6 +1119,18 @@ public:
                                  const std::string &body,
                                  const char *content_type);
 
+  // Streams `content_length` bytes from `content_provider` as the body.
+  std::shared_ptr<Response>
+  Post(const char *path, uint64_t content_length,
+       std::function<void(uint64_t offset, uint64_t length, Out out)>
+           content_provider,
+       const char *content_type);
+  std::shared_ptr<Response>
+  Post(const char *path, const Headers &headers, uint64_t content_length,
+       std::function<void(uint64_t offset, uint64_t length, Out out)>
+           content_provider,
+       const char *content_type);
+
   std::shared_ptr<Response> Post(const char *path, const Params &params);
   std::shared_ptr<Response> Post(const char *path, const Headers &headers,
                                  const Params &params);
@@ -515,12 +1146,34 @@ public:
                                 const std::string &body,
                                 const char *content_type);
 
+  std::shared_ptr<Response>
+  Put(const char *path, uint64_t content_length,
+      std::function<void(uint64_t offset, uint64_t length, Out out)>
+          content_provider,
+      const char *content_type);
+  std::shared_ptr<Response>
+  Put(const char *path, const Headers &headers, uint64_t content_length,
+      std::function<void(uint64_t offset, uint64_t length, Out out)>
+          content_provider,
+      const char *content_type);
+
   std::shared_ptr<Response> Patch(const char *path, const std::string &body,
                                   const char *content_type);
   std::shared_ptr<Response> Patch(const char *path, const Headers &headers,
                                   const std::string &body,
                                   const char *content_type);
 
+  std::shared_ptr<Response>
+  Patch(const char *path, uint64_t content_length,
+        std::function<void(uint64_t offset, uint64_t length, Out out)>
+            content_provider,
+        const char *content_type);
+  std::shared_ptr<Response>
+  Patch(const char *path, const Headers &headers, uint64_t content_length,
+        std::function<void(uint64_t offset, uint64_t length, Out out)>
+            content_provider,
+        const char *content_type);
+
   std::shared_ptr<Response> Delete(const char *path,
                                    const std::string &body = std::string(),
                                    const char *content_type = nullptr);
@@ -531,24 +1184,206 @@ public:
   std::shared_ptr<Response> Options(const char *path);
   std::shared_ptr<Response> Options(const char *path, const Headers &headers);
 
-  bool send(Request &req, Response &res);
+  virtual bool send(Request &req, Response &res);
+
+  // Sends `req` without blocking the caller. Waiting for the connection and
+  // the response is left to one event loop thread shared by all clients, and
+  // `handler` is called with `res`, or nullptr on failure, from one of its
+  // worker threads. So are `res->progress` and `res->content_receiver`.
+  // Destroying the client cancels its pending requests, which then fail, and
+  // waits until their handlers are called.
+  void send_async(const Request &req, std::shared_ptr<Response> res,
+                  ResponseHandler handler);
+  std::future<std::shared_ptr<Response>>
+  send_async(const Request &req, std::shared_ptr<Response> res);
+
+  std::future<std::shared_ptr<Response>>
+  Get_async(const char *path, Progress progress = nullptr);
+  std::future<std::shared_ptr<Response>>
+  Get_async(const char *path, const Headers &headers,
+            Progress progress = nullptr);
+
+  std::future<std::shared_ptr<Response>>
+  Get_async(const char *path, ContentReceiver content_receiver,
+            Progress progress = nullptr);
+  std::future<std::shared_ptr<Response>>
+  Get_async(const char *path, const Headers &headers,
+            ContentReceiver content_receiver, Progress progress = nullptr);
+
+  std::future<std::shared_ptr<Response>>
+  Post_async(const char *path, const std::string &body,
+             const char *content_type);
+  std::future<std::shared_ptr<Response>>
+  Post_async(const char *path, const Headers &headers,
+             const std::string &body, const char *content_type);
+
+  // Sends `requests` with at most `max_concurrency` of them in flight and
+  // waits for all of them. Results are in the order of `requests`. Only as
+  // many connections as set_keep_alive_max_idle_count() allows are kept for
+  // later requests.
+  std::vector<BatchResult>
+  send_batch(const std::vector<Request> &requests,
+             size_t max_concurrency = CPPHTTPLIB_BATCH_MAX_CONCURRENCY);
+  std::vector<BatchResult>
+  Get_batch(const std::vector<std::string> &paths,
+            const Headers &headers = Headers(),
+            size_t max_concurrency = CPPHTTPLIB_BATCH_MAX_CONCURRENCY);
+
+  // Up to `count` idle connections to the server are kept open for later
+  // requests; 0 closes each connection after its request.
+  void set_keep_alive_max_idle_count(size_t count);
+  void set_keep_alive_idle_timeout(time_t sec);
+
+  // nullptr resolves the host on every new connection.
+  void set_dns_cache(std::shared_ptr<DnsCache> dns_cache);
+
+  // Response bodies are reserved from Content-Length up to `length` bytes, so
+  // a bogus length can't allocate more than that before data arrives.
+  void set_body_reserve_max_length(size_t length);
+
+  // nullptr, the default, sends every request. Only send() and the calls
+  // built on it are coalesced, and only when the response is received into
+  // its body without a progress callback.
+  void set_request_coalescer(std::shared_ptr<RequestCoalescer> coalescer);
+
+  // nullptr, the default, fetches every response. Like coalescing, caching
+  // only applies to send() and the calls built on it, for responses received
+  // into their body. GET requests with a Range or a condition of their own
+  // bypass the cache, and other successful requests remove the responses
+  // cached for their URL.
+  void set_response_cache(std::shared_ptr<ResponseCache> cache);
+
+  // Sends an idempotent request again on another connection when it takes
+  // longer than the `percentile` of recent requests, and takes the first
+  // response. At most `budget` of the requests, such as 0.05 for 5%, are
+  // sent twice. It applies to send() and the calls built on it, for responses
+  // received into their body without a progress callback. The first attempt
+  // runs on the caller's thread, and the second one through the event loop
+  // of send_async().
+  void enable_hedging(bool enabled,
+                      double percentile = CPPHTTPLIB_HEDGING_PERCENTILE,
+                      double budget = CPPHTTPLIB_HEDGING_BUDGET);
+
+  // Each phase of a request gives up after its timeout in milliseconds, and
+  // the request as a whole after the total timeout; 0 waits without limit.
+  // By default connecting takes up to the `timeout_sec` of the constructor,
+  // the TLS handshake CPPHTTPLIB_SSL_HANDSHAKE_TIMEOUT_SECOND, and each read
+  // CPPHTTPLIB_READ_TIMEOUT_SECOND, without a total timeout.
+  void set_connect_timeout(time_t msec);
+  void set_tls_handshake_timeout(time_t msec);
+  // Counts from when the request was written until the response starts.
+  void set_first_byte_timeout(time_t msec);
+  // Counts between the later parts of the response.
+  void set_read_timeout(time_t msec);
+  void set_total_timeout(time_t msec);
+
+  // Derives the timeouts of connecting and of the TLS handshake from the
+  // round-trip time measured for the server. The first-byte timeout only
+  // shrinks to ten times how long its responses usually take to start, and
+  // no less than 3 seconds. The timeouts set above then become upper bounds,
+  // and apply as they are until enough has been measured.
+  void enable_adaptive_timeouts(bool enabled);
 
 protected:
+  // `cancellation`, when given, lets another thread end the request early.
+  virtual bool send_request(Request &req, Response &res,
+                            detail::ClientCancellation *cancellation);
+  // Fills in the DNS and connect times of `timing`.
+  socket_t create_client_socket(const detail::ClientTimeouts &timeouts,
+                                ResponseTiming &timing) const;
+  bool resolve_host(std::vector<struct sockaddr_storage> &addrs,
+                    ResponseTiming &timing) const;
+  // Updates the round-trip times and the DNS cache after an attempt to
+  // connect within `timeout_msec`, which took `elapsed`.
+  void record_connect(socket_t sock, const detail::ClientTimeouts &timeouts,
+                      time_t timeout_msec,
+                      std::chrono::steady_clock::duration elapsed) const;
+  detail::ClientTimeouts get_timeouts() const;
+  // Calls `fn` with each header which the request needs but `req` lacks,
+  // leaving `req` untouched.
+  void for_each_default_header(
+      const Request &req, bool close_connection,
+      std::function<void(const std::string &key, const std::string &val)> fn)
+      const;
+  Headers get_default_headers(const Request &req) const;
+  void write_request(Stream &strm, const Request &req, bool close_connection);
   bool process_request(Stream &strm, Request &req, Response &res,
-                       bool &connection_close);
+                       bool &connection_close, bool request_sent = false);
+  void release_connection(detail::ClientConnection &conn,
+                          bool connection_close);
+  std::shared_ptr<Response> send_with_content_provider(
+      const char *method, const char *path, const Headers &headers,
+      uint64_t content_length,
+      std::function<void(uint64_t offset, uint64_t length, Out out)>
+          content_provider,
+      const char *content_type);
+
+  // Run on the event loop's workers.
+  virtual void start_async(std::shared_ptr<detail::ClientAsyncCall> call);
+  // Takes a call on once its socket has connected.
+  virtual void async_connected(std::shared_ptr<detail::ClientAsyncCall> call);
+  // Writes the request unless it went out while connecting, and waits for
+  // the response.
+  void write_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                   bool request_sent);
+  // Waits in the readiness loop until one of `socks` is ready, and then runs
+  // `ready` on a worker, or `expired` once `deadline` passes or the call is
+  // cancelled.
+  void wait_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                  const std::vector<socket_t> &socks, bool write,
+                  std::chrono::steady_clock::time_point deadline,
+                  std::function<void()> ready, std::function<void()> expired);
 
   const std::string host_;
   const int port_;
-  time_t timeout_sec_;
   const std::string host_and_port_;
+  time_t connect_timeout_msec_;
+  time_t tls_handshake_timeout_msec_;
+  time_t first_byte_timeout_msec_;
+  time_t read_timeout_msec_;
+  time_t total_timeout_msec_;
+  bool adaptive_timeouts_;
+  size_t keep_alive_max_idle_count_;
+  time_t keep_alive_idle_timeout_sec_;
+  std::shared_ptr<DnsCache> dns_cache_;
+  size_t body_reserve_max_length_;
+  std::shared_ptr<RequestCoalescer> request_coalescer_;
+  std::shared_ptr<ResponseCache> response_cache_;
+  std::shared_ptr<detail::HedgingPolicy> hedging_;
+  std::shared_ptr<detail::ClientAsyncCalls> async_calls_;
 
 private:
-  socket_t create_client_socket() const;
+  bool send_cached(Request &req, Response &res);
+  bool send_coalesced(Request &req, Response &res);
+  bool send_hedged(Request &req, Response &res);
   bool read_response_line(Stream &strm, Response &res);
-  void write_request(Stream &strm, Request &req);
-
-  virtual bool read_and_close_socket(socket_t sock, Request &req,
-                                     Response &res);
+  // `sent_at` is when the request went out, if `request_sent`.
+  bool process_connection(detail::ClientConnection &conn, Request &req,
+                          Response &res, bool &connection_close,
+                          bool request_sent,
+                          const detail::ClientTimeouts &timeouts,
+                          std::chrono::steady_clock::time_point sent_at);
+  template <typename T>
+  bool process_stream(T &strm, Request &req, Response &res,
+                      bool &connection_close, bool request_sent,
+                      std::chrono::steady_clock::time_point &sent_at,
+                      std::chrono::steady_clock::time_point &first_byte_time);
+  // Registers `call` with the client and starts it on a worker.
+  void enqueue_async(std::shared_ptr<detail::ClientAsyncCall> call);
+  void connect_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                     const std::vector<struct sockaddr_storage> &addrs);
+  void step_connect_async(std::shared_ptr<detail::ClientAsyncCall> call);
+  void finish_async(std::shared_ptr<detail::ClientAsyncCall> call);
+  // Lets later timeouts grow after the first byte was awaited in vain.
+  void back_off_first_byte(const detail::ClientTimeouts &timeouts,
+                           std::chrono::steady_clock::time_point sent_at);
+
+  // Opens a new connection for `req`. `request_sent` is set when the request
+  // already went out while the connection was set up.
+  virtual bool open_connection(detail::ClientConnection &conn, Request &req,
+                               bool close_connection, bool &request_sent,
+                               const detail::ClientTimeouts &timeouts);
+  virtual std::string connection_pool_key() const;
   virtual bool is_ssl() const;
 };
 
@@ -564,11 +1399,68 @@ public:
   virtual int write(const std::string &s);
   virtual std::string get_remote_addr() const;
 
+  // True when data can be read without waiting for the socket.
+  bool has_pending_data() const;
+
+  // Serves `data`, such as TLS early data, before reading the connection.
+  void preload(const std::string &data);
+
+  void enable_dynamic_record_sizing(bool enabled);
+
+  // Reads wait up to `first_byte_msec` for the first byte and `msec` for
+  // each later one, but never past `deadline`; 0 waits without limit.
+  void set_read_timeout(time_t first_byte_msec, time_t msec,
+                        std::chrono::steady_clock::time_point deadline);
+
+  // When the first byte was read, or the clock's epoch until then.
+  std::chrono::steady_clock::time_point get_first_byte_time() const;
+
+  uint64_t get_bytes_read() const;
+  uint64_t get_bytes_written() const;
+
 private:
   socket_t sock_;
   SSL *ssl_;
+  time_t first_byte_timeout_msec_ = CPPHTTPLIB_READ_TIMEOUT_SECOND * 1000 +
+                                    CPPHTTPLIB_READ_TIMEOUT_USECOND / 1000;
+  time_t read_timeout_msec_ = first_byte_timeout_msec_;
+  std::chrono::steady_clock::time_point deadline_ =
+      (std::chrono::steady_clock::time_point::max)();
+  std::chrono::steady_clock::time_point first_byte_time_;
+  uint64_t bytes_read_ = 0;
+  uint64_t bytes_written_ = 0;
+  std::vector<char> read_buff_;
+  size_t read_buff_off_ = 0;
+  size_t read_buff_content_size_ = 0;
+  bool dynamic_record_sizing_ = false;
+  bool read_since_write_ = true;
+  size_t written_since_reset_ = 0;
+  std::chrono::steady_clock::time_point last_write_;
+};
+
+typedef std::function<void(const std::string &id, const std::string &session)>
+    SSLSessionStore;
+
+typedef std::function<bool(const std::string &id, std::string &session)>
+    SSLSessionLookup;
+
+typedef std::function<void(const std::string &id)> SSLSessionRemove;
+
+namespace detail {
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+class Http2ClientSession;
+#endif
+
+struct SSLTicketKey {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+  time_t created;
 };
 
+} // namespace detail
+
 class SSLServer : public Server {
 public:
   SSLServer(const char *cert_path, const char *private_key_path,
@@ -579,11 +1471,112 @@ public:
 
   virtual bool is_valid() const;
 
+  // Size 0 disables the in-process session cache, and with it early data
+  // unless an external cache removes sessions (see set_max_early_data).
+  void set_session_cache(long size, long timeout_sec =
+                                        CPPHTTPLIB_SSL_SESSION_TIMEOUT_SECOND);
+  void enable_session_tickets(bool enabled);
+  // Interval 0 keeps OpenSSL's fixed per-context ticket key.
+  void set_session_ticket_key_rotation(time_t interval_sec,
+                                       size_t retired_key_count = 1);
+  // The callbacks may run on several worker threads at once.
+  void set_external_session_cache(SSLSessionStore store,
+                                  SSLSessionLookup lookup,
+                                  SSLSessionRemove remove = nullptr);
+
+  // Runs handshakes, and so their private key operations, on a separate pool
+  // of `thread_count` threads, so that the request workers keep serving
+  // established connections during handshake bursts.
+  void enable_crypto_thread_pool(
+      size_t thread_count = CPPHTTPLIB_CRYPTO_THREAD_POOL_COUNT);
+
+  // Sends the start of each response in small TLS records (off by default).
+  // Clients can then use the first bytes of a body without waiting for a
+  // full 16 KB record, while large bodies take a little longer overall.
+  // Turning it on also sets TCP_NODELAY on the connections.
+  void enable_dynamic_record_sizing(bool enabled);
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  // Advertises h2 through ALPN (on by default).
+  void enable_http2(bool enabled);
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // Accepts up to `size` bytes of TLS 1.3 early data from resuming clients;
+  // 0 (the default) refuses it. Early data is only served when it holds a
+  // single GET, HEAD or OPTIONS request, and other requests get 425.
+  // NOTE: Replays are refused by resuming each session at most once, which
+  // needs the session cache. An external cache must remove sessions in its
+  // `remove` callback to extend this across processes. Without either, early
+  // data is refused whatever `size` is.
+  void set_max_early_data(uint32_t size);
+#endif
+
 private:
   virtual bool read_and_close_socket(socket_t sock);
 
+  // `deadline` bounds the whole handshake, however many waits it takes.
+  bool accept_and_close_socket(socket_t sock, SSL *ssl,
+                               std::chrono::steady_clock::time_point deadline);
+  bool process_and_close_socket(socket_t sock, SSL *ssl);
+  void close_socket(socket_t sock, SSL *ssl);
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  bool process_http2(socket_t sock, SSL *ssl);
+
+  static int alpn_select_callback(SSL *ssl, const unsigned char **out,
+                                  unsigned char *outlen,
+                                  const unsigned char *in, unsigned int inlen,
+                                  void *arg);
+#endif
+
+  bool rotate_session_ticket_keys();
+
+  static int new_session_callback(SSL *ssl, SSL_SESSION *session);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  static SSL_SESSION *get_session_callback(SSL *ssl, unsigned char *id,
+                                           int id_len, int *copy);
+#else
+  static SSL_SESSION *get_session_callback(SSL *ssl, const unsigned char *id,
+                                           int id_len, int *copy);
+#endif
+  static void remove_session_callback(SSL_CTX *ctx, SSL_SESSION *session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                 unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+                                 EVP_MAC_CTX *hmac_ctx, int enc);
+#else
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                 unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+                                 HMAC_CTX *hmac_ctx, int enc);
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  int accept_with_early_data(SSL *ssl);
+  void update_max_early_data();
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  static int allow_early_data_callback(SSL *ssl, void *arg);
+#endif
+#endif
+
   SSL_CTX *ctx_;
-  std::mutex ctx_mutex_;
+  SSLSessionStore session_store_;
+  SSLSessionLookup session_lookup_;
+  SSLSessionRemove session_remove_;
+  bool session_cache_enabled_ = false;
+  std::mutex ticket_keys_mutex_;
+  std::vector<detail::SSLTicketKey> ticket_keys_; // Newest first
+  time_t ticket_key_rotation_interval_ = 0;
+  size_t retired_ticket_key_count_ = 1;
+  std::unique_ptr<TaskQueue> crypto_queue_;
+  bool dynamic_record_sizing_ = false;
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  bool http2_ = true;
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  uint32_t max_early_data_ = 0;
+#endif
 };
 
 class SSLClient : public Client {
@@ -600,25 +1593,89 @@ public:
                         const char *ca_cert_dir_path = nullptr);
   void enable_server_certificate_verification(bool enabled);
 
+  // CA certificates are read once and shared by every client with the same
+  // paths. This re-reads them for the connections made from now on.
+  static bool reload_ca_certs();
+
+  // Resumes TLS sessions from earlier connections to the same server with
+  // the same TLS settings (on by default).
+  void enable_session_resumption(bool enabled);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // Sends GET and HEAD requests as TLS 1.3 early data when a new HTTP/1.1
+  // connection resumes a session that allows it, saving a round trip. Off by
+  // default, since early data can be replayed by an attacker.
+  void enable_early_data(bool enabled);
+#endif
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  // Negotiates h2 through ALPN and multiplexes concurrent requests over one
+  // connection (on by default).
+  void enable_http2(bool enabled);
+#endif
+
   long get_openssl_verify_result() const;
 
 private:
-  virtual bool read_and_close_socket(socket_t sock, Request &req,
-                                     Response &res);
+  virtual bool send_request(Request &req, Response &res,
+                            detail::ClientCancellation *cancellation);
+  virtual bool open_connection(detail::ClientConnection &conn, Request &req,
+                               bool close_connection, bool &request_sent,
+                               const detail::ClientTimeouts &timeouts);
+  virtual std::string connection_pool_key() const;
   virtual bool is_ssl() const;
 
+  bool open_ssl_connection(detail::ClientConnection &conn, bool http2,
+                           const detail::ClientTimeouts &timeouts,
+                           const std::string *early_data = nullptr,
+                           bool *early_data_accepted = nullptr);
+  // Sets up the TLS client for `sock`. `early_data` is reset when the session
+  // to be resumed can't take it.
+  SSL *create_ssl(socket_t sock, bool http2, const std::string *&early_data);
+  bool connect_and_verify(SSL *ssl, socket_t sock, time_t timeout_msec,
+                          const std::string *early_data,
+                          bool *early_data_accepted);
+  // Checks the server once the handshake is done.
+  bool verify_connection(SSL *ssl, const std::string *early_data,
+                         bool *early_data_accepted);
+
+  virtual void async_connected(std::shared_ptr<detail::ClientAsyncCall> call);
+  void step_handshake_async(std::shared_ptr<detail::ClientAsyncCall> call);
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  std::shared_ptr<detail::Http2ClientSession>
+  get_http2_session(bool &fallback, const detail::ClientTimeouts &timeouts);
+  // Whether get_http2_session() would return without connecting.
+  bool is_http2_session_ready();
+  virtual void start_async(std::shared_ptr<detail::ClientAsyncCall> call);
+  void send_http2_async(std::shared_ptr<detail::ClientAsyncCall> call);
+#endif
+
   bool verify_host(X509 *server_cert) const;
   bool verify_host_with_subject_alt_name(X509 *server_cert) const;
   bool verify_host_with_common_name(X509 *server_cert) const;
   bool check_host_name(const char *pattern, size_t pattern_len) const;
 
+  static int new_session_callback(SSL *ssl, SSL_SESSION *session);
+
   SSL_CTX *ctx_;
-  std::mutex ctx_mutex_;
   std::vector<std::string> host_components_;
+  std::string client_cert_path_;
+  std::string client_key_path_;
   std::string ca_cert_file_path_;
   std::string ca_cert_dir_path_;
   bool server_certificate_verification_ = false;
   long verify_result_ = 0;
+  bool session_resumption_ = true;
+  bool early_data_ = false;
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  bool http2_ = true;
+  bool http2_unsupported_ = false;
+  bool http2_connecting_ = false;
+  std::mutex http2_mutex_;
+  std::condition_variable http2_cond_;
+  std::shared_ptr<detail::Http2ClientSession> http2_session_;
+#endif
 };
 #endif
 
@@ -887,56 +1944,94 @@ inline int close_socket(socket_t sock) {
 #endif
 }
 
-inline int select_read(socket_t sock, time_t sec, time_t usec) {
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
+// Waits up to `msec` for `events` on `sock`, or without limit when `msec` is
+// negative. Unlike select(), poll() works for any socket number, also beyond
+// FD_SETSIZE.
+inline int poll_sockets(struct pollfd *fds, size_t count, time_t msec) {
+  auto timeout = msec < 0 ? -1 : static_cast<int>(msec);
+#ifdef _WIN32
+  return WSAPoll(fds, static_cast<ULONG>(count), timeout);
+#else
+  int ret;
+  do {
+    ret = poll(fds, static_cast<nfds_t>(count), timeout);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+#endif
+}
+
+inline int poll_socket(socket_t sock, short events, short &revents,
+                       time_t msec) {
+  struct pollfd fd;
+  fd.fd = sock;
+  fd.events = events;
+  fd.revents = 0;
 
-  timeval tv;
-  tv.tv_sec = static_cast<long>(sec);
-  tv.tv_usec = static_cast<long>(usec);
+  auto ret = poll_sockets(&fd, 1, msec);
+  revents = fd.revents;
+  return ret;
+}
 
-  return select(static_cast<int>(sock + 1), &fds, nullptr, nullptr, &tv);
+inline int select_read(socket_t sock, time_t sec, time_t usec) {
+  short revents;
+  return poll_socket(sock, POLLIN, revents, sec * 1000 + (usec + 999) / 1000);
 }
 
-inline bool wait_until_socket_is_ready(socket_t sock, time_t sec, time_t usec) {
-  fd_set fdsr;
-  FD_ZERO(&fdsr);
-  FD_SET(sock, &fdsr);
+// Waits up to `msec` for `sock` to be readable, or writable when `write` is
+// set; 0 waits without limit.
+inline int select_msec(socket_t sock, bool write, time_t msec) {
+  short revents;
+  return poll_socket(sock, write ? POLLOUT : POLLIN, revents,
+                     msec ? msec : -1);
+}
 
-  auto fdsw = fdsr;
-  auto fdse = fdsr;
+// The part of `msec` which is left before `deadline`, where 0 is without
+// limit, or -1 once the deadline has passed.
+inline time_t
+get_remaining_msec(time_t msec,
+                   std::chrono::steady_clock::time_point deadline) {
+  if (deadline == (std::chrono::steady_clock::time_point::max)()) {
+    return msec;
+  }
 
-  timeval tv;
-  tv.tv_sec = static_cast<long>(sec);
-  tv.tv_usec = static_cast<long>(usec);
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  deadline - std::chrono::steady_clock::now())
+                  .count();
+  if (left <= 0) { return -1; }
+  return msec && msec < left ? msec : static_cast<time_t>(left);
+}
 
-  if (select(static_cast<int>(sock + 1), &fdsr, &fdsw, &fdse, &tv) < 0) {
-    return false;
-  } else if (FD_ISSET(sock, &fdsr) || FD_ISSET(sock, &fdsw)) {
-    int error = 0;
-    socklen_t len = sizeof(error);
-    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len) < 0 ||
-        error) {
-      return false;
-    }
-  } else {
+inline bool wait_readable(socket_t sock, time_t msec,
+                          std::chrono::steady_clock::time_point deadline) {
+  auto left = get_remaining_msec(msec, deadline);
+  return left >= 0 && select_msec(sock, false, left) > 0;
+}
+
+inline bool wait_until_socket_is_ready(socket_t sock, time_t sec, time_t usec) {
+  short revents;
+  if (poll_socket(sock, POLLIN | POLLOUT, revents,
+                  sec * 1000 + (usec + 999) / 1000) <= 0) {
     return false;
   }
 
-  return true;
+  // A failed connect shows up as an error or hang-up, or as being writable.
+  int error = 0;
+  socklen_t len = sizeof(error);
+  return getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == 0 &&
+         !error;
 }
 
 template <typename T>
 inline bool read_and_close_socket(socket_t sock, size_t keep_alive_max_count,
-                                  T callback) {
+                                  time_t keep_alive_timeout_sec,
+                                  time_t keep_alive_timeout_usec, T callback) {
   bool ret = false;
 
   if (keep_alive_max_count > 0) {
     auto count = keep_alive_max_count;
     while (count > 0 &&
-           detail::select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                               CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0) {
+           detail::select_read(sock, keep_alive_timeout_sec,
+                               keep_alive_timeout_usec) > 0) {
       SocketStream strm(sock);
       auto last_connection = count == 1;
       auto connection_close = false;
@@ -964,9 +2059,7 @@ inline int shutdown_socket(socket_t sock) {
 #endif
 }
 
-template <typename Fn>
-socket_t create_socket(const char *host, int port, Fn fn,
-                       int socket_flags = 0) {
+inline socket_t open_socket(int family, int socktype, int protocol) {
 #ifdef _WIN32
 #define SO_SYNCHRONOUS_NONALERT 0x20
 #define SO_OPENTYPE 0x7008
@@ -974,8 +2067,43 @@ socket_t create_socket(const char *host, int port, Fn fn,
   int opt = SO_SYNCHRONOUS_NONALERT;
   setsockopt(INVALID_SOCKET, SOL_SOCKET, SO_OPENTYPE, (char *)&opt,
              sizeof(opt));
+
+  auto sock = WSASocketW(family, socktype, protocol, nullptr, 0,
+                         WSA_FLAG_NO_HANDLE_INHERIT);
+#else
+  auto sock = socket(family, socktype, protocol);
+#endif
+  if (sock == INVALID_SOCKET) { return INVALID_SOCKET; }
+
+#ifndef _WIN32
+  if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+    close_socket(sock);
+    return INVALID_SOCKET;
+  }
+#endif
+
+  // Make 'reuse address' option available
+  int yes = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&yes, sizeof(yes));
+#endif
+  // Headers and body go out in separate writes; on a kept-alive connection
+  // Nagle's algorithm would hold the body back for a delayed ACK.
+  if (CPPHTTPLIB_TCP_NODELAY) {
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&yes, sizeof(yes));
+  }
+#ifdef SO_NOSIGPIPE
+  // A write to a reused connection the peer has closed must not kill us.
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, (char *)&yes, sizeof(yes));
 #endif
 
+  return sock;
+}
+
+template <typename Fn>
+socket_t create_socket(const char *host, int port, Fn fn,
+                       int socket_flags = 0) {
   // Get address info
   struct addrinfo hints;
   struct addrinfo *result;
@@ -994,25 +2122,9 @@ socket_t create_socket(const char *host, int port, Fn fn,
 
   for (auto rp = result; rp; rp = rp->ai_next) {
     // Create a socket
-#ifdef _WIN32
-    auto sock = WSASocketW(rp->ai_family, rp->ai_socktype, rp->ai_protocol,
-                           nullptr, 0, WSA_FLAG_NO_HANDLE_INHERIT);
-#else
-    auto sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-#endif
+    auto sock = open_socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
     if (sock == INVALID_SOCKET) { continue; }
 
-#ifndef _WIN32
-    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) { continue; }
-#endif
-
-    // Make 'reuse address' option available
-    int yes = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&yes, sizeof(yes));
-#ifdef SO_REUSEPORT
-    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&yes, sizeof(yes));
-#endif
-
     // bind or connect
     if (fn(sock, *rp)) {
       freeaddrinfo(result);
@@ -1026,6 +2138,40 @@ socket_t create_socket(const char *host, int port, Fn fn,
   return INVALID_SOCKET;
 }
 
+inline bool resolve_address(const std::string &host, int port,
+                            std::vector<struct sockaddr_storage> &addrs) {
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = 0;
+
+  auto service = std::to_string(port);
+
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result)) {
+    return false;
+  }
+
+  for (auto rp = result; rp; rp = rp->ai_next) {
+    if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) { continue; }
+
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, rp->ai_addr, rp->ai_addrlen);
+    addrs.push_back(addr);
+  }
+
+  freeaddrinfo(result);
+  return !addrs.empty();
+}
+
+inline socklen_t sockaddr_length(const struct sockaddr_storage &addr) {
+  return addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                    : sizeof(struct sockaddr_in);
+}
+
 inline void set_nonblocking(socket_t sock, bool nonblocking) {
 #ifdef _WIN32
   auto flags = nonblocking ? 1UL : 0UL;
@@ -1045,2185 +2191,7851 @@ inline bool is_connection_error() {
 #endif
 }
 
-inline std::string get_remote_addr(socket_t sock) {
-  struct sockaddr_storage addr;
-  socklen_t len = sizeof(addr);
-
-  if (!getpeername(sock, (struct sockaddr *)&addr, &len)) {
-    char ipstr[NI_MAXHOST];
+// Alternates address families, starting with the family of the first
+// address (RFC 8305 section 4).
+inline std::vector<struct sockaddr_storage>
+interleave_address_families(const std::vector<struct sockaddr_storage> &addrs) {
+  if (addrs.empty()) { return addrs; }
 
-    if (!getnameinfo((struct sockaddr *)&addr, len, ipstr, sizeof(ipstr),
-                     nullptr, 0, NI_NUMERICHOST)) {
-      return ipstr;
+  std::vector<struct sockaddr_storage> preferred;
+  std::vector<struct sockaddr_storage> others;
+  for (const auto &addr : addrs) {
+    if (addr.ss_family == addrs[0].ss_family) {
+      preferred.push_back(addr);
+    } else {
+      others.push_back(addr);
     }
   }
 
-  return std::string();
-}
-
-inline const char *find_content_type(const std::string &path) {
-  auto ext = file_extension(path);
-  if (ext == "txt") {
-    return "text/plain";
-  } else if (ext == "html") {
-    return "text/html";
-  } else if (ext == "css") {
-    return "text/css";
-  } else if (ext == "jpeg" || ext == "jpg") {
-    return "image/jpg";
-  } else if (ext == "png") {
-    return "image/png";
-  } else if (ext == "gif") {
-    return "image/gif";
-  } else if (ext == "svg") {
-    return "image/svg+xml";
-  } else if (ext == "ico") {
-    return "image/x-icon";
-  } else if (ext == "json") {
-    return "application/json";
-  } else if (ext == "pdf") {
-    return "application/pdf";
-  } else if (ext == "js") {
-    return "application/javascript";
-  } else if (ext == "xml") {
-    return "application/xml";
-  } else if (ext == "xhtml") {
-    return "application/xhtml+xml";
+  std::vector<struct sockaddr_storage> result;
+  for (size_t i = 0; i < preferred.size() || i < others.size(); i++) {
+    if (i < preferred.size()) { result.push_back(preferred[i]); }
+    if (i < others.size()) { result.push_back(others[i]); }
   }
-  return nullptr;
+  return result;
 }
 
-inline const char *status_message(int status) {
-  switch (status) {
-  case 200: return "OK";
-  case 206: return "Partial Content";
-  case 301: return "Moved Permanently";
-  case 302: return "Found";
-  case 303: return "See Other";
-  case 304: return "Not Modified";
-  case 400: return "Bad Request";
-  case 403: return "Forbidden";
-  case 404: return "Not Found";
-  case 413: return "Payload Too Large";
-  case 414: return "Request-URI Too Long";
-  case 415: return "Unsupported Media Type";
-  case 416: return "Range Not Satisfiable";
+// Lets another thread end a client request early. While the request waits on
+// sockets, cancelling shuts them down, which ends the wait; while it waits
+// anywhere else, such as in the readiness loop, `interrupt` is called.
+struct ClientCancellation {
+  std::mutex mutex;
+  bool cancelled = false;
+  std::vector<socket_t> socks;
+  std::function<void()> interrupt;
+};
 
-  default:
-  case 500: return "Internal Server Error";
+inline void cancel_request(ClientCancellation &cancellation) {
+  std::function<void()> interrupt;
+  {
+    std::lock_guard<std::mutex> guard(cancellation.mutex);
+    cancellation.cancelled = true;
+    for (auto sock : cancellation.socks) {
+      shutdown_socket(sock);
+    }
+    interrupt.swap(cancellation.interrupt);
   }
-}
 
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-inline bool can_compress(const std::string &content_type) {
-  return !content_type.find("text/") || content_type == "image/svg+xml" ||
-         content_type == "application/javascript" ||
-         content_type == "application/json" ||
-         content_type == "application/xml" ||
-         content_type == "application/xhtml+xml";
+  if (interrupt) { interrupt(); }
 }
 
-inline bool compress(std::string &content) {
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-
-  auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
-                          Z_DEFAULT_STRATEGY);
-  if (ret != Z_OK) { return false; }
-
-  strm.avail_in = content.size();
-  strm.next_in = (Bytef *)content.data();
-
-  std::string compressed;
+// The functions below do nothing for a request without `cancellation`.
+inline bool is_cancelled(ClientCancellation *cancellation) {
+  if (!cancellation) { return false; }
+  std::lock_guard<std::mutex> guard(cancellation->mutex);
+  return cancellation->cancelled;
+}
 
-  const auto bufsiz = 16384;
-  char buff[bufsiz];
-  do {
-    strm.avail_out = bufsiz;
-    strm.next_out = (Bytef *)buff;
-    ret = deflate(&strm, Z_FINISH);
-    assert(ret != Z_STREAM_ERROR);
-    compressed.append(buff, bufsiz - strm.avail_out);
-  } while (strm.avail_out == 0);
+// Has cancel_request() shut down `socks` until unwatch_sockets(). Fails if
+// the request was cancelled already.
+inline bool watch_sockets(ClientCancellation *cancellation,
+                          const std::vector<socket_t> &socks) {
+  if (!cancellation) { return true; }
+  std::lock_guard<std::mutex> guard(cancellation->mutex);
+  if (cancellation->cancelled) { return false; }
+  cancellation->socks = socks;
+  return true;
+}
 
-  assert(ret == Z_STREAM_END);
-  assert(strm.avail_in == 0);
+inline bool watch_socket(ClientCancellation *cancellation, socket_t sock) {
+  return watch_sockets(cancellation, std::vector<socket_t>(1, sock));
+}
 
-  content.swap(compressed);
+// Fails if the request was cancelled meanwhile. The sockets may be shut down
+// then.
+inline bool unwatch_sockets(ClientCancellation *cancellation) {
+  if (!cancellation) { return true; }
+  std::lock_guard<std::mutex> guard(cancellation->mutex);
+  cancellation->socks.clear();
+  return !cancellation->cancelled;
+}
 
-  deflateEnd(&strm);
+// Has cancel_request() call `interrupt` until clear_interrupt(). Fails if the
+// request was cancelled already.
+inline bool set_interrupt(ClientCancellation *cancellation,
+                          std::function<void()> interrupt) {
+  if (!cancellation) { return true; }
+  std::lock_guard<std::mutex> guard(cancellation->mutex);
+  if (cancellation->cancelled) { return false; }
+  cancellation->interrupt = interrupt;
   return true;
 }
 
-class decompressor {
+inline void clear_interrupt(ClientCancellation *cancellation) {
+  if (!cancellation) { return; }
+  std::lock_guard<std::mutex> guard(cancellation->mutex);
+  cancellation->interrupt = nullptr;
+}
+
+// Connects to the first address to answer (RFC 8305 "Happy Eyeballs"). A new
+// attempt starts whenever the previous one fails or hasn't succeeded within
+// `attempt_delay_msec`, and the earlier attempts keep running alongside it.
+// The first established connection wins; the others are closed. A
+// `timeout_msec` of 0 waits without limit. Nothing here blocks: the caller
+// waits for the sockets in between steps.
+class ConnectionAttempts {
 public:
-  decompressor() {
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+  ConnectionAttempts(const std::vector<struct sockaddr_storage> &addrs,
+                     time_t timeout_msec, time_t attempt_delay_msec)
+      : addrs_(interleave_address_families(addrs)),
+        attempt_delay_msec_(attempt_delay_msec), next_(0),
+        sock_(INVALID_SOCKET) {
+    auto now = std::chrono::steady_clock::now();
+    deadline_ = timeout_msec
+                    ? now + std::chrono::milliseconds(timeout_msec)
+                    : (std::chrono::steady_clock::time_point::max)();
+    next_attempt_ = now;
+  }
 
-    // 15 is the value of wbits, which should be at the maximum possible value
-    // to ensure that any gzip stream can be decoded. The offset of 16 specifies
-    // that the stream to decompress will be formatted with a gzip wrapper.
-    is_valid_ = inflateInit2(&strm, 16 + 15) == Z_OK;
+  ConnectionAttempts(const ConnectionAttempts &) = delete;
+
+  ~ConnectionAttempts() {
+    close_pending();
+    if (sock_ != INVALID_SOCKET) { close_socket(sock_); }
   }
 
-  ~decompressor() { inflateEnd(&strm); }
+  // Starts the attempts which are due and takes in those which have
+  // finished. Returns true once it's over, and take() then has the
+  // connection, if any. Until then, the caller waits for one of `pending()`
+  // to be writable, but not past get_wake_time().
+  bool step() {
+    for (;;) {
+      if (!collect() || sock_ != INVALID_SOCKET) { break; }
 
-  bool is_valid() const { return is_valid_; }
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline_) { break; }
 
-  template <typename T>
-  bool decompress(const char *data, size_t data_length, T callback) {
-    int ret = Z_OK;
+      if (next_ < addrs_.size() && (now >= next_attempt_ || pending_.empty())) {
+        start(now);
+        continue;
+      }
 
-    strm.avail_in = data_length;
-    strm.next_in = (Bytef *)data;
+      if (!pending_.empty()) { return false; }
+      break;
+    }
 
-    const auto bufsiz = 16384;
-    char buff[bufsiz];
-    do {
-      strm.avail_out = bufsiz;
-      strm.next_out = (Bytef *)buff;
+    close_pending();
+    return true;
+  }
 
-      ret = inflate(&strm, Z_NO_FLUSH);
-      assert(ret != Z_STREAM_ERROR);
-      switch (ret) {
-      case Z_NEED_DICT:
-      case Z_DATA_ERROR:
-      case Z_MEM_ERROR: inflateEnd(&strm); return false;
-      }
+  socket_t take() {
+    auto sock = sock_;
+    sock_ = INVALID_SOCKET;
+    if (sock != INVALID_SOCKET) { set_nonblocking(sock, false); }
+    return sock;
+  }
 
-      if (!callback(buff, bufsiz - strm.avail_out)) { return false; }
-    } while (strm.avail_out == 0);
+  const std::vector<socket_t> &pending() const { return pending_; }
 
-    return ret == Z_STREAM_END;
+  std::chrono::steady_clock::time_point get_wake_time() const {
+    auto until = deadline_;
+    if (next_ < addrs_.size() && next_attempt_ < until) {
+      until = next_attempt_;
+    }
+    return until;
   }
 
 private:
-  bool is_valid_;
-  z_stream strm;
-};
-#endif
+  void start(std::chrono::steady_clock::time_point now) {
+    const auto &addr = addrs_[next_++];
+    next_attempt_ = now + std::chrono::milliseconds(attempt_delay_msec_);
+
+    auto s = open_socket(addr.ss_family, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) { return; }
+
+    set_nonblocking(s, true);
+    auto ret = connect(s, reinterpret_cast<const struct sockaddr *>(&addr),
+                       sockaddr_length(addr));
+    if (ret == 0) {
+      sock_ = s;
+    } else if (is_connection_error()) {
+      close_socket(s);
+    } else {
+      pending_.push_back(s);
+    }
+  }
 
-inline bool has_header(const Headers &headers, const char *key) {
-  return headers.find(key) != headers.end();
-}
+  // Fails when the sockets can't be polled.
+  bool collect() {
+    if (pending_.empty()) { return true; }
 
-inline const char *get_header_value(const Headers &headers, const char *key,
-                                    size_t id = 0, const char *def = nullptr) {
-  auto it = headers.find(key);
-  std::advance(it, id);
-  if (it != headers.end()) { return it->second.c_str(); }
-  return def;
-}
+    std::vector<struct pollfd> fds(pending_.size());
+    for (size_t i = 0; i < pending_.size(); i++) {
+      fds[i].fd = pending_[i];
+      fds[i].events = POLLOUT;
+      fds[i].revents = 0;
+    }
 
-inline uint64_t get_header_value_uint64(const Headers &headers, const char *key,
-                                        int def = 0) {
-  auto it = headers.find(key);
-  if (it != headers.end()) {
-    return std::strtoull(it->second.data(), nullptr, 10);
+    if (poll_sockets(fds.data(), fds.size(), 0) < 0) { return false; }
+
+    std::vector<socket_t> waiting;
+    for (size_t i = 0; i < pending_.size(); i++) {
+      auto s = pending_[i];
+      if (!fds[i].revents) {
+        waiting.push_back(s);
+        continue;
+      }
+
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (sock_ == INVALID_SOCKET &&
+          getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == 0 &&
+          !error) {
+        sock_ = s;
+      } else {
+        close_socket(s);
+        // Don't wait out the delay for an attempt which has already failed.
+        next_attempt_ = std::chrono::steady_clock::now();
+      }
+    }
+    pending_.swap(waiting);
+    return true;
   }
-  return def;
-}
 
-inline bool read_headers(Stream &strm, Headers &headers) {
-  static std::regex re(R"((.+?):\s*(.+?)\s*\r\n)");
+  void close_pending() {
+    for (auto s : pending_) {
+      close_socket(s);
+    }
+    pending_.clear();
+  }
 
-  const auto bufsiz = 2048;
-  char buf[bufsiz];
+  std::vector<struct sockaddr_storage> addrs_;
+  time_t attempt_delay_msec_;
+  std::chrono::steady_clock::time_point deadline_;
+  std::chrono::steady_clock::time_point next_attempt_;
+  size_t next_;
+  std::vector<socket_t> pending_;
+  socket_t sock_;
+};
 
-  stream_line_reader reader(strm, buf, bufsiz);
+// Waits for the attempts on this thread. Cancelling shuts down the sockets
+// being connected, which ends the wait.
+inline socket_t
+connect_to_any_address(const std::vector<struct sockaddr_storage> &addrs,
+                       time_t timeout_msec, time_t attempt_delay_msec,
+                       ClientCancellation *cancellation = nullptr) {
+  ConnectionAttempts attempts(addrs, timeout_msec, attempt_delay_msec);
+
+  while (!attempts.step()) {
+    const auto &pending = attempts.pending();
+    std::vector<struct pollfd> fds(pending.size());
+    for (size_t i = 0; i < pending.size(); i++) {
+      fds[i].fd = pending[i];
+      fds[i].events = POLLOUT;
+      fds[i].revents = 0;
+    }
 
-  for (;;) {
-    if (!reader.getline()) { return false; }
-    if (!strcmp(reader.ptr(), "\r\n")) { break; }
-    std::cmatch m;
-    if (std::regex_match(reader.ptr(), m, re)) {
-      auto key = std::string(m[1]);
-      auto val = std::string(m[2]);
-      headers.emplace(key, val);
+    auto until = attempts.get_wake_time();
+    time_t msec = -1;
+    if (until != (std::chrono::steady_clock::time_point::max)()) {
+      auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                      until - std::chrono::steady_clock::now())
+                      .count();
+      msec = usec > 0 ? static_cast<time_t>((usec + 999) / 1000) : 0;
     }
+
+    if (!watch_sockets(cancellation, pending)) { return INVALID_SOCKET; }
+    poll_sockets(fds.data(), fds.size(), msec);
+    if (!unwatch_sockets(cancellation)) { return INVALID_SOCKET; }
   }
 
-  return true;
+  return attempts.take();
 }
 
-typedef std::function<bool(const char *data, uint64_t data_length)>
-    ContentReceiverCore;
-
-inline bool read_content_with_length(Stream &strm, size_t len,
-                                     Progress progress,
-                                     ContentReceiverCore out) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
-
-  size_t r = 0;
-  while (r < len) {
-    auto n = strm.read(buf, std::min((len - r), CPPHTTPLIB_RECV_BUFSIZ));
-    if (n <= 0) { return false; }
-
-    if (!out(buf, n)) { return false; }
+inline std::string get_remote_addr(socket_t sock) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
 
-    r += n;
+  if (!getpeername(sock, (struct sockaddr *)&addr, &len)) {
+    char ipstr[NI_MAXHOST];
 
-    if (progress) {
-      if (!progress(r, len)) { return false; }
+    if (!getnameinfo((struct sockaddr *)&addr, len, ipstr, sizeof(ipstr),
+                     nullptr, 0, NI_NUMERICHOST)) {
+      return ipstr;
     }
   }
 
-  return true;
+  return std::string();
 }
 
-inline void skip_content_with_length(Stream &strm, size_t len) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
-  size_t r = 0;
-  while (r < len) {
-    auto n = strm.read(buf, std::min((len - r), CPPHTTPLIB_RECV_BUFSIZ));
-    if (n <= 0) { return; }
-    r += n;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+// Keys the HMAC-SHA256 of a session ticket.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+inline bool init_ticket_hmac(EVP_MAC_CTX *ctx, const unsigned char *key,
+                             size_t key_len) {
+  char digest[] = "SHA256";
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                        const_cast<unsigned char *>(key),
+                                        key_len),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+      OSSL_PARAM_construct_end()};
+  return EVP_MAC_CTX_set_params(ctx, params) == 1;
+}
+#else
+inline bool init_ticket_hmac(HMAC_CTX *ctx, const unsigned char *key,
+                             size_t key_len) {
+  return HMAC_Init_ex(ctx, key, static_cast<int>(key_len), EVP_sha256(),
+                      nullptr) == 1;
+}
+#endif
+
+// Takes the handshake of `ssl` on its non-blocking socket as far as it goes
+// without waiting, writing `early_data` first unless it's empty. Returns 1
+// once done, -1 on failure, and 0 when it has to wait for the socket to be
+// readable, or writable if `want_write` is set. `early_data_written` keeps
+// track in between.
+inline int ssl_connect_step(SSL *ssl, const std::string &early_data,
+                            bool &early_data_written, bool &want_write) {
+  auto ret = 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!early_data.empty() && !early_data_written) {
+    size_t written = 0;
+    ret = SSL_write_early_data(ssl, early_data.data(), early_data.size(),
+                               &written);
+    early_data_written = ret == 1;
   }
+#else
+  (void)early_data;
+  (void)early_data_written;
+#endif
+  if (ret == 1) { ret = SSL_connect(ssl); }
+  if (ret == 1) { return 1; }
+
+  auto err = SSL_get_error(ssl, ret);
+  if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) { return -1; }
+  want_write = err == SSL_ERROR_WANT_WRITE;
+  return 0;
 }
 
-inline bool read_content_without_length(Stream &strm, ContentReceiverCore out) {
-  char buf[CPPHTTPLIB_RECV_BUFSIZ];
-  for (;;) {
-    auto n = strm.read(buf, CPPHTTPLIB_RECV_BUFSIZ);
-    if (n < 0) {
-      return false;
-    } else if (n == 0) {
-      return true;
+// NOTE: Each thread keeps up to `CPPHTTPLIB_SSL_POOL_COUNT` finished SSL
+// objects and resets them with `SSL_clear` instead of paying for `SSL_new`
+// and `SSL_free` on every connection. OpenSSL 1.1.0 and later (or the locking
+// callbacks below for older versions) make `SSL_new` safe without a lock.
+// Each pool's mutex is only contended by discard().
+class SSLPool {
+public:
+  static SSL *acquire(SSL_CTX *ctx) {
+    SSL *ssl = nullptr;
+    {
+      auto &p = pool();
+      std::lock_guard<std::mutex> guard(p.mutex);
+      for (auto it = p.ssls.rbegin(); it != p.ssls.rend(); ++it) {
+        if (SSL_get_SSL_CTX(*it) == ctx) {
+          ssl = *it;
+          p.ssls.erase(std::next(it).base());
+          break;
+        }
+      }
     }
-    if (!out(buf, n)) { return false; }
+    if (!ssl) { return SSL_new(ctx); }
+
+    // SSL_clear keeps what was set on the object itself, so everything which
+    // it copies from the context at SSL_new is copied again.
+    SSL_clear_options(ssl, SSL_get_options(ssl));
+    SSL_set_options(ssl, SSL_CTX_get_options(ctx));
+    SSL_clear_mode(ssl, SSL_get_mode(ssl));
+    SSL_set_mode(ssl, SSL_CTX_get_mode(ctx));
+    SSL_set_read_ahead(ssl, SSL_CTX_get_read_ahead(ctx));
+    SSL_set_verify(ssl, SSL_CTX_get_verify_mode(ctx),
+                   SSL_CTX_get_verify_callback(ctx));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    SSL_set_max_early_data(ssl, SSL_CTX_get_max_early_data(ctx));
+    SSL_set_recv_max_early_data(ssl, SSL_CTX_get_recv_max_early_data(ctx));
+#endif
+    return ssl;
   }
 
-  return true;
-}
+  static void release(SSL *ssl) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    // SSL_clear doesn't reset the early data state, which would break the
+    // next handshake.
+    if (SSL_get_early_data_status(ssl) != SSL_EARLY_DATA_NOT_SENT) {
+      SSL_free(ssl);
+      return;
+    }
+#endif
 
-inline bool read_content_chunked(Stream &strm, ContentReceiverCore out) {
-  const auto bufsiz = 16;
-  char buf[bufsiz];
+    // Detach the socket BIOs and drop the last session before recycling.
+    SSL_set_bio(ssl, nullptr, nullptr);
+    if (SSL_clear(ssl) != 1 || SSL_set_session(ssl, nullptr) != 1) {
+      SSL_free(ssl);
+      return;
+    }
+    SSL_set_alpn_protos(ssl, nullptr, 0);
 
-  stream_line_reader reader(strm, buf, bufsiz);
+    SSL *evicted = nullptr;
+    {
+      auto &p = pool();
+      std::lock_guard<std::mutex> guard(p.mutex);
+      if (p.ssls.size() >= CPPHTTPLIB_SSL_POOL_COUNT) {
+        evicted = p.ssls.front();
+        p.ssls.erase(p.ssls.begin());
+      }
+      p.ssls.push_back(ssl);
+    }
+    if (evicted) { SSL_free(evicted); }
+  }
 
-  if (!reader.getline()) { return false; }
+  // Frees the objects made from `ctx` in the pools of all threads, since each
+  // holds a reference which would keep `ctx` alive. Its owner calls this
+  // before it frees `ctx`.
+  static void discard(SSL_CTX *ctx) {
+    std::vector<SSL *> discarded;
+    {
+      std::lock_guard<std::mutex> guard(registry_mutex());
+      for (auto p : registry()) {
+        std::lock_guard<std::mutex> pool_guard(p->mutex);
+        auto it = p->ssls.begin();
+        while (it != p->ssls.end()) {
+          if (SSL_get_SSL_CTX(*it) == ctx) {
+            discarded.push_back(*it);
+            it = p->ssls.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+    }
 
-  auto chunk_len = std::stoi(reader.ptr(), 0, 16);
+    for (auto ssl : discarded) {
+      SSL_free(ssl);
+    }
+  }
 
-  while (chunk_len > 0) {
-    if (!read_content_with_length(strm, chunk_len, nullptr, out)) {
-      return false;
+private:
+  struct Pool {
+    Pool() {
+      std::lock_guard<std::mutex> guard(registry_mutex());
+      registry().push_back(this);
     }
 
-    if (!reader.getline()) { return false; }
+    ~Pool() {
+      {
+        std::lock_guard<std::mutex> guard(registry_mutex());
+        auto &pools = registry();
+        pools.erase(std::remove(pools.begin(), pools.end(), this),
+                    pools.end());
+      }
 
-    if (strcmp(reader.ptr(), "\r\n")) { break; }
+      for (auto ssl : ssls) {
+        SSL_free(ssl);
+      }
+    }
 
-    if (!reader.getline()) { return false; }
+    std::mutex mutex;
+    std::vector<SSL *> ssls; // Most recently released last
+  };
 
-    chunk_len = std::stoi(reader.ptr(), 0, 16);
+  static Pool &pool() {
+    static thread_local Pool pool_;
+    return pool_;
   }
 
-  if (chunk_len == 0) {
-    // Reader terminator after chunks
-    if (!reader.getline() || strcmp(reader.ptr(), "\r\n")) return false;
+  static std::mutex &registry_mutex() {
+    static std::mutex mutex;
+    return mutex;
   }
 
-  return true;
-}
+  static std::vector<Pool *> &registry() {
+    static std::vector<Pool *> pools;
+    return pools;
+  }
+};
 
-inline bool is_chunked_transfer_encoding(const Headers &headers) {
-  return !strcasecmp(get_header_value(headers, "Transfer-Encoding", 0, ""),
-                     "chunked");
-}
+// NOTE: A CA bundle is parsed once per process and the resulting X509_STORE
+// is shared read-only by every client using the same paths. Each connection
+// takes its own reference, so a reload never pulls a store from under a
+// handshake in progress.
+class CACertStoreCache {
+public:
+  static CACertStoreCache &get() {
+    static CACertStoreCache cache;
+    return cache;
+  }
 
-template <typename T>
-bool read_content(Stream &strm, T &x, uint64_t payload_max_length, int &status,
-                  Progress progress, ContentReceiverCore receiver) {
+  ~CACertStoreCache() {
+    for (auto &x : stores_) {
+      X509_STORE_free(x.second);
+    }
+  }
 
-  ContentReceiverCore out = [&](const char *buf, size_t n) {
-    return receiver(buf, n);
-  };
+  // Returns a new reference, or nullptr when the certificates can't be read.
+  X509_STORE *acquire(const std::string &file_path,
+                      const std::string &dir_path) {
+    auto key = std::make_pair(file_path, dir_path);
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = stores_.find(key);
+    if (it == stores_.end()) {
+      auto store = load(file_path, dir_path);
+      if (!store) { return nullptr; }
+      it = stores_.emplace(key, store).first;
+    }
 
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-  detail::decompressor decompressor;
+    X509_STORE_up_ref(it->second);
+    return it->second;
+  }
 
-  if (!decompressor.is_valid()) {
-    status = 500;
-    return false;
+  // Re-reads every cached store. A store which fails to load is kept.
+  bool reload() {
+    auto ret = true;
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto &x : stores_) {
+      auto store = load(x.first.first, x.first.second);
+      if (store) {
+        X509_STORE_free(x.second);
+        x.second = store;
+      } else {
+        ret = false;
+      }
+    }
+    return ret;
   }
 
-  if (x.get_header_value("Content-Encoding") == "gzip") {
-    out = [&](const char *buf, size_t n) {
-      return decompressor.decompress(
-          buf, n, [&](const char *buf, size_t n) { return receiver(buf, n); });
-    };
+private:
+  static X509_STORE *load(const std::string &file_path,
+                          const std::string &dir_path) {
+    auto store = X509_STORE_new();
+    if (store &&
+        !X509_STORE_load_locations(
+            store, file_path.empty() ? nullptr : file_path.c_str(),
+            dir_path.empty() ? nullptr : dir_path.c_str())) {
+      X509_STORE_free(store);
+      return nullptr;
+    }
+    return store;
   }
-#else
-  if (x.get_header_value("Content-Encoding") == "gzip") {
-    status = 415;
-    return false;
+
+  std::mutex mutex_;
+  std::map<std::pair<std::string, std::string>, X509_STORE *> stores_;
+};
+
+// NOTE: Client sessions are kept per origin and TLS settings so that a new
+// connection can resume instead of running a full handshake. TLS 1.3 tickets
+// are handed out once each, as RFC 8446 recommends; older sessions may be
+// resumed repeatedly until they expire.
+class SSLClientSessionCache {
+public:
+  static SSLClientSessionCache &get() {
+    static SSLClientSessionCache cache;
+    return cache;
   }
-#endif
 
-  auto ret = true;
-  auto exceed_payload_max_length = false;
+  ~SSLClientSessionCache() {
+    for (auto &x : sessions_) {
+      for (auto session : x.second) {
+        SSL_SESSION_free(session);
+      }
+    }
+  }
 
-  if (is_chunked_transfer_encoding(x.headers)) {
-    ret = read_content_chunked(strm, out);
-  } else if (!has_header(x.headers, "Content-Length")) {
-    ret = read_content_without_length(strm, out);
-  } else {
-    auto len = get_header_value_uint64(x.headers, "Content-Length", 0);
-    if (len > 0) {
-      if ((len > payload_max_length) ||
-          // For 32-bit platform
-          (sizeof(size_t) < sizeof(uint64_t) &&
-           len > std::numeric_limits<size_t>::max())) {
-        exceed_payload_max_length = true;
-        skip_content_with_length(strm, len);
-        ret = false;
+  // Takes over the caller's reference to `session`.
+  void store(const std::string &key, SSL_SESSION *session) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto &sessions = sessions_[key];
+    sessions.push_back(session);
+    while (sessions.size() > CPPHTTPLIB_SSL_CLIENT_SESSION_COUNT) {
+      SSL_SESSION_free(sessions.front());
+      sessions.erase(sessions.begin());
+    }
+  }
+
+  // Returns a new reference to the newest usable session, or nullptr.
+  SSL_SESSION *acquire(const std::string &key) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = sessions_.find(key);
+    if (it == sessions_.end()) { return nullptr; }
+
+    auto &sessions = it->second;
+    auto now = time(nullptr);
+    SSL_SESSION *ret = nullptr;
+    while (!ret && !sessions.empty()) {
+      auto session = sessions.back();
+      if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) <=
+          now) {
+        SSL_SESSION_free(session);
+        sessions.pop_back();
+        continue;
+      }
+
+      ret = session;
+      auto single_use = false;
+#ifdef TLS1_3_VERSION
+      single_use =
+          SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION;
+#endif
+      if (single_use) {
+        sessions.pop_back();
       } else {
-        ret = read_content_with_length(strm, len, progress, out);
+        SSL_SESSION_up_ref(session);
       }
     }
+
+    if (sessions.empty()) { sessions_.erase(it); }
+    return ret;
   }
 
-  if (!ret) { status = exceed_payload_max_length ? 413 : 400; }
+  void remove(const std::string &key) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = sessions_.find(key);
+    if (it == sessions_.end()) { return; }
+    for (auto session : it->second) {
+      SSL_SESSION_free(session);
+    }
+    sessions_.erase(it);
+  }
 
-  return ret;
-}
+  // The key under which the sessions `ssl` receives are stored. It stays
+  // with the SSL object, since TLS 1.3 tickets arrive after the handshake.
+  static void set_key(SSL *ssl, const std::string &key) {
+    auto p = static_cast<std::string *>(SSL_get_ex_data(ssl, key_index()));
+    if (p) {
+      *p = key;
+    } else {
+      SSL_set_ex_data(ssl, key_index(), new std::string(key));
+    }
+  }
 
-template <typename T> inline int write_headers(Stream &strm, const T &info) {
-  auto write_len = 0;
-  for (const auto &x : info.headers) {
-    auto len =
-        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
-    if (len < 0) { return len; }
-    write_len += len;
+  static const std::string *get_key(SSL *ssl) {
+    return static_cast<const std::string *>(SSL_get_ex_data(ssl, key_index()));
   }
-  auto len = strm.write("\r\n");
-  if (len < 0) { return len; }
-  write_len += len;
-  return write_len;
-}
 
-inline int write_content(Stream &strm, ContentProvider content_provider,
-                         uint64_t offset, uint64_t length) {
-  uint64_t begin_offset = offset;
-  uint64_t end_offset = offset + length;
-  while (offset < end_offset) {
-    int64_t written_length = 0;
-    content_provider(
-        offset, end_offset - offset,
-        [&](const char *d, uint64_t l) {
-          offset += l;
-          written_length = strm.write(d, l);
-        },
-        [&](void) { written_length = -1; });
-    if (written_length < 0) { return static_cast<int>(written_length); }
+private:
+  static int key_index() {
+    static int index =
+        SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, free_key);
+    return index;
   }
-  return static_cast<int>(offset - begin_offset);
-}
 
-inline int write_content_chunked(Stream &strm,
-                                 ContentProvider content_provider) {
-  uint64_t offset = 0;
-  auto data_available = true;
-  uint64_t total_written_length = 0;
-  while (data_available) {
-    int64_t written_length = 0;
-    content_provider(
-        offset, 0,
-        [&](const char *d, uint64_t l) {
-          data_available = l > 0;
-          offset += l;
+  static void free_key(void * /*parent*/, void *ptr, CRYPTO_EX_DATA * /*ad*/,
+                       int /*idx*/, long /*argl*/, void * /*argp*/) {
+    delete static_cast<std::string *>(ptr);
+  }
 
-          // Emit chunked response header and footer for each chunk
-          auto chunk = from_i_to_hex(l) + "\r\n" + std::string(d, l) + "\r\n";
-          written_length = strm.write(chunk);
-        },
-        [&](void) {
-          data_available = false;
-          written_length = strm.write("0\r\n\r\n");
-        });
+  std::mutex mutex_;
+  std::map<std::string, std::vector<SSL_SESSION *>> sessions_;
+};
 
-    if (written_length < 0) { return static_cast<int>(written_length); }
-    total_written_length += written_length;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+// TLS 1.3 early data read by a server during the handshake. It stays with the
+// SSL object while a non-blocking handshake is resumed.
+struct SSLEarlyData {
+  std::string data;
+  bool finished = false;
+
+  static SSLEarlyData &get(SSL *ssl) {
+    auto p = static_cast<SSLEarlyData *>(SSL_get_ex_data(ssl, index()));
+    if (!p) {
+      p = new SSLEarlyData;
+      SSL_set_ex_data(ssl, index(), p);
+    }
+    return *p;
   }
-  return static_cast<int>(total_written_length);
+
+private:
+  static int index() {
+    static int index =
+        SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, free_data);
+    return index;
+  }
+
+  static void free_data(void * /*parent*/, void *ptr, CRYPTO_EX_DATA * /*ad*/,
+                        int /*idx*/, long /*argl*/, void * /*argp*/) {
+    delete static_cast<SSLEarlyData *>(ptr);
+  }
+};
+
+// Early data may be replayed, so it is only served when it holds nothing but
+// the head of a single GET, HEAD or OPTIONS request.
+inline bool is_replay_safe_early_data(const std::string &data) {
+  auto end = data.find("\r\n\r\n");
+  if (end == std::string::npos || end + 4 != data.size()) { return false; }
+
+  return !data.compare(0, 4, "GET ") || !data.compare(0, 5, "HEAD ") ||
+         !data.compare(0, 8, "OPTIONS ");
 }
+#endif
+#endif
 
-inline std::string encode_url(const std::string &s) {
-  std::string result;
+// The timeouts of one client request in milliseconds, where 0 waits without
+// limit, and the point at which the request gives up as a whole.
+struct ClientTimeouts {
+  time_t connect_msec = 0;
+  time_t tls_handshake_msec = 0;
+  time_t first_byte_msec = 0;
+  time_t read_msec = 0;
+  std::chrono::steady_clock::time_point deadline =
+      (std::chrono::steady_clock::time_point::max)();
+  // Set when the timeouts follow the measured round-trip times, which are
+  // then updated by the request.
+  bool adaptive = false;
+  // Lets the request be cancelled while it waits.
+  ClientCancellation *cancellation = nullptr;
+};
 
-  for (auto i = 0; s[i]; i++) {
-    switch (s[i]) {
-    case ' ': result += "%20"; break;
-    case '+': result += "%2B"; break;
-    case '\r': result += "%0D"; break;
-    case '\n': result += "%0A"; break;
-    case '\'': result += "%27"; break;
-    case ',': result += "%2C"; break;
-    case ':': result += "%3A"; break;
-    case ';': result += "%3B"; break;
-    default:
-      auto c = static_cast<uint8_t>(s[i]);
-      if (c >= 0x80) {
-        result += '%';
-        char hex[4];
-        size_t len = snprintf(hex, sizeof(hex) - 1, "%02X", c);
-        assert(len == 2);
-        result.append(hex, len);
-      } else {
-        result += s[i];
-      }
-      break;
+// Whether the response to a request sent at `sent_at` has waited out the
+// first-byte timeout, or the total one, as opposed to the connection having
+// been closed.
+inline bool
+is_first_byte_timed_out(const ClientTimeouts &timeouts,
+                        std::chrono::steady_clock::time_point sent_at) {
+  auto now = std::chrono::steady_clock::now();
+  return now >= timeouts.deadline ||
+         (timeouts.first_byte_msec &&
+          now - sent_at >= std::chrono::milliseconds(timeouts.first_byte_msec));
+}
+
+// Smoothed round-trip time and its variation in microseconds (RFC 6298).
+struct RttEstimator {
+  double srtt = 0;
+  double rttvar = 0;
+  size_t samples = 0;
+  int backoff = 0;
+
+  void add(double usec) {
+    if (samples == 0) {
+      srtt = usec;
+      rttvar = usec / 2;
+    } else {
+      rttvar = 0.75 * rttvar + 0.25 * std::fabs(srtt - usec);
+      srtt = 0.875 * srtt + 0.125 * usec;
     }
+    samples++;
+    backoff = 0;
   }
 
-  return result;
-}
-
-inline std::string decode_url(const std::string &s) {
-  std::string result;
-
-  for (size_t i = 0; i < s.size(); i++) {
-    if (s[i] == '%' && i + 1 < s.size()) {
-      if (s[i + 1] == 'u') {
-        int val = 0;
-        if (from_hex_to_i(s, i + 2, 4, val)) {
-          // 4 digits Unicode codes
-          char buff[4];
-          size_t len = to_utf8(val, buff);
-          if (len > 0) { result.append(buff, len); }
-          i += 5; // 'u0000'
-        } else {
-          result += s[i];
-        }
-      } else {
-        int val = 0;
-        if (from_hex_to_i(s, i + 1, 2, val)) {
-          // 2 digits hex codes
-          result += val;
-          i += 2; // '00'
-        } else {
-          result += s[i];
-        }
-      }
-    } else if (s[i] == '+') {
-      result += ' ';
-    } else {
-      result += s[i];
-    }
+  // Like TCP's retransmission timer, the timeout doubles each time it
+  // expires, until a new sample arrives.
+  void back_off() {
+    if (backoff < 6) { backoff++; }
   }
 
-  return result;
-}
+  // `factor` times the retransmission timeout, but at least `min_msec` and
+  // at most `max_msec` unless that is 0. Without enough samples it's
+  // `max_msec` itself.
+  time_t get_timeout_msec(double factor, time_t min_msec,
+                          time_t max_msec) const {
+    if (samples < CPPHTTPLIB_ADAPTIVE_TIMEOUT_MIN_SAMPLE_COUNT) {
+      return max_msec;
+    }
 
-inline void parse_query_text(const std::string &s, Params &params) {
-  split(&s[0], &s[s.size()], '&', [&](const char *b, const char *e) {
-    std::string key;
-    std::string val;
-    split(b, e, '=', [&](const char *b, const char *e) {
-      if (key.empty()) {
-        key.assign(b, e);
-      } else {
-        val.assign(b, e);
-      }
-    });
-    params.emplace(key, decode_url(val));
-  });
-}
+    auto msec = static_cast<time_t>(factor * (srtt + 4 * rttvar) / 1000);
+    msec = std::max(msec, min_msec);
+    msec <<= backoff;
+    return max_msec ? std::min(msec, max_msec) : msec;
+  }
+};
 
-inline bool parse_multipart_boundary(const std::string &content_type,
-                                     std::string &boundary) {
-  auto pos = content_type.find("boundary=");
-  if (pos == std::string::npos) { return false; }
+// The round-trip times measured for an origin. Connecting takes one round
+// trip, and the first byte of a response one plus the server's time.
+struct OriginRtt {
+  RttEstimator connect;
+  RttEstimator first_byte;
+};
 
-  boundary = content_type.substr(pos + 9);
-  return true;
-}
+// NOTE: Shared by every client in the process, since all of them take the
+// same network path to an origin.
+class OriginRttCache {
+public:
+  static OriginRttCache &get() {
+    static OriginRttCache cache;
+    return cache;
+  }
 
-inline bool parse_multipart_formdata(const std::string &boundary,
-                                     const std::string &body,
-                                     MultipartFiles &files) {
-  static std::string dash = "--";
-  static std::string crlf = "\r\n";
+  OriginRtt lookup(const std::string &origin) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = origins_.find(origin);
+    return it != origins_.end() ? it->second : OriginRtt();
+  }
 
-  static std::regex re_content_type("Content-Type: (.*?)",
-                                    std::regex_constants::icase);
+  void add(const std::string &origin, bool first_byte,
+           std::chrono::steady_clock::duration rtt) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto &x = origins_[origin];
+    (first_byte ? x.first_byte : x.connect)
+        .add(static_cast<double>(
+            std::chrono::duration_cast<std::chrono::microseconds>(rtt)
+                .count()));
+  }
 
-  static std::regex re_content_disposition(
-      "Content-Disposition: form-data; name=\"(.*?)\"(?:; filename=\"(.*?)\")?",
-      std::regex_constants::icase);
+  void back_off(const std::string &origin, bool first_byte) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto &x = origins_[origin];
+    (first_byte ? x.first_byte : x.connect).back_off();
+  }
 
-  auto dash_boundary = dash + boundary;
+private:
+  std::mutex mutex_;
+  std::map<std::string, OriginRtt> origins_;
+};
 
-  auto pos = body.find(dash_boundary);
-  if (pos != 0) { return false; }
+// An established client connection, kept open between requests.
+struct ClientConnection {
+  socket_t sock = INVALID_SOCKET;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  SSL *ssl = nullptr;
+#endif
+  std::chrono::steady_clock::time_point expires;
+  // How it was set up, until the first response on it takes this over.
+  ResponseTiming timing;
+};
 
-  pos += dash_boundary.size();
+// Returns the setup times for the response which starts on `conn`. Later
+// responses on it only see that it was reused.
+inline ResponseTiming take_connection_timing(ClientConnection &conn) {
+  auto timing = conn.timing;
+  conn.timing = ResponseTiming();
+  conn.timing.connection_reused = true;
+  return timing;
+}
 
-  auto next_pos = body.find(crlf, pos);
-  if (next_pos == std::string::npos) { return false; }
+inline void close_client_connection(ClientConnection &conn) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (conn.ssl) {
+    SSL_shutdown(conn.ssl);
+    SSLPool::release(conn.ssl);
+    conn.ssl = nullptr;
+  }
+#endif
+  close_socket(conn.sock);
+  conn.sock = INVALID_SOCKET;
+}
 
-  pos = next_pos + crlf.size();
+// An idle connection must have nothing to read: data would be a stray
+// response, and EOF means the server has closed it.
+inline bool is_client_connection_alive(const ClientConnection &conn) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if (conn.ssl && SSL_pending(conn.ssl) > 0) { return false; }
+#else
+  // Unlike `SSL_pending`, this includes raw records read ahead. Records
+  // which arrived while idle may only be session tickets, which SSL_peek
+  // takes in without returning data.
+  if (conn.ssl && (SSL_has_pending(conn.ssl) == 1 ||
+                   select_read(conn.sock, 0, 0) != 0)) {
+    char c;
+    set_nonblocking(conn.sock, true);
+    auto n = SSL_peek(conn.ssl, &c, 1);
+    auto err = SSL_get_error(conn.ssl, n);
+    set_nonblocking(conn.sock, false);
+    return n <= 0 && err == SSL_ERROR_WANT_READ;
+  }
+#endif
+#endif
+  return select_read(conn.sock, 0, 0) == 0;
+}
 
-  while (pos < body.size()) {
-    next_pos = body.find(crlf, pos);
-    if (next_pos == std::string::npos) { return false; }
+// NOTE: Idle keep-alive connections are shared by every client in the
+// process. They are keyed by origin and TLS settings, so a connection is only
+// reused by clients which would have established the very same one.
+class ClientConnectionPool {
+public:
+  static ClientConnectionPool &get() {
+    static ClientConnectionPool pool;
+    return pool;
+  }
 
-    std::string name;
-    MultipartFile file;
+  ~ClientConnectionPool() {
+    // SSLPool is thread local and may already be gone at exit.
+    for (auto &x : idle_) {
+      for (auto &conn : x.second) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+        if (conn.ssl) { SSL_free(conn.ssl); }
+#endif
+        close_socket(conn.sock);
+      }
+    }
+  }
 
-    auto header = body.substr(pos, (next_pos - pos));
+  // Takes the most recently used healthy connection for `key`. Checking a
+  // connection takes system calls, so it's done without holding the lock.
+  bool acquire(const std::string &key, ClientConnection &conn) {
+    for (;;) {
+      if (!take(key, conn)) { return false; }
+      if (is_client_connection_alive(conn)) { return true; }
+      close_client_connection(conn);
+    }
+  }
 
-    while (pos != next_pos) {
-      std::smatch m;
-      if (std::regex_match(header, m, re_content_type)) {
-        file.content_type = m[1];
-      } else if (std::regex_match(header, m, re_content_disposition)) {
-        name = m[1];
-        file.filename = m[2];
+  // Keeps `conn` for reuse, closing the oldest idle connections beyond
+  // `max_idle_count` and any which have expired.
+  void release(const std::string &key, const ClientConnection &conn,
+               size_t max_idle_count) {
+    std::vector<ClientConnection> stale;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto &conns = idle_[key];
+      conns.push_back(conn);
+      while (conns.size() > max_idle_count) {
+        stale.push_back(conns.front());
+        conns.erase(conns.begin());
       }
 
-      pos = next_pos + crlf.size();
-
-      next_pos = body.find(crlf, pos);
-      if (next_pos == std::string::npos) { return false; }
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = idle_.begin(); it != idle_.end();) {
+        auto &v = it->second;
+        auto keep = std::stable_partition(
+            v.begin(), v.end(),
+            [&](const ClientConnection &c) { return c.expires > now; });
+        stale.insert(stale.end(), keep, v.end());
+        v.erase(keep, v.end());
+        it = v.empty() ? idle_.erase(it) : std::next(it);
+      }
+    }
 
-      header = body.substr(pos, (next_pos - pos));
+    for (auto &c : stale) {
+      close_client_connection(c);
     }
+  }
 
-    pos = next_pos + crlf.size();
+private:
+  // Takes the most recently used connection for `key` which hasn't expired.
+  bool take(const std::string &key, ClientConnection &conn) {
+    std::vector<ClientConnection> stale;
+    auto found = false;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = idle_.find(key);
+      if (it != idle_.end()) {
+        auto &conns = it->second;
+        auto now = std::chrono::steady_clock::now();
+        while (!conns.empty()) {
+          auto c = conns.back();
+          conns.pop_back();
+          if (c.expires > now) {
+            conn = c;
+            found = true;
+            break;
+          }
+          stale.push_back(c);
+        }
+        if (conns.empty()) { idle_.erase(it); }
+      }
+    }
 
-    next_pos = body.find(crlf + dash_boundary, pos);
+    for (auto &c : stale) {
+      close_client_connection(c);
+    }
+    return found;
+  }
 
-    if (next_pos == std::string::npos) { return false; }
+  std::mutex mutex_;
+  std::map<std::string, std::vector<ClientConnection>> idle_;
+};
 
-    file.offset = pos;
-    file.length = next_pos - pos;
+inline bool is_idempotent_method(const std::string &method) {
+  return method == "GET" || method == "HEAD" || method == "OPTIONS" ||
+         method == "PUT" || method == "DELETE";
+}
 
-    pos = next_pos + crlf.size() + dash_boundary.size();
+// A request sent by Client::send_async, from start to completion.
+struct ClientAsyncCall {
+  Request req;
+  std::shared_ptr<Response> res;
+  ResponseHandler handler;
+  ClientConnection conn;
+  ClientTimeouts timeouts;
+  std::chrono::steady_clock::time_point sent_at;
+  bool connection_close = false;
+  bool reused = false;
+  bool retried = false;
+  // A second attempt, which must not share the first one's connection.
+  bool hedged = false;
+
+  // While a new connection is set up, step by step.
+  std::unique_ptr<ConnectionAttempts> attempts;
+  time_t connect_timeout_msec = 0;
+  std::chrono::steady_clock::time_point setup_start;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  std::chrono::steady_clock::time_point handshake_deadline;
+  std::string early_data;
+  bool early_data_written = false;
+#endif
 
-    next_pos = body.find(crlf, pos);
-    if (next_pos == std::string::npos) { return false; }
+  ClientCancellation cancellation;
+};
 
-    files.emplace(name, file);
+// The asynchronous calls of a client which haven't completed. They run the
+// client's code until then, so the client cancels them and waits before it
+// goes.
+class ClientAsyncCalls {
+public:
+  void add(const std::shared_ptr<ClientAsyncCall> &call) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    calls_[call.get()] = call;
+  }
 
-    pos = next_pos + crlf.size();
+  void remove(const ClientAsyncCall *call) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    calls_.erase(call);
+    if (calls_.empty() && !held_) { cond_.notify_all(); }
   }
 
-  return true;
-}
+  // Work for the client which isn't one of its calls, such as setting up its
+  // HTTP/2 session, is waited for as well until it is released.
+  void hold() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    held_++;
+  }
 
-inline bool parse_range_header(const std::string &s, Ranges &ranges) {
-  try {
-    static auto re = std::regex(R"(bytes=(\d*-\d*(?:,\s*\d*-\d*)*))");
-    std::smatch m;
-    if (std::regex_match(s, m, re)) {
-      auto pos = m.position(1);
-      auto len = m.length(1);
-      detail::split(
-          &s[pos], &s[pos + len], ',', [&](const char *b, const char *e) {
-            static auto re = std::regex(R"(\s*(\d*)-(\d*))");
-            std::cmatch m;
-            if (std::regex_match(b, e, m, re)) {
-              uint64_t first = -1;
-              if (!m.str(1).empty()) { first = std::stoll(m.str(1)); }
+  void release() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    held_--;
+    if (calls_.empty() && !held_) { cond_.notify_all(); }
+  }
 
-              uint64_t last = -1;
-              if (!m.str(2).empty()) { last = std::stoll(m.str(2)); }
+  void cancel_and_wait() {
+    std::vector<std::shared_ptr<ClientAsyncCall>> calls;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      for (auto &x : calls_) {
+        auto call = x.second.lock();
+        if (call) { calls.push_back(call); }
+      }
+    }
 
-              if (int64_t(first) != -1 && int64_t(last) != -1 && first > last) {
-                throw std::runtime_error("invalid range error");
-              }
-              ranges.emplace_back(std::make_pair(first, last));
-            }
-          });
-      return true;
+    for (auto &call : calls) {
+      cancel_request(call->cancellation);
     }
-    return false;
-  } catch (...) { return false; }
-}
 
-inline std::string to_lower(const char *beg, const char *end) {
-  std::string out;
-  auto it = beg;
-  while (it != end) {
-    out += ::tolower(*it);
-    it++;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&] { return calls_.empty() && !held_; });
   }
-  return out;
-}
 
-inline std::string make_multipart_data_boundary() {
-  static const char data[] =
-      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<const ClientAsyncCall *, std::weak_ptr<ClientAsyncCall>> calls_;
+  size_t held_ = 0;
+};
 
-  std::random_device seed_gen;
-  std::mt19937 engine(seed_gen());
+// Closes a connection without writing to it, for it may be shut down.
+inline void abort_client_connection(ClientConnection &conn) {
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (conn.ssl) {
+    SSL_set_shutdown(conn.ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+  }
+#endif
+  close_client_connection(conn);
+}
 
-  std::string result = "--cpp-httplib-multipart-data-";
+// Keeps the latencies of a client's recent requests, which tell when to
+// hedge one, and the budget for hedging.
+class HedgingPolicy {
+public:
+  void enable(bool enabled, double percentile, double budget) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    enabled_ = enabled;
+    percentile_ = std::min(std::max(percentile, 0.0), 1.0);
+    budget_ = budget;
+    tokens_ = 0;
+  }
 
-  for (auto i = 0; i < 16; i++) {
-    result += data[engine() % (sizeof(data) - 1)];
+  bool is_enabled() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return enabled_;
   }
 
-  return result;
-}
+  // Earns a request's share of the budget, and tells how long it may take
+  // before it is hedged.
+  bool get_delay(std::chrono::steady_clock::duration &delay) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto max_tokens = std::max(1.0, budget_ * CPPHTTPLIB_HEDGING_SAMPLE_COUNT);
+    tokens_ = std::min(tokens_ + budget_, max_tokens);
 
-inline std::pair<uint64_t, uint64_t>
-get_range_offset_and_length(const Request &req, uint64_t content_length,
-                            size_t index) {
-  auto r = req.ranges[index];
+    if (samples_.size() < CPPHTTPLIB_HEDGING_MIN_SAMPLE_COUNT) { return false; }
 
-  if (r.first == -1 && r.second == -1) {
-    return std::make_pair(0, content_length);
+    auto samples = samples_;
+    auto nth = samples.begin() +
+               static_cast<std::ptrdiff_t>(percentile_ * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    delay = *nth;
+    return true;
   }
 
-  if (r.first == -1) {
-    r.first = content_length - r.second;
-    r.second = content_length - 1;
+  // Spends the budget for one more attempt.
+  bool acquire() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (tokens_ < 1) { return false; }
+    tokens_ -= 1;
+    return true;
   }
 
-  if (r.second == -1) { r.second = content_length - 1; }
+  void record(std::chrono::steady_clock::duration latency) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (samples_.size() < CPPHTTPLIB_HEDGING_SAMPLE_COUNT) {
+      samples_.push_back(latency);
+    } else {
+      samples_[next_sample_] = latency;
+    }
+    next_sample_ = (next_sample_ + 1) % CPPHTTPLIB_HEDGING_SAMPLE_COUNT;
+  }
+
+private:
+  std::mutex mutex_;
+  bool enabled_ = false;
+  double percentile_ = CPPHTTPLIB_HEDGING_PERCENTILE;
+  double budget_ = CPPHTTPLIB_HEDGING_BUDGET;
+  double tokens_ = 0;
+  std::vector<std::chrono::steady_clock::duration> samples_;
+  size_t next_sample_ = 0;
+};
+
+// A request coalesced by RequestCoalescer, and the response its waiters get.
+struct CoalescedFetch {
+  Headers headers;
+  bool done = false;
+  bool ok = false;
+  Response res;
+};
+
+// A response cached by ResponseCache, and when it was received.
+struct CachedResponse {
+  std::string key;
+  std::string vary_key;
+  int status = 0;
+  Headers headers;
+  std::string body;
+  time_t response_time = 0;
+  time_t initial_age = 0;
+  time_t lifetime = 0;
+  bool no_cache = false;
+};
+
+inline std::string make_request_key(const std::string &origin,
+                                    const std::string &method,
+                                    const std::string &path) {
+  return method + " " + origin + path;
+}
+
+// Identifies the response to `req`. It starts with make_request_key(), and
+// goes on with a line for each header which changes the response without
+// being listed in Vary.
+inline std::string make_request_key(const std::string &origin,
+                                    const Request &req) {
+  static const char *names[] = {"Authorization", "Cookie",
+                                "Range",         "If-Range",
+                                "If-Match",      "If-None-Match",
+                                "If-Modified-Since", "If-Unmodified-Since"};
+
+  auto key = make_request_key(origin, req.method, req.path);
+  for (auto name : names) {
+    auto r = req.headers.equal_range(name);
+    for (auto it = r.first; it != r.second; ++it) {
+      key += "\n";
+      key += name;
+      key += ": ";
+      key += it->second;
+    }
+  }
+  return key;
+}
+
+// NOTE: Asynchronous requests from every client share one readiness loop,
+// which parks their connections while the servers are busy, and a few
+// workers, which write requests and read responses as data arrives. It is
+// never destroyed, so that requests still pending at exit don't hold up
+// static destruction.
+class ClientEventLoop {
+public:
+  static ClientEventLoop &get() {
+    static auto loop = new ClientEventLoop();
+    return *loop;
+  }
+
+  ReadinessLoop &readiness_loop() { return readiness_loop_; }
+  TaskQueue &task_queue() { return *task_queue_; }
+
+private:
+  ClientEventLoop() {
+#if CPPHTTPLIB_THREAD_POOL_COUNT > 0
+    task_queue_.reset(new ThreadPool(CPPHTTPLIB_ASYNC_CLIENT_THREAD_COUNT));
+#else
+    task_queue_.reset(new Threads());
+#endif
+    readiness_loop_.start(*task_queue_);
+  }
+
+  std::unique_ptr<TaskQueue> task_queue_;
+  ReadinessLoop readiness_loop_;
+};
+
+// NOTE: Runs what asynchronous requests have to block for, such as DNS
+// lookups and setting up HTTP/2 sessions, on a few threads shared by every
+// client. Requests which need the same job done wait for that one job, and a
+// request which is cancelled stops waiting at once. A job which no request
+// waits for any more is cancelled. Like ClientEventLoop, it is never
+// destroyed.
+class ClientSetupQueue {
+public:
+  // A job fills `addrs` when it is a lookup.
+  using Job = std::function<bool(ClientCancellation &cancellation,
+                                 std::vector<struct sockaddr_storage> &addrs)>;
+  using Resume = std::function<void(
+      bool ok, const std::vector<struct sockaddr_storage> &addrs)>;
+
+  static ClientSetupQueue &get() {
+    static auto queue = new ClientSetupQueue();
+    return *queue;
+  }
+
+  // Has `resume` called with the outcome of the job under `key` on the event
+  // loop's task queue, and starts `job` unless that job is pending already.
+  // If `call` is cancelled meanwhile, its handler is called instead.
+  void wait(const std::string &key, std::shared_ptr<ClientAsyncCall> call,
+            Job job, Resume resume) {
+    std::shared_ptr<Pending> started;
+    auto added = false;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto &pending = pending_[key];
+      if (!pending) {
+        pending = std::make_shared<Pending>();
+        pending->key = key;
+        started = pending;
+      }
+
+      // Set while the lock is held, so that the job can't be done before.
+      std::weak_ptr<Pending> weak_pending = pending;
+      std::weak_ptr<ClientAsyncCall> weak_call = call;
+      added = set_interrupt(&call->cancellation,
+                            [this, weak_pending, weak_call]() {
+                              leave(weak_pending.lock(), weak_call.lock());
+                            });
+      if (added) {
+        pending->waiters.emplace_back(call, resume);
+      } else if (started) {
+        pending_.erase(key);
+        started.reset();
+      }
+    }
+
+    if (!added) {
+      call->handler(nullptr);
+      return;
+    }
+    if (started) {
+      task_queue_->enqueue([this, started, job]() { run(started, job); });
+    }
+  }
+
+private:
+  using Waiter = std::pair<std::shared_ptr<ClientAsyncCall>, Resume>;
+
+  struct Pending {
+    std::string key;
+    ClientCancellation cancellation;
+    std::vector<Waiter> waiters;
+  };
+
+  ClientSetupQueue() {
+#if CPPHTTPLIB_THREAD_POOL_COUNT > 0
+    task_queue_.reset(
+        new ThreadPool(CPPHTTPLIB_ASYNC_CLIENT_SETUP_THREAD_COUNT));
+#else
+    task_queue_.reset(new Threads());
+#endif
+  }
+
+  void run(std::shared_ptr<Pending> pending, Job job) {
+    std::vector<struct sockaddr_storage> addrs;
+    auto ok = job(pending->cancellation, addrs);
+
+    std::vector<Waiter> waiters;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = pending_.find(pending->key);
+      if (it != pending_.end() && it->second == pending) { pending_.erase(it); }
+      waiters.swap(pending->waiters);
+    }
+
+    auto &task_queue = ClientEventLoop::get().task_queue();
+    for (const auto &waiter : waiters) {
+      auto call = waiter.first;
+      auto resume = waiter.second;
+      task_queue.enqueue([call, resume, ok, addrs]() {
+        clear_interrupt(&call->cancellation);
+        if (is_cancelled(&call->cancellation)) {
+          call->handler(nullptr);
+        } else {
+          resume(ok, addrs);
+        }
+      });
+    }
+  }
+
+  void leave(std::shared_ptr<Pending> pending,
+             std::shared_ptr<ClientAsyncCall> call) {
+    if (!pending || !call) { return; }
+
+    auto left = false;
+    auto unwanted = false;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto &waiters = pending->waiters;
+      for (auto it = waiters.begin(); it != waiters.end(); ++it) {
+        if (it->first == call) {
+          waiters.erase(it);
+          left = true;
+          break;
+        }
+      }
+
+      // The next request for the same job starts a new one.
+      if (left && waiters.empty()) {
+        auto it = pending_.find(pending->key);
+        if (it != pending_.end() && it->second == pending) {
+          pending_.erase(it);
+        }
+        unwanted = true;
+      }
+    }
+
+    if (unwanted) { cancel_request(pending->cancellation); }
+    if (left) {
+      ClientEventLoop::get().task_queue().enqueue(
+          [call]() { call->handler(nullptr); });
+    }
+  }
+
+  std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<Pending>> pending_;
+  std::unique_ptr<TaskQueue> task_queue_;
+};
+
+struct DnsCacheEntry {
+  std::vector<struct sockaddr_storage> addrs;
+  bool resolved = false;
+  bool resolving = false;
+  bool refreshing = false;
+  std::chrono::steady_clock::time_point refresh_after;
+  std::chrono::steady_clock::time_point expires;
+};
+
+// Shared with background refreshes, which may outlive their DnsCache.
+struct DnsCacheState {
+  Resolver resolver;
+  std::chrono::seconds ttl;
+  std::chrono::seconds negative_ttl;
+  size_t max_entry_count;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::map<std::string, DnsCacheEntry> entries;
+
+  void update(DnsCacheEntry &entry, bool resolved,
+              const std::vector<struct sockaddr_storage> &addrs) {
+    auto now = std::chrono::steady_clock::now();
+    entry.resolved = resolved;
+    entry.addrs = addrs;
+    entry.expires = now + (resolved ? ttl : negative_ttl);
+    // Refresh during the last quarter of the TTL.
+    auto ttl_msec = std::chrono::duration_cast<std::chrono::milliseconds>(ttl);
+    entry.refresh_after = now + ttl_msec * 3 / 4;
+  }
+
+  void evict() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = entries.begin(); it != entries.end();) {
+      auto busy = it->second.resolving || it->second.refreshing;
+      it = (!busy && it->second.expires <= now) ? entries.erase(it)
+                                                : std::next(it);
+    }
+
+    while (entries.size() > max_entry_count) {
+      auto oldest = entries.end();
+      for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->second.resolving || it->second.refreshing) { continue; }
+        if (oldest == entries.end() ||
+            it->second.expires < oldest->second.expires) {
+          oldest = it;
+        }
+      }
+      if (oldest == entries.end()) { break; }
+      entries.erase(oldest);
+    }
+  }
+};
+
+inline const char *find_content_type(const std::string &path) {
+  auto ext = file_extension(path);
+  if (ext == "txt") {
+    return "text/plain";
+  } else if (ext == "html") {
+    return "text/html";
+  } else if (ext == "css") {
+    return "text/css";
+  } else if (ext == "jpeg" || ext == "jpg") {
+    return "image/jpg";
+  } else if (ext == "png") {
+    return "image/png";
+  } else if (ext == "gif") {
+    return "image/gif";
+  } else if (ext == "svg") {
+    return "image/svg+xml";
+  } else if (ext == "ico") {
+    return "image/x-icon";
+  } else if (ext == "json") {
+    return "application/json";
+  } else if (ext == "pdf") {
+    return "application/pdf";
+  } else if (ext == "js") {
+    return "application/javascript";
+  } else if (ext == "xml") {
+    return "application/xml";
+  } else if (ext == "xhtml") {
+    return "application/xhtml+xml";
+  }
+  return nullptr;
+}
+
+inline const char *status_message(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 301: return "Moved Permanently";
+  case 302: return "Found";
+  case 303: return "See Other";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 413: return "Payload Too Large";
+  case 414: return "Request-URI Too Long";
+  case 415: return "Unsupported Media Type";
+  case 416: return "Range Not Satisfiable";
+
+  default:
+  case 500: return "Internal Server Error";
+  }
+}
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+inline bool can_compress(const std::string &content_type) {
+  return !content_type.find("text/") || content_type == "image/svg+xml" ||
+         content_type == "application/javascript" ||
+         content_type == "application/json" ||
+         content_type == "application/xml" ||
+         content_type == "application/xhtml+xml";
+}
+
+inline bool compress(std::string &content) {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+
+  auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+                          Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK) { return false; }
+
+  strm.avail_in = content.size();
+  strm.next_in = (Bytef *)content.data();
+
+  std::string compressed;
+
+  const auto bufsiz = 16384;
+  char buff[bufsiz];
+  do {
+    strm.avail_out = bufsiz;
+    strm.next_out = (Bytef *)buff;
+    ret = deflate(&strm, Z_FINISH);
+    assert(ret != Z_STREAM_ERROR);
+    compressed.append(buff, bufsiz - strm.avail_out);
+  } while (strm.avail_out == 0);
+
+  assert(ret == Z_STREAM_END);
+  assert(strm.avail_in == 0);
+
+  content.swap(compressed);
+
+  deflateEnd(&strm);
+  return true;
+}
+
+class decompressor {
+public:
+  decompressor() {
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    // 15 is the value of wbits, which should be at the maximum possible value
+    // to ensure that any gzip stream can be decoded. The offset of 16 specifies
+    // that the stream to decompress will be formatted with a gzip wrapper.
+    is_valid_ = inflateInit2(&strm, 16 + 15) == Z_OK;
+  }
+
+  ~decompressor() { inflateEnd(&strm); }
+
+  bool is_valid() const { return is_valid_; }
+
+  template <typename T>
+  bool decompress(const char *data, size_t data_length, T callback) {
+    int ret = Z_OK;
+
+    strm.avail_in = data_length;
+    strm.next_in = (Bytef *)data;
+
+    const auto bufsiz = 16384;
+    char buff[bufsiz];
+    do {
+      strm.avail_out = bufsiz;
+      strm.next_out = (Bytef *)buff;
+
+      ret = inflate(&strm, Z_NO_FLUSH);
+      assert(ret != Z_STREAM_ERROR);
+      switch (ret) {
+      case Z_NEED_DICT:
+      case Z_DATA_ERROR:
+      case Z_MEM_ERROR: inflateEnd(&strm); return false;
+      }
+
+      if (!callback(buff, bufsiz - strm.avail_out)) { return false; }
+    } while (strm.avail_out == 0);
+
+    return ret == Z_STREAM_END;
+  }
+
+private:
+  bool is_valid_;
+  z_stream strm;
+};
+#endif
+
+inline bool has_header(const Headers &headers, const char *key) {
+  return headers.find(key) != headers.end();
+}
+
+inline const char *get_header_value(const Headers &headers, const char *key,
+                                    size_t id = 0, const char *def = nullptr) {
+  auto it = headers.find(key);
+  std::advance(it, id);
+  if (it != headers.end()) { return it->second.c_str(); }
+  return def;
+}
+
+inline void trim_space(const char *&b, const char *&e) {
+  while (b < e && (*b == ' ' || *b == '\t')) { b++; }
+  while (b < e && (e[-1] == ' ' || e[-1] == '\t')) { e--; }
+}
+
+// Appends the values in `headers` of those which a response with
+// `res_headers` varies on to `key`. Fails for "Vary: *", which no other
+// request can share.
+inline bool append_vary_key(const Headers &res_headers, const Headers &headers,
+                            std::string &key) {
+  auto ret = true;
+  auto r = res_headers.equal_range("Vary");
+  for (auto it = r.first; it != r.second; ++it) {
+    const auto &val = it->second;
+    split(val.data(), val.data() + val.size(), ',',
+          [&](const char *b, const char *e) {
+            trim_space(b, e);
+            std::string name(b, e);
+            if (name.empty()) { return; }
+            if (name == "*") { ret = false; }
+            key += "\n";
+            key += name;
+            key += ": ";
+            key += get_header_value(headers, name.c_str(), 0, "");
+          });
+  }
+  return ret;
+}
+
+inline uint64_t get_header_value_uint64(const Headers &headers, const char *key,
+                                        int def = 0) {
+  auto it = headers.find(key);
+  if (it != headers.end()) {
+    return std::strtoull(it->second.data(), nullptr, 10);
+  }
+  return def;
+}
+
+// Finds `name` among the Cache-Control directives in `headers`, and puts its
+// argument, if any, in `val`.
+inline bool get_cache_directive(const Headers &headers, const char *name,
+                                std::string *val = nullptr) {
+  auto found = false;
+  auto r = headers.equal_range("Cache-Control");
+  for (auto it = r.first; it != r.second && !found; ++it) {
+    const auto &s = it->second;
+    split(s.data(), s.data() + s.size(), ',',
+          [&](const char *b, const char *e) {
+            trim_space(b, e);
+            auto eq = std::find(b, e, '=');
+            if (found || strcasecmp(std::string(b, eq).c_str(), name)) {
+              return;
+            }
+            found = true;
+            if (val && eq != e) {
+              b = eq + 1;
+              if (e - b >= 2 && *b == '"' && e[-1] == '"') {
+                b++;
+                e--;
+              }
+              val->assign(b, e);
+            }
+          });
+  }
+  return found;
+}
+
+inline bool get_cache_directive_seconds(const Headers &headers,
+                                        const char *name, time_t &sec) {
+  std::string val;
+  if (!get_cache_directive(headers, name, &val)) { return false; }
+  sec = static_cast<time_t>(std::strtoll(val.c_str(), nullptr, 10));
+  return true;
+}
+
+// Parses an HTTP-date (RFC 7231 7.1.1.1): an IMF-fixdate, such as
+// "Sun, 06 Nov 1994 08:49:37 GMT", or one of the obsolete forms,
+// "Sunday, 06-Nov-94 08:49:37 GMT" and "Sun Nov  6 08:49:37 1994".
+inline bool parse_http_date(const char *s, time_t &t) {
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+  char wday[10];
+  char mon[4];
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(s, "%3s, %d %3s %d %d:%d:%d GMT", wday, &tm.tm_mday, mon,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 7 &&
+      sscanf(s, "%3s %3s %d %d:%d:%d %d", wday, mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year) != 7) {
+    if (sscanf(s, "%9[A-Za-z], %d-%3s-%d %d:%d:%d GMT", wday, &tm.tm_mday,
+               mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+               &tm.tm_sec) != 7) {
+      return false;
+    }
+    if (tm.tm_year < 100) {
+      // A two-digit year is the nearest one with those digits, unless that
+      // is more than 50 years ahead.
+      auto now_year = static_cast<int>(1970 + time(nullptr) / 31556952);
+      tm.tm_year += now_year - now_year % 100;
+      if (tm.tm_year > now_year + 50) {
+        tm.tm_year -= 100;
+      } else if (tm.tm_year < now_year - 50) {
+        tm.tm_year += 100;
+      }
+    }
+  }
+
+  tm.tm_mon = -1;
+  for (auto i = 0; i < 12; i++) {
+    if (!strcmp(mon, months[i])) { tm.tm_mon = i; }
+  }
+  if (tm.tm_mon == -1) { return false; }
+  tm.tm_year -= 1900;
+
+#ifdef _WIN32
+  auto ret = _mkgmtime(&tm);
+#else
+  auto ret = timegm(&tm);
+#endif
+  if (ret == -1) { return false; }
+  t = ret;
+  return true;
+}
+
+inline bool is_cacheable_status(int status) {
+  return status == 200 || status == 203 || status == 204 || status == 300 ||
+         status == 301 || status == 404 || status == 405 || status == 410 ||
+         status == 414 || status == 501;
+}
+
+// Works out how old `entry`, received at `now`, was then and how long it
+// stays fresh (RFC 7234 4.2).
+inline void update_freshness(CachedResponse &entry, time_t now) {
+  auto &headers = entry.headers;
+
+  time_t date = now;
+  parse_http_date(get_header_value(headers, "Date", 0, ""), date);
+
+  entry.response_time = now;
+  entry.initial_age =
+      std::max(std::max<time_t>(now - date, 0),
+               static_cast<time_t>(get_header_value_uint64(headers, "Age", 0)));
+  headers.erase("Age");
+
+  if (!get_cache_directive_seconds(headers, "max-age", entry.lifetime)) {
+    entry.lifetime = 0;
+
+    time_t t = 0;
+    if (has_header(headers, "Expires")) {
+      if (parse_http_date(get_header_value(headers, "Expires", 0, ""), t)) {
+        entry.lifetime = t - date;
+      }
+    } else if (parse_http_date(get_header_value(headers, "Last-Modified", 0,
+                                                ""),
+                               t)) {
+      // A tenth of the time since the last change, as is usual.
+      entry.lifetime =
+          std::min<time_t>((date - t) / 10,
+                           CPPHTTPLIB_RESPONSE_CACHE_HEURISTIC_MAX_SECOND);
+    }
+  }
+
+  entry.no_cache = get_cache_directive(headers, "no-cache");
+}
+
+inline void fill_cached_response(const CachedResponse &entry, time_t age,
+                                 Response &res) {
+  res.version = "HTTP/1.1";
+  res.status = entry.status;
+  res.headers = entry.headers;
+  res.headers.emplace("Age", std::to_string(age));
+  res.body = entry.body;
+}
+
+// How much of the cache `entry` takes up.
+inline size_t get_cached_size(const CachedResponse &entry) {
+  return entry.key.size() + entry.vary_key.size() + entry.body.size();
+}
+
+inline std::string hash_cache_key(const char *b, const char *e) {
+  uint64_t h = 14695981039346656037ull;
+  for (; b != e; ++b) {
+    h ^= static_cast<unsigned char>(*b);
+    h *= 1099511628211ull;
+  }
+
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+  return buf;
+}
+
+// The file of the response with `vary_key` for the URL of `key`. It starts
+// with a hash of the URL, which is all of it when the response doesn't vary.
+inline std::string get_cache_file_name(const std::string &key,
+                                       const std::string &vary_key) {
+  auto url_size = std::min(key.find('\n'), key.size());
+  auto name = hash_cache_key(key.data(), key.data() + url_size);
+  if (!vary_key.empty()) {
+    name += hash_cache_key(vary_key.data(), vary_key.data() + vary_key.size());
+  }
+  return name;
+}
+
+// Whether `key` holds the credentials of its request, which aren't to be
+// written to disk.
+inline bool has_credentials(const std::string &key) {
+  return key.find("\nAuthorization: ") != std::string::npos ||
+         key.find("\nCookie: ") != std::string::npos;
+}
+
+// A file kept by ResponseCache, found when listing its directory.
+struct CacheFile {
+  std::string name;
+  size_t size;
+  uint64_t modified;
+};
+
+inline bool is_cache_file_name(const std::string &name) {
+  if (name.size() != 16 && name.size() != 32) { return false; }
+  int v;
+  for (auto c : name) {
+    if (!is_hex(c, v)) { return false; }
+  }
+  return true;
+}
+
+inline void list_cache_files(const std::string &dir,
+                             std::vector<CacheFile> &files) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  auto handle = FindFirstFileA((dir + "\\*").c_str(), &data);
+  if (handle == INVALID_HANDLE_VALUE) { return; }
+  do {
+    if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+        !is_cache_file_name(data.cFileName)) {
+      continue;
+    }
+    CacheFile file;
+    file.name = data.cFileName;
+    file.size = static_cast<size_t>(
+        (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow);
+    file.modified =
+        (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) |
+        data.ftLastWriteTime.dwLowDateTime;
+    files.push_back(file);
+  } while (FindNextFileA(handle, &data));
+  FindClose(handle);
+#else
+  auto d = opendir(dir.c_str());
+  if (!d) { return; }
+  while (auto ent = readdir(d)) {
+    std::string name = ent->d_name;
+    struct stat st;
+    if (!is_cache_file_name(name) ||
+        stat((dir + "/" + name).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    CacheFile file;
+    file.name = name;
+    file.size = static_cast<size_t>(st.st_size);
+    file.modified = static_cast<uint64_t>(st.st_mtime);
+    files.push_back(file);
+  }
+  closedir(d);
+#endif
+}
+
+// `size` gets the size of the file written.
+inline bool write_cached_response(const std::string &path,
+                                  const CachedResponse &entry, size_t &size) {
+  // Written aside and renamed, so that readers never see part of a file.
+  auto tmp = path + "." +
+             std::to_string(
+                 std::hash<std::thread::id>()(std::this_thread::get_id())) +
+             ".tmp";
+  {
+    std::ofstream ofs(tmp, std::ios::binary);
+    ofs << "CPPHTTPLIB-CACHE 1\n"
+        << entry.key.size() << ' ' << entry.vary_key.size() << ' '
+        << entry.body.size() << ' ' << entry.status << ' '
+        << static_cast<long long>(entry.response_time) << ' '
+        << static_cast<long long>(entry.initial_age) << ' '
+        << static_cast<long long>(entry.lifetime) << ' '
+        << (entry.no_cache ? 1 : 0) << '\n'
+        << entry.key << entry.vary_key;
+    for (const auto &x : entry.headers) {
+      ofs << x.first << ": " << x.second << "\r\n";
+    }
+    ofs << "\r\n";
+    ofs.write(entry.body.data(),
+              static_cast<std::streamsize>(entry.body.size()));
+    if (!ofs.flush()) {
+      ofs.close();
+      std::remove(tmp.c_str());
+      return false;
+    }
+    size = static_cast<size_t>(ofs.tellp());
+  }
+
+#ifdef _WIN32
+  std::remove(path.c_str());
+#endif
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+inline bool read_exactly(std::istream &is, std::string &s, uint64_t len) {
+  s.resize(static_cast<size_t>(len));
+  return !len ||
+         is.read(&s[0], static_cast<std::streamsize>(len)).gcount() ==
+             static_cast<std::streamsize>(len);
+}
+
+// Reads the body straight into `entry`, which takes the only copy of it.
+// `size` gets the size of the file.
+inline bool read_cached_response(const std::string &path,
+                                 CachedResponse &entry, size_t &size) {
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  if (!ifs) { return false; }
+  auto file_size = static_cast<uint64_t>(ifs.tellg());
+  ifs.seekg(0);
+
+  std::string line;
+  if (!std::getline(ifs, line) || line != "CPPHTTPLIB-CACHE 1" ||
+      !std::getline(ifs, line)) {
+    return false;
+  }
+
+  unsigned long long key_len, vary_len, body_len;
+  long long response_time, initial_age, lifetime;
+  int status, no_cache;
+  if (sscanf(line.c_str(), "%llu %llu %llu %d %lld %lld %lld %d", &key_len,
+             &vary_len, &body_len, &status, &response_time, &initial_age,
+             &lifetime, &no_cache) != 8 ||
+      key_len > file_size || vary_len > file_size || body_len > file_size ||
+      !read_exactly(ifs, entry.key, key_len) ||
+      !read_exactly(ifs, entry.vary_key, vary_len)) {
+    return false;
+  }
+
+  for (;;) {
+    if (!std::getline(ifs, line) || line.empty() || line.back() != '\r') {
+      return false;
+    }
+    if (line.size() == 1) { break; }
+
+    auto colon = line.find(':');
+    if (colon == std::string::npos) { return false; }
+    const char *b = line.data() + colon + 1;
+    const char *e = line.data() + line.size() - 1;
+    trim_space(b, e);
+    entry.headers.emplace(line.substr(0, colon), std::string(b, e));
+  }
+
+  if (file_size - static_cast<uint64_t>(ifs.tellg()) != body_len ||
+      !read_exactly(ifs, entry.body, body_len)) {
+    return false;
+  }
+  entry.status = status;
+  entry.response_time = static_cast<time_t>(response_time);
+  entry.initial_age = static_cast<time_t>(initial_age);
+  entry.lifetime = static_cast<time_t>(lifetime);
+  entry.no_cache = no_cache != 0;
+  size = static_cast<size_t>(file_size);
+  return true;
+}
+
+inline bool read_headers(Stream &strm, Headers &headers) {
+  static std::regex re(R"((.+?):\s*(.+?)\s*\r\n)");
+
+  const auto bufsiz = 2048;
+  char buf[bufsiz];
+
+  stream_line_reader reader(strm, buf, bufsiz);
+
+  for (;;) {
+    if (!reader.getline()) { return false; }
+    if (!strcmp(reader.ptr(), "\r\n")) { break; }
+    std::cmatch m;
+    if (std::regex_match(reader.ptr(), m, re)) {
+      auto key = std::string(m[1]);
+      auto val = std::string(m[2]);
+      headers.emplace(key, val);
+    }
+  }
+
+  return true;
+}
+
+typedef std::function<bool(const char *data, uint64_t data_length)>
+    ContentReceiverCore;
+
+inline bool read_content_with_length(Stream &strm, size_t len,
+                                     Progress progress,
+                                     ContentReceiverCore out) {
+  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+
+  size_t r = 0;
+  while (r < len) {
+    auto n = strm.read(buf, std::min((len - r), CPPHTTPLIB_RECV_BUFSIZ));
+    if (n <= 0) { return false; }
+
+    if (!out(buf, n)) { return false; }
+
+    r += n;
+
+    if (progress) {
+      if (!progress(r, len)) { return false; }
+    }
+  }
+
+  return true;
+}
+
+inline void skip_content_with_length(Stream &strm, size_t len) {
+  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+  size_t r = 0;
+  while (r < len) {
+    auto n = strm.read(buf, std::min((len - r), CPPHTTPLIB_RECV_BUFSIZ));
+    if (n <= 0) { return; }
+    r += n;
+  }
+}
+
+inline bool read_content_without_length(Stream &strm, ContentReceiverCore out) {
+  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+  for (;;) {
+    auto n = strm.read(buf, CPPHTTPLIB_RECV_BUFSIZ);
+    if (n < 0) {
+      return false;
+    } else if (n == 0) {
+      return true;
+    }
+    if (!out(buf, n)) { return false; }
+  }
+
+  return true;
+}
+
+inline bool read_content_chunked(Stream &strm, ContentReceiverCore out) {
+  const auto bufsiz = 16;
+  char buf[bufsiz];
+
+  stream_line_reader reader(strm, buf, bufsiz);
+
+  if (!reader.getline()) { return false; }
+
+  auto chunk_len = std::stoi(reader.ptr(), 0, 16);
+
+  while (chunk_len > 0) {
+    if (!read_content_with_length(strm, chunk_len, nullptr, out)) {
+      return false;
+    }
+
+    if (!reader.getline()) { return false; }
+
+    if (strcmp(reader.ptr(), "\r\n")) { break; }
+
+    if (!reader.getline()) { return false; }
+
+    chunk_len = std::stoi(reader.ptr(), 0, 16);
+  }
+
+  if (chunk_len == 0) {
+    // Reader terminator after chunks
+    if (!reader.getline() || strcmp(reader.ptr(), "\r\n")) return false;
+  }
+
+  return true;
+}
+
+inline bool is_chunked_transfer_encoding(const Headers &headers) {
+  return !strcasecmp(get_header_value(headers, "Transfer-Encoding", 0, ""),
+                     "chunked");
+}
+
+template <typename T>
+bool read_content(Stream &strm, T &x, uint64_t payload_max_length, int &status,
+                  Progress progress, ContentReceiverCore receiver) {
+
+  ContentReceiverCore out = [&](const char *buf, size_t n) {
+    return receiver(buf, n);
+  };
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+  detail::decompressor decompressor;
+
+  if (!decompressor.is_valid()) {
+    status = 500;
+    return false;
+  }
+
+  if (x.get_header_value("Content-Encoding") == "gzip") {
+    out = [&](const char *buf, size_t n) {
+      return decompressor.decompress(
+          buf, n, [&](const char *buf, size_t n) { return receiver(buf, n); });
+    };
+  }
+#else
+  if (x.get_header_value("Content-Encoding") == "gzip") {
+    status = 415;
+    return false;
+  }
+#endif
+
+  auto ret = true;
+  auto exceed_payload_max_length = false;
+
+  if (is_chunked_transfer_encoding(x.headers)) {
+    ret = read_content_chunked(strm, out);
+  } else if (!has_header(x.headers, "Content-Length")) {
+    ret = read_content_without_length(strm, out);
+  } else {
+    auto len = get_header_value_uint64(x.headers, "Content-Length", 0);
+    if (len > 0) {
+      if ((len > payload_max_length) ||
+          // For 32-bit platform
+          (sizeof(size_t) < sizeof(uint64_t) &&
+           len > std::numeric_limits<size_t>::max())) {
+        exceed_payload_max_length = true;
+        skip_content_with_length(strm, len);
+        ret = false;
+      } else {
+        ret = read_content_with_length(strm, len, progress, out);
+      }
+    }
+  }
+
+  if (!ret) { status = exceed_payload_max_length ? 413 : 400; }
+
+  return ret;
+}
+
+inline bool write_file(int fd, const char *buf, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    auto n = _write(fd, buf, static_cast<unsigned int>(size));
+#else
+    auto n = ::write(fd, buf, size);
+    if (n < 0 && errno == EINTR) { continue; }
+#endif
+    if (n <= 0) { return false; }
+    buf += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Delivers a response body to its content receiver, the receive buffer or
+// file, or into `res.body`, which is reserved from Content-Length up to
+// `reserve_max_length`.
+inline ContentReceiverCore make_content_receiver(Response &res,
+                                                 size_t reserve_max_length) {
+  res.received_length = 0;
+
+  if (res.receive_buffer) {
+    return [&res](const char *buf, size_t n) {
+      if (n > res.receive_buffer_size - res.received_length) { return false; }
+      memcpy(res.receive_buffer + res.received_length, buf, n);
+      res.received_length += n;
+      return true;
+    };
+  }
+
+  if (res.receive_fd != -1) {
+    return [&res](const char *buf, size_t n) {
+      if (!write_file(res.receive_fd, buf, n)) { return false; }
+      res.received_length += n;
+      return true;
+    };
+  }
+
+  if (!res.content_receiver) {
+    auto length = get_header_value_uint64(res.headers, "Content-Length", 0);
+    res.body.reserve(static_cast<size_t>(
+        std::min(length, static_cast<uint64_t>(reserve_max_length))));
+    return [&res](const char *buf, size_t n) {
+      res.body.append(buf, n);
+      return true;
+    };
+  }
+
+  auto offset = std::make_shared<uint64_t>();
+  auto length = get_header_value_uint64(res.headers, "Content-Length", 0);
+  auto receiver = res.content_receiver;
+  return [offset, length, receiver](const char *buf, size_t n) {
+    auto ret = receiver(buf, n, *offset, length);
+    (*offset) += n;
+    return ret;
+  };
+}
+
+// Reads a plain Content-Length body straight from the stream into its
+// destination. Other bodies go through read_content.
+inline bool read_response_body(Stream &strm, Response &res,
+                               size_t reserve_max_length) {
+  auto len = get_header_value_uint64(res.headers, "Content-Length", 0);
+  auto to_file = res.receive_fd != -1;
+  auto direct = !res.content_receiver &&
+                has_header(res.headers, "Content-Length") &&
+                !has_header(res.headers, "Content-Encoding") &&
+                !is_chunked_transfer_encoding(res.headers) &&
+                (res.receive_buffer || to_file || len <= reserve_max_length);
+
+  if (!direct) {
+    auto out = make_content_receiver(res, reserve_max_length);
+    int dummy_status;
+    return read_content(strm, res, std::numeric_limits<uint64_t>::max(),
+                        dummy_status, res.progress, out);
+  }
+
+  char buf[CPPHTTPLIB_SSL_RECV_BUFSIZ];
+  char *dest = nullptr;
+  if (res.receive_buffer) {
+    if (len > res.receive_buffer_size) { return false; }
+    dest = res.receive_buffer;
+  } else if (!to_file) {
+    res.body.resize(static_cast<size_t>(len));
+    dest = &res.body[0];
+  }
+
+  uint64_t r = 0;
+  while (r < len) {
+    auto n = dest ? strm.read(dest + r, static_cast<size_t>(len - r))
+                  : strm.read(buf, static_cast<size_t>(std::min(
+                                       len - r, uint64_t(sizeof(buf)))));
+    if (n <= 0) { break; }
+    if (to_file && !write_file(res.receive_fd, buf, static_cast<size_t>(n))) {
+      break;
+    }
+
+    r += static_cast<uint64_t>(n);
+
+    if (res.progress && !res.progress(r, len)) { break; }
+  }
+
+  if (res.receive_buffer || to_file) {
+    res.received_length = r;
+  } else {
+    res.body.resize(static_cast<size_t>(r));
+  }
+  return r == len;
+}
+
+template <typename T> inline int write_headers(Stream &strm, const T &info) {
+  auto write_len = 0;
+  for (const auto &x : info.headers) {
+    auto len =
+        strm.write_format("%s: %s\r\n", x.first.c_str(), x.second.c_str());
+    if (len < 0) { return len; }
+    write_len += len;
+  }
+  auto len = strm.write("\r\n");
+  if (len < 0) { return len; }
+  write_len += len;
+  return write_len;
+}
+
+inline int64_t read_file(int fd, uint64_t offset, char *buf, size_t size) {
+#ifdef _WIN32
+  if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) == -1) {
+    return -1;
+  }
+  return _read(fd, buf, static_cast<unsigned int>(size));
+#else
+  ssize_t n;
+  do {
+    n = pread(fd, buf, size, static_cast<off_t>(offset));
+  } while (n < 0 && errno == EINTR);
+  return static_cast<int64_t>(n);
+#endif
+}
+
+inline int write_content(Stream &strm, ContentProvider content_provider,
+                         uint64_t offset, uint64_t length) {
+  uint64_t begin_offset = offset;
+  uint64_t end_offset = offset + length;
+  while (offset < end_offset) {
+    int64_t written_length = 0;
+    content_provider(
+        offset, end_offset - offset,
+        [&](const char *d, uint64_t l) {
+          offset += l;
+          written_length = strm.write(d, l);
+        },
+        [&](void) { written_length = -1; });
+    if (written_length < 0) { return static_cast<int>(written_length); }
+  }
+  return static_cast<int>(offset - begin_offset);
+}
+
+inline int write_content_chunked(Stream &strm,
+                                 ContentProvider content_provider) {
+  uint64_t offset = 0;
+  auto data_available = true;
+  uint64_t total_written_length = 0;
+  while (data_available) {
+    int64_t written_length = 0;
+    content_provider(
+        offset, 0,
+        [&](const char *d, uint64_t l) {
+          data_available = l > 0;
+          offset += l;
+
+          // Emit chunked response header and footer for each chunk
+          auto chunk = from_i_to_hex(l) + "\r\n" + std::string(d, l) + "\r\n";
+          written_length = strm.write(chunk);
+        },
+        [&](void) {
+          data_available = false;
+          written_length = strm.write("0\r\n\r\n");
+        });
+
+    if (written_length < 0) { return static_cast<int>(written_length); }
+    total_written_length += written_length;
+  }
+  return static_cast<int>(total_written_length);
+}
+
+inline std::string encode_url(const std::string &s) {
+  std::string result;
+
+  for (auto i = 0; s[i]; i++) {
+    switch (s[i]) {
+    case ' ': result += "%20"; break;
+    case '+': result += "%2B"; break;
+    case '\r': result += "%0D"; break;
+    case '\n': result += "%0A"; break;
+    case '\'': result += "%27"; break;
+    case ',': result += "%2C"; break;
+    case ':': result += "%3A"; break;
+    case ';': result += "%3B"; break;
+    default:
+      auto c = static_cast<uint8_t>(s[i]);
+      if (c >= 0x80) {
+        result += '%';
+        char hex[4];
+        size_t len = snprintf(hex, sizeof(hex) - 1, "%02X", c);
+        assert(len == 2);
+        result.append(hex, len);
+      } else {
+        result += s[i];
+      }
+      break;
+    }
+  }
+
+  return result;
+}
+
+inline std::string decode_url(const std::string &s) {
+  std::string result;
+
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '%' && i + 1 < s.size()) {
+      if (s[i + 1] == 'u') {
+        int val = 0;
+        if (from_hex_to_i(s, i + 2, 4, val)) {
+          // 4 digits Unicode codes
+          char buff[4];
+          size_t len = to_utf8(val, buff);
+          if (len > 0) { result.append(buff, len); }
+          i += 5; // 'u0000'
+        } else {
+          result += s[i];
+        }
+      } else {
+        int val = 0;
+        if (from_hex_to_i(s, i + 1, 2, val)) {
+          // 2 digits hex codes
+          result += val;
+          i += 2; // '00'
+        } else {
+          result += s[i];
+        }
+      }
+    } else if (s[i] == '+') {
+      result += ' ';
+    } else {
+      result += s[i];
+    }
+  }
+
+  return result;
+}
+
+inline void parse_query_text(const std::string &s, Params &params) {
+  split(&s[0], &s[s.size()], '&', [&](const char *b, const char *e) {
+    std::string key;
+    std::string val;
+    split(b, e, '=', [&](const char *b, const char *e) {
+      if (key.empty()) {
+        key.assign(b, e);
+      } else {
+        val.assign(b, e);
+      }
+    });
+    params.emplace(key, decode_url(val));
+  });
+}
+
+inline bool parse_multipart_boundary(const std::string &content_type,
+                                     std::string &boundary) {
+  auto pos = content_type.find("boundary=");
+  if (pos == std::string::npos) { return false; }
+
+  boundary = content_type.substr(pos + 9);
+  return true;
+}
+
+inline bool parse_multipart_formdata(const std::string &boundary,
+                                     const std::string &body,
+                                     MultipartFiles &files) {
+  static std::string dash = "--";
+  static std::string crlf = "\r\n";
+
+  static std::regex re_content_type("Content-Type: (.*?)",
+                                    std::regex_constants::icase);
+
+  static std::regex re_content_disposition(
+      "Content-Disposition: form-data; name=\"(.*?)\"(?:; filename=\"(.*?)\")?",
+      std::regex_constants::icase);
+
+  auto dash_boundary = dash + boundary;
+
+  auto pos = body.find(dash_boundary);
+  if (pos != 0) { return false; }
+
+  pos += dash_boundary.size();
+
+  auto next_pos = body.find(crlf, pos);
+  if (next_pos == std::string::npos) { return false; }
+
+  pos = next_pos + crlf.size();
+
+  while (pos < body.size()) {
+    next_pos = body.find(crlf, pos);
+    if (next_pos == std::string::npos) { return false; }
+
+    std::string name;
+    MultipartFile file;
+
+    auto header = body.substr(pos, (next_pos - pos));
+
+    while (pos != next_pos) {
+      std::smatch m;
+      if (std::regex_match(header, m, re_content_type)) {
+        file.content_type = m[1];
+      } else if (std::regex_match(header, m, re_content_disposition)) {
+        name = m[1];
+        file.filename = m[2];
+      }
+
+      pos = next_pos + crlf.size();
+
+      next_pos = body.find(crlf, pos);
+      if (next_pos == std::string::npos) { return false; }
+
+      header = body.substr(pos, (next_pos - pos));
+    }
+
+    pos = next_pos + crlf.size();
+
+    next_pos = body.find(crlf + dash_boundary, pos);
+
+    if (next_pos == std::string::npos) { return false; }
+
+    file.offset = pos;
+    file.length = next_pos - pos;
+
+    pos = next_pos + crlf.size() + dash_boundary.size();
+
+    next_pos = body.find(crlf, pos);
+    if (next_pos == std::string::npos) { return false; }
+
+    files.emplace(name, file);
+
+    pos = next_pos + crlf.size();
+  }
+
+  return true;
+}
+
+inline bool parse_range_header(const std::string &s, Ranges &ranges) {
+  try {
+    static auto re = std::regex(R"(bytes=(\d*-\d*(?:,\s*\d*-\d*)*))");
+    std::smatch m;
+    if (std::regex_match(s, m, re)) {
+      auto pos = m.position(1);
+      auto len = m.length(1);
+      detail::split(
+          &s[pos], &s[pos + len], ',', [&](const char *b, const char *e) {
+            static auto re = std::regex(R"(\s*(\d*)-(\d*))");
+            std::cmatch m;
+            if (std::regex_match(b, e, m, re)) {
+              uint64_t first = -1;
+              if (!m.str(1).empty()) { first = std::stoll(m.str(1)); }
+
+              uint64_t last = -1;
+              if (!m.str(2).empty()) { last = std::stoll(m.str(2)); }
+
+              if (int64_t(first) != -1 && int64_t(last) != -1 && first > last) {
+                throw std::runtime_error("invalid range error");
+              }
+              ranges.emplace_back(std::make_pair(first, last));
+            }
+          });
+      return true;
+    }
+    return false;
+  } catch (...) { return false; }
+}
+
+inline std::string to_lower(const char *beg, const char *end) {
+  std::string out;
+  auto it = beg;
+  while (it != end) {
+    out += ::tolower(*it);
+    it++;
+  }
+  return out;
+}
+
+inline std::string make_multipart_data_boundary() {
+  static const char data[] =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+  std::random_device seed_gen;
+  std::mt19937 engine(seed_gen());
+
+  std::string result = "--cpp-httplib-multipart-data-";
+
+  for (auto i = 0; i < 16; i++) {
+    result += data[engine() % (sizeof(data) - 1)];
+  }
+
+  return result;
+}
+
+inline std::pair<uint64_t, uint64_t>
+get_range_offset_and_length(const Request &req, uint64_t content_length,
+                            size_t index) {
+  auto r = req.ranges[index];
+
+  if (r.first == -1 && r.second == -1) {
+    return std::make_pair(0, content_length);
+  }
+
+  if (r.first == -1) {
+    r.first = content_length - r.second;
+    r.second = content_length - 1;
+  }
+
+  if (r.second == -1) { r.second = content_length - 1; }
+
+  return std::make_pair(r.first, r.second - r.first + 1);
+}
+
+inline std::string make_content_range_header_field(uint64_t offset,
+                                                   uint64_t length,
+                                                   uint64_t content_length) {
+  std::string field = "bytes ";
+  field += std::to_string(offset);
+  field += "-";
+  field += std::to_string(offset + length - 1);
+  field += "/";
+  field += std::to_string(content_length);
+  return field;
+}
+
+template <typename SToken, typename CToken, typename Content>
+bool process_multipart_ranges_data(const Request &req, Response &res,
+                                   const std::string &boundary,
+                                   const std::string &content_type,
+                                   SToken stoken, CToken ctoken,
+                                   Content content) {
+  for (size_t i = 0; i < req.ranges.size(); i++) {
+    ctoken("--");
+    stoken(boundary);
+    ctoken("\r\n");
+    if (!content_type.empty()) {
+      ctoken("Content-Type: ");
+      stoken(content_type);
+      ctoken("\r\n");
+    }
+
+    auto offsets = detail::get_range_offset_and_length(req, res.body.size(), i);
+    auto offset = offsets.first;
+    auto length = offsets.second;
+
+    ctoken("Content-Range: ");
+    stoken(make_content_range_header_field(offset, length, res.body.size()));
+    ctoken("\r\n");
+    ctoken("\r\n");
+    if (!content(offset, length)) { return false; }
+    ctoken("\r\n");
+  }
+
+  ctoken("--");
+  stoken(boundary);
+  ctoken("--\r\n");
+
+  return true;
+}
+
+inline std::string make_multipart_ranges_data(const Request &req, Response &res,
+                                              const std::string &boundary,
+                                              const std::string &content_type) {
+  std::string data;
+
+  process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { data += token; },
+      [&](const char *token) { data += token; },
+      [&](uint64_t offset, uint64_t length) {
+        data += res.body.substr(offset, length);
+        return true;
+      });
+
+  return data;
+}
+
+inline uint64_t
+get_multipart_ranges_data_length(const Request &req, Response &res,
+                                 const std::string &boundary,
+                                 const std::string &content_type) {
+  uint64_t data_length = 0;
+
+  process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { data_length += token.size(); },
+      [&](const char *token) { data_length += strlen(token); },
+      [&](uint64_t /*offset*/, uint64_t length) {
+        data_length += length;
+        return true;
+      });
+
+  return data_length;
+}
+
+inline bool write_multipart_ranges_data(Stream &strm, const Request &req,
+                                        Response &res,
+                                        const std::string &boundary,
+                                        const std::string &content_type) {
+  return process_multipart_ranges_data(
+      req, res, boundary, content_type,
+      [&](const std::string &token) { strm.write(token); },
+      [&](const char *token) { strm.write(token); },
+      [&](uint64_t offset, uint64_t length) {
+        return detail::write_content(strm, res.content_provider, offset,
+                                     length) >= 0;
+      });
+}
+
+inline std::pair<uint64_t, uint64_t>
+get_range_offset_and_length(const Request &req, const Response &res,
+                            size_t index) {
+  auto r = req.ranges[index];
+
+  if (r.second == -1) { r.second = res.content_provider_resource_length - 1; }
 
   return std::make_pair(r.first, r.second - r.first + 1);
 }
 
-inline std::string make_content_range_header_field(uint64_t offset,
-                                                   uint64_t length,
-                                                   uint64_t content_length) {
-  std::string field = "bytes ";
-  field += std::to_string(offset);
-  field += "-";
-  field += std::to_string(offset + length - 1);
-  field += "/";
-  field += std::to_string(content_length);
-  return field;
+#ifdef _WIN32
+class WSInit {
+public:
+  WSInit() {
+    WSADATA wsaData;
+    WSAStartup(0x0002, &wsaData);
+  }
+
+  ~WSInit() { WSACleanup(); }
+};
+
+static WSInit wsinit_;
+#endif
+
+} // namespace detail
+
+// Header utilities
+inline std::pair<std::string, std::string> make_range_header(Ranges ranges) {
+  std::string field = "bytes=";
+  auto i = 0;
+  for (auto r : ranges) {
+    if (i != 0) { field += ", "; }
+    if (r.first != -1) { field += std::to_string(r.first); }
+    field += '-';
+    if (r.second != -1) { field += std::to_string(r.second); }
+    i++;
+  }
+  return std::make_pair("Range", field);
+}
+
+inline std::pair<std::string, std::string>
+make_basic_authentication_header(const std::string &username,
+                                 const std::string &password) {
+  auto field = "Basic " + detail::base64_encode(username + ":" + password);
+  return std::make_pair("Authorization", field);
+}
+
+// Request implementation
+inline bool Request::has_header(const char *key) const {
+  return detail::has_header(headers, key);
+}
+
+inline std::string Request::get_header_value(const char *key, size_t id) const {
+  return detail::get_header_value(headers, key, id, "");
+}
+
+inline size_t Request::get_header_value_count(const char *key) const {
+  auto r = headers.equal_range(key);
+  return std::distance(r.first, r.second);
+}
+
+inline void Request::set_header(const char *key, const char *val) {
+  headers.emplace(key, val);
+}
+
+inline void Request::set_header(const char *key, const std::string &val) {
+  headers.emplace(key, val);
+}
+
+inline bool Request::has_param(const char *key) const {
+  return params.find(key) != params.end();
+}
+
+inline std::string Request::get_param_value(const char *key, size_t id) const {
+  auto it = params.find(key);
+  std::advance(it, id);
+  if (it != params.end()) { return it->second; }
+  return std::string();
+}
+
+inline size_t Request::get_param_value_count(const char *key) const {
+  auto r = params.equal_range(key);
+  return std::distance(r.first, r.second);
+}
+
+inline bool Request::has_file(const char *key) const {
+  return files.find(key) != files.end();
+}
+
+inline MultipartFile Request::get_file_value(const char *key) const {
+  auto it = files.find(key);
+  if (it != files.end()) { return it->second; }
+  return MultipartFile();
+}
+
+inline void Request::set_content_provider(
+    uint64_t length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)> provider) {
+  assert(length > 0);
+  content_provider_resource_length = length;
+  content_provider = [provider](uint64_t offset, uint64_t length, Out out,
+                                Done) { provider(offset, length, out); };
+  content_fd = -1;
+}
+
+inline void Request::set_chunked_content_provider(
+    std::function<void(uint64_t offset, Out out, Done done)> provider) {
+  content_provider_resource_length = 0;
+  content_provider = [provider](uint64_t offset, uint64_t, Out out, Done done) {
+    provider(offset, out, done);
+  };
+  content_fd = -1;
+}
+
+inline void Request::set_content_file(int fd, uint64_t offset,
+                                      uint64_t length) {
+  content_provider_resource_length = length;
+  content_fd = length ? fd : -1;
+  content_fd_offset = offset;
+
+  // For streams which can't send the file directly, such as TLS.
+  content_provider = nullptr;
+  if (length) {
+    content_provider = [fd, offset](uint64_t off, uint64_t length, Out out,
+                                    Done done) {
+      char buf[CPPHTTPLIB_SEND_BUFSIZ];
+      auto n = detail::read_file(
+          fd, offset + off, buf,
+          static_cast<size_t>(std::min<uint64_t>(length, sizeof(buf))));
+      if (n > 0) {
+        out(buf, static_cast<uint64_t>(n));
+      } else {
+        done();
+      }
+    };
+  }
+}
+
+// Response implementation
+inline void Response::set_receive_buffer(char *buf, size_t size) {
+  receive_buffer = buf;
+  receive_buffer_size = size;
+  receive_fd = -1;
+}
+
+inline void Response::set_receive_file(int fd) {
+  receive_buffer = nullptr;
+  receive_buffer_size = 0;
+  receive_fd = fd;
+}
+
+inline bool Response::has_header(const char *key) const {
+  return headers.find(key) != headers.end();
+}
+
+inline std::string Response::get_header_value(const char *key,
+                                              size_t id) const {
+  return detail::get_header_value(headers, key, id, "");
+}
+
+inline size_t Response::get_header_value_count(const char *key) const {
+  auto r = headers.equal_range(key);
+  return std::distance(r.first, r.second);
+}
+
+inline void Response::set_header(const char *key, const char *val) {
+  headers.emplace(key, val);
+}
+
+inline void Response::set_header(const char *key, const std::string &val) {
+  headers.emplace(key, val);
+}
+
+inline void Response::set_redirect(const char *url) {
+  set_header("Location", url);
+  status = 302;
+}
+
+inline void Response::set_content(const char *s, size_t n,
+                                  const char *content_type) {
+  body.assign(s, n);
+  set_header("Content-Type", content_type);
+}
+
+inline void Response::set_content(const std::string &s,
+                                  const char *content_type) {
+  body = s;
+  set_header("Content-Type", content_type);
+}
+
+inline void Response::set_content_provider(
+    uint64_t length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)> provider,
+    std::function<void()> resource_releaser) {
+  assert(length > 0);
+  content_provider_resource_length = length;
+  content_provider = [provider](uint64_t offset, uint64_t length, Out out,
+                                Done) { provider(offset, length, out); };
+  content_provider_resource_releaser = resource_releaser;
+}
+
+inline void Response::set_chunked_content_provider(
+    std::function<void(uint64_t offset, Out out, Done done)> provider,
+    std::function<void()> resource_releaser) {
+  content_provider_resource_length = 0;
+  content_provider = [provider](uint64_t offset, uint64_t, Out out, Done done) {
+    provider(offset, out, done);
+  };
+  content_provider_resource_releaser = resource_releaser;
+}
+
+// Rstream implementation
+inline bool Stream::writev(const char *ptr1, size_t size1, const char *ptr2,
+                           size_t size2) {
+  return (!size1 || write(ptr1, size1) == static_cast<int>(size1)) &&
+         (!size2 || write(ptr2, size2) == static_cast<int>(size2));
+}
+
+inline bool Stream::write_file(int fd, uint64_t offset, uint64_t length) {
+  char buf[CPPHTTPLIB_SEND_BUFSIZ];
+  while (length > 0) {
+    auto n = detail::read_file(
+        fd, offset, buf,
+        static_cast<size_t>(std::min<uint64_t>(length, sizeof(buf))));
+    if (n <= 0 ||
+        write(buf, static_cast<size_t>(n)) != static_cast<int>(n)) {
+      return false;
+    }
+    offset += static_cast<uint64_t>(n);
+    length -= static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+template <typename... Args>
+inline int Stream::write_format(const char *fmt, const Args &... args) {
+  const auto bufsiz = 2048;
+  char buf[bufsiz];
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+  auto n = _snprintf_s(buf, bufsiz, bufsiz - 1, fmt, args...);
+#else
+  auto n = snprintf(buf, bufsiz - 1, fmt, args...);
+#endif
+  if (n <= 0) { return n; }
+
+  if (n >= bufsiz - 1) {
+    std::vector<char> glowable_buf(bufsiz);
+
+    while (n >= static_cast<int>(glowable_buf.size() - 1)) {
+      glowable_buf.resize(glowable_buf.size() * 2);
+#if defined(_MSC_VER) && _MSC_VER < 1900
+      n = _snprintf_s(&glowable_buf[0], glowable_buf.size(),
+                      glowable_buf.size() - 1, fmt, args...);
+#else
+      n = snprintf(&glowable_buf[0], glowable_buf.size() - 1, fmt, args...);
+#endif
+    }
+    return write(&glowable_buf[0], n);
+  } else {
+    return write(buf, n);
+  }
+}
+
+// Socket stream implementation
+inline SocketStream::SocketStream(socket_t sock) : sock_(sock) {}
+
+inline SocketStream::~SocketStream() {}
+
+inline int SocketStream::read(char *ptr, size_t size) {
+  auto first = first_byte_time_ == std::chrono::steady_clock::time_point();
+  if (!detail::wait_readable(
+          sock_, first ? first_byte_timeout_msec_ : read_timeout_msec_,
+          deadline_)) {
+    return -1;
+  }
+
+  // The count read must fit the return value.
+  size = std::min(size, static_cast<size_t>(std::numeric_limits<int>::max()));
+  auto n = recv(sock_, ptr, static_cast<int>(size), 0);
+  if (n > 0) {
+    if (first) { first_byte_time_ = std::chrono::steady_clock::now(); }
+    bytes_read_ += static_cast<uint64_t>(n);
+  }
+  return static_cast<int>(n);
+}
+
+inline int SocketStream::write(const char *ptr, size_t size) {
+#ifdef MSG_NOSIGNAL
+  auto n = send(sock_, ptr, static_cast<int>(size), MSG_NOSIGNAL);
+#else
+  auto n = send(sock_, ptr, static_cast<int>(size), 0);
+#endif
+  if (n > 0) { bytes_written_ += static_cast<uint64_t>(n); }
+  return static_cast<int>(n);
+}
+
+inline int SocketStream::write(const char *ptr) {
+  return write(ptr, strlen(ptr));
+}
+
+inline int SocketStream::write(const std::string &s) {
+  return write(s.data(), s.size());
+}
+
+inline std::string SocketStream::get_remote_addr() const {
+  return detail::get_remote_addr(sock_);
+}
+
+inline void
+SocketStream::set_read_timeout(time_t first_byte_msec, time_t msec,
+                               std::chrono::steady_clock::time_point deadline) {
+  first_byte_timeout_msec_ = first_byte_msec;
+  read_timeout_msec_ = msec;
+  deadline_ = deadline;
+}
+
+inline std::chrono::steady_clock::time_point
+SocketStream::get_first_byte_time() const {
+  return first_byte_time_;
+}
+
+inline uint64_t SocketStream::get_bytes_read() const { return bytes_read_; }
+
+inline uint64_t SocketStream::get_bytes_written() const {
+  return bytes_written_;
+}
+
+// Both pieces go out in one system call, and so usually in one segment.
+inline bool SocketStream::writev(const char *ptr1, size_t size1,
+                                 const char *ptr2, size_t size2) {
+#ifdef _WIN32
+  return Stream::writev(ptr1, size1, ptr2, size2);
+#else
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char *>(ptr1);
+  iov[0].iov_len = size1;
+  iov[1].iov_base = const_cast<char *>(ptr2);
+  iov[1].iov_len = size2;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  while (msg.msg_iovlen > 0) {
+    if (!msg.msg_iov[0].iov_len) {
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+      continue;
+    }
+
+#ifdef MSG_NOSIGNAL
+    auto n = sendmsg(sock_, &msg, MSG_NOSIGNAL);
+#else
+    auto n = sendmsg(sock_, &msg, 0);
+#endif
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return false; }
+    bytes_written_ += static_cast<uint64_t>(n);
+
+    // Skip what was sent, which may end in the middle of a piece.
+    auto left = static_cast<size_t>(n);
+    while (left > 0) {
+      auto &v = msg.msg_iov[0];
+      auto len = std::min(left, v.iov_len);
+      v.iov_base = static_cast<char *>(v.iov_base) + len;
+      v.iov_len -= len;
+      left -= len;
+      if (!v.iov_len) {
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+    }
+  }
+  return true;
+#endif
+}
+
+// NOTE: sendfile copies the file to the socket inside the kernel. It has no
+// MSG_NOSIGNAL, so SIGPIPE is blocked meanwhile and discarded if it raised it.
+inline bool SocketStream::write_file(int fd, uint64_t offset,
+                                     uint64_t length) {
+#if defined(__linux__)
+  sigset_t sigpipe, old_mask, pending;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask);
+  sigpending(&pending);
+  auto sigpipe_pending = sigismember(&pending, SIGPIPE) == 1;
+
+  auto sent = uint64_t(0);
+  auto ret = true;
+  while (sent < length) {
+    auto off = static_cast<off_t>(offset + sent);
+    auto n = sendfile(sock_, fd, &off,
+                      static_cast<size_t>(
+                          std::min<uint64_t>(length - sent, 0x40000000)));
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) {
+      // Some files, such as pipes, can't be sent this way.
+      ret = n < 0 && !sent && (errno == EINVAL || errno == ENOSYS) &&
+            Stream::write_file(fd, offset, length);
+      break;
+    }
+    sent += static_cast<uint64_t>(n);
+    bytes_written_ += static_cast<uint64_t>(n);
+  }
+
+  if (!ret && !sigpipe_pending) {
+    struct timespec no_wait = {0, 0};
+    sigtimedwait(&sigpipe, nullptr, &no_wait);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+  return ret;
+#elif defined(__APPLE__)
+  // Client sockets have SO_NOSIGPIPE set.
+  auto sent = uint64_t(0);
+  while (sent < length) {
+    auto len =
+        static_cast<off_t>(std::min<uint64_t>(length - sent, 0x40000000));
+    auto ret = sendfile(fd, sock_, static_cast<off_t>(offset + sent), &len,
+                        nullptr, 0);
+    sent += static_cast<uint64_t>(len);
+    if (ret == -1 && errno != EINTR && errno != EAGAIN) {
+      return !sent && (errno == ENOTSOCK || errno == EOPNOTSUPP) &&
+             Stream::write_file(fd, offset, length);
+    }
+    if (ret == 0 && len == 0) { return false; }
+  }
+  return true;
+#else
+  return Stream::write_file(fd, offset, length);
+#endif
+}
+
+// Buffer stream implementation
+inline int BufferStream::read(char *ptr, size_t size) {
+#if defined(_MSC_VER) && _MSC_VER < 1900
+  return static_cast<int>(buffer._Copy_s(ptr, size, size));
+#else
+  return static_cast<int>(buffer.copy(ptr, size));
+#endif
+}
+
+inline int BufferStream::write(const char *ptr, size_t size) {
+  buffer.append(ptr, size);
+  return static_cast<int>(size);
+}
+
+inline int BufferStream::write(const char *ptr) {
+  return write(ptr, strlen(ptr));
+}
+
+inline int BufferStream::write(const std::string &s) {
+  return write(s.data(), s.size());
+}
+
+inline std::string BufferStream::get_remote_addr() const { return ""; }
+
+inline const std::string &BufferStream::get_buffer() const { return buffer; }
+
+// HTTP server implementation
+inline Server::Server()
+    : keep_alive_max_count_(CPPHTTPLIB_KEEPALIVE_MAX_COUNT),
+      keep_alive_timeout_sec_(CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND),
+      keep_alive_timeout_usec_(CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND),
+      adaptive_keep_alive_(false), adaptive_keep_alive_max_connections_(0),
+      task_queue_thread_count_(0),
+      payload_max_length_(CPPHTTPLIB_PAYLOAD_MAX_LENGTH),
+      active_connection_count_(0), is_running_(false),
+      svr_sock_(INVALID_SOCKET), connection_count_(0), request_count_(0),
+      reused_request_count_(0) {
+#ifndef _WIN32
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  new_task_queue = [] {
+#if CPPHTTPLIB_THREAD_POOL_COUNT > 0
+    return new ThreadPool(CPPHTTPLIB_THREAD_POOL_COUNT);
+#else
+    return new Threads();
+#endif
+  };
+}
+
+inline Server::~Server() {}
+
+inline Server &Server::Get(const char *pattern, Handler handler) {
+  get_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline Server &Server::Post(const char *pattern, Handler handler) {
+  post_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline Server &Server::Put(const char *pattern, Handler handler) {
+  put_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline Server &Server::Patch(const char *pattern, Handler handler) {
+  patch_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline Server &Server::Delete(const char *pattern, Handler handler) {
+  delete_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline Server &Server::Options(const char *pattern, Handler handler) {
+  options_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
+inline bool Server::set_base_dir(const char *path) {
+  if (detail::is_dir(path)) {
+    base_dir_ = path;
+    return true;
+  }
+  return false;
+}
+
+inline void Server::set_file_request_handler(Handler handler) {
+  file_request_handler_ = handler;
+}
+
+inline void Server::set_error_handler(Handler handler) {
+  error_handler_ = handler;
+}
+
+inline void Server::set_logger(Logger logger) { logger_ = logger; }
+
+inline void Server::set_keep_alive_max_count(size_t count) {
+  keep_alive_max_count_ = count;
+}
+
+inline void Server::set_keep_alive_timeout(time_t sec, time_t usec) {
+  keep_alive_timeout_sec_ = sec;
+  keep_alive_timeout_usec_ = usec;
+}
+
+inline void Server::set_adaptive_keep_alive(bool enabled,
+                                            size_t max_connections) {
+  adaptive_keep_alive_ = enabled;
+  adaptive_keep_alive_max_connections_ = max_connections;
+}
+
+inline void Server::set_payload_max_length(uint64_t length) {
+  payload_max_length_ = length;
+}
+
+inline KeepAliveStats Server::get_keep_alive_stats() const {
+  KeepAliveStats stats;
+  stats.connections = connection_count_;
+  stats.requests = request_count_;
+  stats.reused_requests = reused_request_count_;
+  stats.active_connections = active_connection_count_;
+  return stats;
+}
+
+inline int Server::bind_to_any_port(const char *host, int socket_flags) {
+  return bind_internal(host, 0, socket_flags);
+}
+
+inline bool Server::listen_after_bind() { return listen_internal(); }
+
+inline bool Server::listen(const char *host, int port, int socket_flags) {
+  if (bind_internal(host, port, socket_flags) < 0) return false;
+  return listen_internal();
+}
+
+inline bool Server::is_running() const { return is_running_; }
+
+inline void Server::stop() {
+  if (is_running_) {
+    assert(svr_sock_ != INVALID_SOCKET);
+    std::atomic<socket_t> sock(svr_sock_.exchange(INVALID_SOCKET));
+    detail::shutdown_socket(sock);
+    detail::close_socket(sock);
+  }
+}
+
+inline bool Server::parse_request_line(const char *s, Request &req) {
+  static std::regex re("(GET|HEAD|POST|PUT|PATCH|DELETE|OPTIONS) "
+                       "(([^?]+)(?:\\?(.+?))?) (HTTP/1\\.[01])\r\n");
+
+  std::cmatch m;
+  if (std::regex_match(s, m, re)) {
+    req.version = std::string(m[5]);
+    req.method = std::string(m[1]);
+    req.target = std::string(m[2]);
+    req.path = detail::decode_url(m[3]);
+
+    // Parse query text
+    auto len = std::distance(m[4].first, m[4].second);
+    if (len > 0) { detail::parse_query_text(m[4], req.params); }
+
+    return true;
+  }
+
+  return false;
+}
+
+inline bool Server::write_response(Stream &strm, bool last_connection,
+                                   const Request &req, Response &res) {
+  assert(res.status != -1);
+
+  if (400 <= res.status && error_handler_) { error_handler_(req, res); }
+
+  // Response line
+  if (!strm.write_format("HTTP/1.1 %d %s\r\n", res.status,
+                         detail::status_message(res.status))) {
+    return false;
+  }
+
+  // Headers
+  if (last_connection || req.get_header_value("Connection") == "close") {
+    res.set_header("Connection", "close");
+  }
+
+  if (!last_connection && req.get_header_value("Connection") == "Keep-Alive") {
+    res.set_header("Connection", "Keep-Alive");
+  }
+
+  std::string content_type;
+  std::string boundary;
+  prepare_response(req, res, boundary, content_type);
+
+  if (!detail::write_headers(strm, res)) { return false; }
+
+  // Body
+  if (req.method != "HEAD") {
+    if (!res.body.empty()) {
+      if (!strm.write(res.body)) { return false; }
+    } else if (res.content_provider) {
+      if (!write_content_with_provider(strm, req, res, boundary,
+                                       content_type)) {
+        return false;
+      }
+    }
+  }
+
+  // Log
+  if (logger_) { logger_(req, res); }
+
+  return true;
+}
+
+// Fills in the entity headers and applies ranges and compression to the body.
+inline void Server::prepare_response(const Request &req, Response &res,
+                                     std::string &boundary,
+                                     std::string &content_type) {
+  if (!res.has_header("Content-Type")) {
+    res.set_header("Content-Type", "text/plain");
+  }
+
+  if (!res.has_header("Accept-Ranges")) {
+    res.set_header("Accept-Ranges", "bytes");
+  }
+
+  if (req.ranges.size() > 1) {
+    boundary = detail::make_multipart_data_boundary();
+
+    auto it = res.headers.find("Content-Type");
+    if (it != res.headers.end()) {
+      content_type = it->second;
+      res.headers.erase(it);
+    }
+
+    res.headers.emplace("Content-Type",
+                        "multipart/byteranges; boundary=" + boundary);
+  }
+
+  if (res.body.empty()) {
+    if (res.content_provider_resource_length > 0) {
+      uint64_t length = 0;
+      if (req.ranges.empty()) {
+        length = res.content_provider_resource_length;
+      } else if (req.ranges.size() == 1) {
+        auto offsets = detail::get_range_offset_and_length(
+            req, res.content_provider_resource_length, 0);
+        auto offset = offsets.first;
+        length = offsets.second;
+        auto content_range = detail::make_content_range_header_field(
+            offset, length, res.content_provider_resource_length);
+        res.set_header("Content-Range", content_range);
+      } else {
+        length = detail::get_multipart_ranges_data_length(req, res, boundary,
+                                                          content_type);
+      }
+      res.set_header("Content-Length", std::to_string(length));
+    } else {
+      if (res.content_provider) {
+        res.set_header("Transfer-Encoding", "chunked");
+      } else {
+        res.set_header("Content-Length", "0");
+      }
+    }
+  } else {
+    if (req.ranges.empty()) {
+      ;
+    } else if (req.ranges.size() == 1) {
+      auto offsets =
+          detail::get_range_offset_and_length(req, res.body.size(), 0);
+      auto offset = offsets.first;
+      auto length = offsets.second;
+      auto content_range = detail::make_content_range_header_field(
+          offset, length, res.body.size());
+      res.set_header("Content-Range", content_range);
+      res.body = res.body.substr(offset, length);
+    } else {
+      res.body =
+          detail::make_multipart_ranges_data(req, res, boundary, content_type);
+    }
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+    // TODO: 'Accpet-Encoding' has gzip, not gzip;q=0
+    const auto &encodings = req.get_header_value("Accept-Encoding");
+    if (encodings.find("gzip") != std::string::npos &&
+        detail::can_compress(res.get_header_value("Content-Type"))) {
+      if (detail::compress(res.body)) {
+        res.set_header("Content-Encoding", "gzip");
+      }
+    }
+#endif
+
+    auto length = std::to_string(res.body.size());
+    res.set_header("Content-Length", length);
+  }
+}
+
+inline bool
+Server::write_content_with_provider(Stream &strm, const Request &req,
+                                    Response &res, const std::string &boundary,
+                                    const std::string &content_type) {
+  if (res.content_provider_resource_length) {
+    if (req.ranges.empty()) {
+      if (detail::write_content(strm, res.content_provider, 0,
+                                res.content_provider_resource_length) < 0) {
+        return false;
+      }
+    } else if (req.ranges.size() == 1) {
+      auto offsets = detail::get_range_offset_and_length(
+          req, res.content_provider_resource_length, 0);
+      auto offset = offsets.first;
+      auto length = offsets.second;
+      if (detail::write_content(strm, res.content_provider, offset, length) <
+          0) {
+        return false;
+      }
+    } else {
+      if (!detail::write_multipart_ranges_data(strm, req, res, boundary,
+                                               content_type)) {
+        return false;
+      }
+    }
+  } else {
+    if (detail::write_content_chunked(strm, res.content_provider) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool Server::handle_file_request(Request &req, Response &res) {
+  if (!base_dir_.empty() && detail::is_valid_path(req.path)) {
+    std::string path = base_dir_ + req.path;
+
+    if (!path.empty() && path.back() == '/') { path += "index.html"; }
+
+    if (detail::is_file(path)) {
+      detail::read_file(path, res.body);
+      auto type = detail::find_content_type(path);
+      if (type) { res.set_header("Content-Type", type); }
+      res.status = 200;
+      if (file_request_handler_) {
+        file_request_handler_(req, res);
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+inline socket_t Server::create_server_socket(const char *host, int port,
+                                             int socket_flags) const {
+  return detail::create_socket(
+      host, port,
+      [](socket_t sock, struct addrinfo &ai) -> bool {
+        if (::bind(sock, ai.ai_addr, static_cast<int>(ai.ai_addrlen))) {
+          return false;
+        }
+        if (::listen(sock, 5)) { // Listen through 5 channels
+          return false;
+        }
+        return true;
+      },
+      socket_flags);
+}
+
+inline int Server::bind_internal(const char *host, int port, int socket_flags) {
+  if (!is_valid()) { return -1; }
+
+  svr_sock_ = create_server_socket(host, port, socket_flags);
+  if (svr_sock_ == INVALID_SOCKET) { return -1; }
+
+  if (port == 0) {
+    struct sockaddr_storage address;
+    socklen_t len = sizeof(address);
+    if (getsockname(svr_sock_, reinterpret_cast<struct sockaddr *>(&address),
+                    &len) == -1) {
+      return -1;
+    }
+    if (address.ss_family == AF_INET) {
+      return ntohs(reinterpret_cast<struct sockaddr_in *>(&address)->sin_port);
+    } else if (address.ss_family == AF_INET6) {
+      return ntohs(
+          reinterpret_cast<struct sockaddr_in6 *>(&address)->sin6_port);
+    } else {
+      return -1;
+    }
+  } else {
+    return port;
+  }
+}
+
+inline bool Server::listen_internal() {
+  auto ret = true;
+  is_running_ = true;
+
+  {
+    std::unique_ptr<TaskQueue> task_queue(new_task_queue());
+    task_queue_thread_count_ = task_queue->get_thread_count();
+    readiness_loop_.start(*task_queue);
+
+    for (;;) {
+      if (svr_sock_ == INVALID_SOCKET) {
+        // The server socket was closed by 'stop' method.
+        break;
+      }
+
+      auto val = detail::select_read(svr_sock_, 0, 100000);
+
+      if (val == 0) { // Timeout
+        continue;
+      }
+
+      socket_t sock = accept(svr_sock_, nullptr, nullptr);
+
+      if (sock == INVALID_SOCKET) {
+        if (svr_sock_ != INVALID_SOCKET) {
+          detail::close_socket(svr_sock_);
+          ret = false;
+        } else {
+          ; // The server socket was closed by user.
+        }
+        break;
+      }
+
+      connection_count_++;
+      active_connection_count_++;
+
+      task_queue->enqueue([=]() { read_and_close_socket(sock); });
+    }
+
+    readiness_loop_.stop();
+    task_queue->shutdown();
+  }
+
+  is_running_ = false;
+  return ret;
+}
+
+inline bool Server::routing(Request &req, Response &res) {
+  if (req.method == "GET" && handle_file_request(req, res)) { return true; }
+
+  if (req.method == "GET" || req.method == "HEAD") {
+    return dispatch_request(req, res, get_handlers_);
+  } else if (req.method == "POST") {
+    return dispatch_request(req, res, post_handlers_);
+  } else if (req.method == "PUT") {
+    return dispatch_request(req, res, put_handlers_);
+  } else if (req.method == "PATCH") {
+    return dispatch_request(req, res, patch_handlers_);
+  } else if (req.method == "DELETE") {
+    return dispatch_request(req, res, delete_handlers_);
+  } else if (req.method == "OPTIONS") {
+    return dispatch_request(req, res, options_handlers_);
+  }
+  return false;
+}
+
+inline bool Server::dispatch_request(Request &req, Response &res,
+                                     Handlers &handlers) {
+  for (const auto &x : handlers) {
+    const auto &pattern = x.first;
+    const auto &handler = x.second;
+
+    if (std::regex_match(req.path, req.matches, pattern)) {
+      handler(req, res);
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool
+Server::process_request(Stream &strm, bool last_connection,
+                        bool &connection_close,
+                        std::function<void(Request &)> setup_request) {
+  const auto bufsiz = 2048;
+  char buf[bufsiz];
+
+  detail::stream_line_reader reader(strm, buf, bufsiz);
+
+  // Connection has been closed on client
+  if (!reader.getline()) { return false; }
+
+  Request req;
+  Response res;
+
+  res.version = "HTTP/1.1";
+
+  // Check if the request URI doesn't exceed the limit
+  if (reader.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
+    Headers dummy;
+    detail::read_headers(strm, dummy);
+    res.status = 414;
+    return write_response(strm, last_connection, req, res);
+  }
+
+  // Request line and headers
+  if (!parse_request_line(reader.ptr(), req) ||
+      !detail::read_headers(strm, req.headers)) {
+    res.status = 400;
+    return write_response(strm, last_connection, req, res);
+  }
+
+  if (req.get_header_value("Connection") == "close") {
+    connection_close = true;
+  }
+
+  if (req.version == "HTTP/1.0" &&
+      req.get_header_value("Connection") != "Keep-Alive") {
+    connection_close = true;
+  }
+
+  req.set_header("REMOTE_ADDR", strm.get_remote_addr());
+
+  // Body
+  if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH") {
+    if (!detail::read_content(strm, req, payload_max_length_, res.status,
+                              Progress(), [&](const char *buf, size_t n) {
+                                req.body.append(buf, n);
+                                return true;
+                              })) {
+      return write_response(strm, last_connection, req, res);
+    }
+  }
+
+  handle_request(req, res, setup_request);
+
+  return write_response(strm, last_connection, req, res);
+}
+
+// Parses the request body and parameters, then dispatches the request to its
+// handler. Shared by every protocol the server speaks.
+inline void
+Server::handle_request(Request &req, Response &res,
+                       std::function<void(Request &)> setup_request) {
+  if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH") {
+    const auto &content_type = req.get_header_value("Content-Type");
+
+    if (!content_type.find("application/x-www-form-urlencoded")) {
+      detail::parse_query_text(req.body, req.params);
+    } else if (!content_type.find("multipart/form-data")) {
+      std::string boundary;
+      if (!detail::parse_multipart_boundary(content_type, boundary) ||
+          !detail::parse_multipart_formdata(boundary, req.body, req.files)) {
+        res.status = 400;
+        return;
+      }
+    }
+  }
+
+  if (req.has_header("Range")) {
+    const auto &range_header_value = req.get_header_value("Range");
+    if (!detail::parse_range_header(range_header_value, req.ranges)) {
+      // TODO: error
+    }
+  }
+
+  if (setup_request) { setup_request(req); }
+
+  if (routing(req, res)) {
+    if (res.status == -1) { res.status = req.ranges.empty() ? 200 : 206; }
+  } else {
+    res.status = 404;
+  }
+}
+
+inline bool Server::is_valid() const { return true; }
+
+inline void Server::get_keep_alive_policy(size_t &max_count, time_t &sec,
+                                          time_t &usec) const {
+  max_count = keep_alive_max_count_;
+  sec = keep_alive_timeout_sec_;
+  usec = keep_alive_timeout_usec_;
+
+  auto capacity = get_keep_alive_capacity();
+  if (!capacity || !max_count) { return; }
+
+  // Connections waiting for a worker are counted as well, since every idle
+  // keep-alive connection holds a worker until its timeout expires.
+  uint64_t active = active_connection_count_;
+  uint64_t total_usec = sec * 1000000 + usec;
+
+  if (active * 2 <= capacity) {
+    // Lightly loaded: let clients reuse their connections longer.
+    max_count *= 2;
+    total_usec *= 2;
+  } else if (active >= capacity) {
+    // Every worker is taken: serve the pending request and hand the worker
+    // back quickly.
+    max_count = 1;
+    total_usec /= 4;
+  } else {
+    // Scale the idle timeout down linearly with the remaining headroom.
+    total_usec = total_usec * (capacity - active) * 2 / capacity;
+  }
+
+  sec = static_cast<time_t>(total_usec / 1000000);
+  usec = static_cast<time_t>(total_usec % 1000000);
+}
+
+inline bool Server::is_keep_alive_under_pressure() const {
+  auto capacity = get_keep_alive_capacity();
+  return capacity && active_connection_count_ >= capacity;
+}
+
+// How many connections can be served at once, or 0 when it isn't limited or
+// adaptive keep-alive is off.
+inline size_t Server::get_keep_alive_capacity() const {
+  if (!adaptive_keep_alive_) { return 0; }
+
+  return adaptive_keep_alive_max_connections_
+             ? adaptive_keep_alive_max_connections_
+             : task_queue_thread_count_.load();
+}
+
+inline void Server::count_request(Request &req,
+                                  size_t &connection_request_count) {
+  req.connection_request_count = ++connection_request_count;
+
+  request_count_++;
+  if (connection_request_count > 1) { reused_request_count_++; }
+}
+
+inline bool Server::read_and_close_socket(socket_t sock) {
+  size_t keep_alive_max_count;
+  time_t keep_alive_timeout_sec;
+  time_t keep_alive_timeout_usec;
+  get_keep_alive_policy(keep_alive_max_count, keep_alive_timeout_sec,
+                        keep_alive_timeout_usec);
+
+  size_t connection_request_count = 0;
+
+  auto ret = detail::read_and_close_socket(
+      sock, keep_alive_max_count, keep_alive_timeout_sec,
+      keep_alive_timeout_usec,
+      [&](Stream &strm, bool last_connection, bool &connection_close) {
+        return process_request(
+            strm, last_connection || is_keep_alive_under_pressure(),
+            connection_close, [&](Request &req) {
+              count_request(req, connection_request_count);
+            });
+      });
+
+  active_connection_count_--;
+  return ret;
+}
+
+// DNS cache implementation
+inline DnsCache::DnsCache(Resolver resolver, time_t ttl_sec,
+                          time_t negative_ttl_sec, size_t max_entry_count)
+    : state_(std::make_shared<detail::DnsCacheState>()) {
+  state_->resolver = resolver ? resolver : detail::resolve_address;
+  state_->ttl = std::chrono::seconds(ttl_sec);
+  state_->negative_ttl = std::chrono::seconds(negative_ttl_sec);
+  state_->max_entry_count = max_entry_count;
+}
+
+inline bool DnsCache::resolve(const std::string &host, int port,
+                              std::vector<struct sockaddr_storage> &addrs) {
+  auto state = state_;
+  auto key = host + ":" + std::to_string(port);
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  for (;;) {
+    auto it = state->entries.find(key);
+    if (it == state->entries.end()) { break; }
+
+    auto &entry = it->second;
+    if (entry.resolving) {
+      state->cond.wait(lock);
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now >= entry.expires) { break; }
+
+    if (entry.resolved && !entry.refreshing && now >= entry.refresh_after) {
+      entry.refreshing = true;
+      std::thread([state, host, port, key]() {
+        std::vector<struct sockaddr_storage> fresh;
+        auto resolved = state->resolver(host, port, fresh) && !fresh.empty();
+
+        std::lock_guard<std::mutex> guard(state->mutex);
+        auto it = state->entries.find(key);
+        if (it == state->entries.end()) { return; }
+        it->second.refreshing = false;
+        // A failed refresh keeps serving the current addresses until expiry.
+        if (resolved) { state->update(it->second, true, fresh); }
+      }).detach();
+    }
+
+    if (!entry.resolved) { return false; }
+    addrs = entry.addrs;
+    return true;
+  }
+
+  state->entries[key].resolving = true;
+  lock.unlock();
+
+  std::vector<struct sockaddr_storage> result;
+  auto resolved = state->resolver(host, port, result) && !result.empty();
+
+  lock.lock();
+  auto &entry = state->entries[key];
+  entry.resolving = false;
+  state->update(entry, resolved, result);
+  state->evict();
+  state->cond.notify_all();
+
+  if (!resolved) { return false; }
+  addrs = result;
+  return true;
+}
+
+inline bool DnsCache::is_cached(const std::string &host, int port) {
+  std::lock_guard<std::mutex> guard(state_->mutex);
+  auto it = state_->entries.find(host + ":" + std::to_string(port));
+  return it != state_->entries.end() && !it->second.resolving &&
+         std::chrono::steady_clock::now() < it->second.expires;
+}
+
+inline void DnsCache::remove(const std::string &host, int port) {
+  std::lock_guard<std::mutex> guard(state_->mutex);
+  auto it = state_->entries.find(host + ":" + std::to_string(port));
+  if (it != state_->entries.end() && !it->second.resolving) {
+    state_->entries.erase(it);
+  }
+}
+
+inline void DnsCache::clear() {
+  std::lock_guard<std::mutex> guard(state_->mutex);
+  for (auto it = state_->entries.begin(); it != state_->entries.end();) {
+    it = it->second.resolving ? std::next(it) : state_->entries.erase(it);
+  }
+}
+
+inline std::shared_ptr<DnsCache> DnsCache::default_instance() {
+  static auto dns_cache = std::make_shared<DnsCache>();
+  return dns_cache;
+}
+
+// Request coalescer implementation
+inline bool RequestCoalescer::send(const std::string &key, const Request &req,
+                                   Response &res,
+                                   std::function<bool(Response &res)> fetch) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  auto it = fetches_.find(key);
+  if (it == fetches_.end()) {
+    auto leader = std::make_shared<detail::CoalescedFetch>();
+    leader->headers = req.headers;
+    fetches_[key] = leader;
+    lock.unlock();
+
+    auto ret = fetch(res);
+    if (ret) {
+      leader->res.version = res.version;
+      leader->res.status = res.status;
+      leader->res.headers = res.headers;
+      leader->res.body = res.body;
+    }
+
+    lock.lock();
+    fetches_.erase(key);
+    leader->done = true;
+    leader->ok = ret;
+    cond_.notify_all();
+    return ret;
+  }
+
+  auto leader = it->second;
+  cond_.wait(lock, [&] { return leader->done; });
+  lock.unlock();
+
+  if (!leader->ok) { return false; }
+
+  // Requests which the response doesn't fit are coalesced by what it varies
+  // on.
+  std::string leader_key;
+  std::string vary_key;
+  if (!detail::append_vary_key(leader->res.headers, leader->headers,
+                               leader_key) ||
+      !detail::append_vary_key(leader->res.headers, req.headers, vary_key)) {
+    return fetch(res);
+  }
+  if (vary_key != leader_key) { return send(key + vary_key, req, res, fetch); }
+
+  res.version = leader->res.version;
+  res.status = leader->res.status;
+  res.headers = leader->res.headers;
+  res.body = leader->res.body;
+  return true;
+}
+
+inline std::shared_ptr<RequestCoalescer> RequestCoalescer::default_instance() {
+  static auto coalescer = std::make_shared<RequestCoalescer>();
+  return coalescer;
+}
+
+// Response cache implementation
+inline ResponseCache::ResponseCache(size_t memory_max_size,
+                                    const std::string &dir,
+                                    size_t disk_max_size)
+    : memory_max_size_(memory_max_size), dir_(dir),
+      disk_max_size_(disk_max_size) {
+  if (dir_.empty()) { return; }
+
+  // Files left by earlier processes count as well, the newest first.
+  std::vector<detail::CacheFile> files;
+  detail::list_cache_files(dir_, files);
+  std::sort(files.begin(), files.end(),
+            [](const detail::CacheFile &a, const detail::CacheFile &b) {
+              return a.modified < b.modified;
+            });
+  for (const auto &file : files) {
+    use_file(file.name, file.size);
+  }
+}
+
+inline bool ResponseCache::get(const std::string &key, const Request &req,
+                               Response &res, Headers &conditions) {
+  auto entry = find(key, req);
+  if (!entry) { return false; }
+
+  auto age = entry->initial_age + (time(nullptr) - entry->response_time);
+  time_t max_age = 0;
+  auto fresh =
+      !entry->no_cache && age < entry->lifetime &&
+      !detail::get_cache_directive(req.headers, "no-cache") &&
+      req.get_header_value("Pragma") != "no-cache" &&
+      !(detail::get_cache_directive_seconds(req.headers, "max-age", max_age) &&
+        age > max_age);
+
+  if (fresh) {
+    detail::fill_cached_response(*entry, age, res);
+    return true;
+  }
+
+  auto etag = entry->headers.find("ETag");
+  if (etag != entry->headers.end()) {
+    conditions.emplace("If-None-Match", etag->second);
+  }
+  auto last_modified = entry->headers.find("Last-Modified");
+  if (last_modified != entry->headers.end()) {
+    conditions.emplace("If-Modified-Since", last_modified->second);
+  }
+  return false;
+}
+
+inline void ResponseCache::put(const std::string &key, const Request &req,
+                               const Response &res) {
+  if (!detail::is_cacheable_status(res.status) ||
+      detail::get_cache_directive(res.headers, "no-store")) {
+    return;
+  }
+
+  auto entry = std::make_shared<detail::CachedResponse>();
+  entry->key = key;
+  if (!detail::append_vary_key(res.headers, req.headers, entry->vary_key)) {
+    return;
+  }
+
+  entry->status = res.status;
+  entry->headers = res.headers;
+  entry->headers.erase("Connection");
+  entry->headers.erase("Keep-Alive");
+  entry->headers.erase("Transfer-Encoding");
+  detail::update_freshness(*entry, time(nullptr));
+
+  // Neither fresh nor revalidatable, so of no use.
+  if (entry->lifetime <= 0 && !entry->headers.count("ETag") &&
+      !entry->headers.count("Last-Modified")) {
+    return;
+  }
+
+  entry->body = res.body;
+  store(entry);
+  save(*entry);
+}
+
+inline bool ResponseCache::refresh(const std::string &key, const Request &req,
+                                   Response &res) {
+  auto stored = find(key, req);
+  if (!stored) { return false; }
+
+  auto entry = std::make_shared<detail::CachedResponse>(*stored);
+  for (const auto &x : res.headers) {
+    entry->headers.erase(x.first);
+  }
+  for (const auto &x : res.headers) {
+    entry->headers.emplace(x.first, x.second);
+  }
+  // A 304 may describe its own empty body.
+  entry->headers.erase("Connection");
+  entry->headers.erase("Keep-Alive");
+  entry->headers.erase("Transfer-Encoding");
+  entry->headers.erase("Content-Length");
+  entry->headers.emplace("Content-Length", std::to_string(entry->body.size()));
+  detail::update_freshness(*entry, time(nullptr));
+
+  if (detail::get_cache_directive(entry->headers, "no-store")) {
+    remove(key.substr(0, key.find('\n')));
+  } else {
+    store(entry);
+    save(*entry);
+  }
+
+  detail::fill_cached_response(*entry, entry->initial_age, res);
+  return true;
+}
+
+inline void ResponseCache::remove(const std::string &url_key) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = index_.lower_bound(std::make_pair(url_key, std::string()));
+    while (it != index_.end() &&
+           !it->first.first.compare(0, url_key.size(), url_key)) {
+      const auto &key = it->first.first;
+      if (key.size() == url_key.size() || key[url_key.size()] == '\n') {
+        memory_size_ -= detail::get_cached_size(**it->second);
+        entries_.erase(it->second);
+        it = index_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  if (dir_.empty()) { return; }
+
+  // Every variant's file starts with the name of the one which doesn't vary.
+  auto prefix = detail::get_cache_file_name(url_key, std::string());
+  std::lock_guard<std::mutex> guard(disk_mutex_);
+  auto it = file_index_.lower_bound(prefix);
+  while (it != file_index_.end() &&
+         !it->first.compare(0, prefix.size(), prefix)) {
+    std::remove(get_path(it->first).c_str());
+    disk_size_ -= it->second->second;
+    files_.erase(it->second);
+    it = file_index_.erase(it);
+  }
+  std::remove(get_path(prefix).c_str());
+}
+
+inline std::shared_ptr<detail::CachedResponse>
+ResponseCache::find(const std::string &key, const Request &req) {
+  // Any variant tells which request headers the response varies on.
+  std::shared_ptr<detail::CachedResponse> variant;
+  std::string vary_key;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = index_.lower_bound(std::make_pair(key, std::string()));
+    for (; it != index_.end() && it->first.first == key; ++it) {
+      const auto &entry = *it->second;
+      vary_key.clear();
+      detail::append_vary_key(entry->headers, req.headers, vary_key);
+      if (vary_key == entry->vary_key) {
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return entry;
+      }
+      variant = entry;
+    }
+  }
+
+  if (dir_.empty() || detail::has_credentials(key)) { return nullptr; }
+
+  if (!variant) {
+    auto name = detail::get_cache_file_name(key, std::string());
+    {
+      std::lock_guard<std::mutex> guard(disk_mutex_);
+      auto it = file_index_.lower_bound(name);
+      if (it != file_index_.end() && !it->first.compare(0, name.size(), name)) {
+        name = it->first;
+      }
+    }
+    variant = load(key, name);
+    if (!variant) { return nullptr; }
+
+    vary_key.clear();
+    detail::append_vary_key(variant->headers, req.headers, vary_key);
+    if (vary_key == variant->vary_key) { return variant; }
+  }
+
+  if (detail::has_credentials(vary_key)) { return nullptr; }
+  auto entry = load(key, detail::get_cache_file_name(key, vary_key));
+  if (!entry || entry->vary_key != vary_key) { return nullptr; }
+  return entry;
+}
+
+inline std::shared_ptr<detail::CachedResponse>
+ResponseCache::load(const std::string &key, const std::string &name) {
+  auto entry = std::make_shared<detail::CachedResponse>();
+  size_t size = 0;
+  if (!detail::read_cached_response(get_path(name), *entry, size) ||
+      entry->key != key ||
+      name != detail::get_cache_file_name(key, entry->vary_key)) {
+    return nullptr;
+  }
+  use_file(name, size);
+  store(entry);
+  return entry;
+}
+
+inline void
+ResponseCache::store(std::shared_ptr<detail::CachedResponse> entry) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  auto it = index_.find(std::make_pair(entry->key, entry->vary_key));
+  if (it != index_.end()) {
+    memory_size_ -= detail::get_cached_size(**it->second);
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+
+  auto size = detail::get_cached_size(*entry);
+  if (size > memory_max_size_) { return; }
+
+  entries_.push_front(entry);
+  index_[std::make_pair(entry->key, entry->vary_key)] = entries_.begin();
+  memory_size_ += size;
+
+  while (memory_size_ > memory_max_size_) {
+    const auto &last = entries_.back();
+    memory_size_ -= detail::get_cached_size(*last);
+    index_.erase(std::make_pair(last->key, last->vary_key));
+    entries_.pop_back();
+  }
+}
+
+inline void ResponseCache::save(const detail::CachedResponse &entry) {
+  if (dir_.empty() || detail::has_credentials(entry.key) ||
+      detail::has_credentials(entry.vary_key) ||
+      detail::get_cached_size(entry) > disk_max_size_) {
+    return;
+  }
+
+  auto name = detail::get_cache_file_name(entry.key, entry.vary_key);
+  size_t size = 0;
+  if (detail::write_cached_response(get_path(name), entry, size)) {
+    use_file(name, size);
+  }
+}
+
+inline std::string ResponseCache::get_path(const std::string &name) const {
+  return dir_ + "/" + name;
+}
+
+inline void ResponseCache::use_file(const std::string &name, size_t size) {
+  std::lock_guard<std::mutex> guard(disk_mutex_);
+
+  auto it = file_index_.find(name);
+  if (it != file_index_.end()) {
+    disk_size_ -= it->second->second;
+    files_.erase(it->second);
+  }
+  files_.emplace_front(name, size);
+  file_index_[name] = files_.begin();
+  disk_size_ += size;
+
+  while (disk_size_ > disk_max_size_ && !files_.empty()) {
+    const auto &last = files_.back();
+    std::remove(get_path(last.first).c_str());
+    disk_size_ -= last.second;
+    file_index_.erase(last.first);
+    files_.pop_back();
+  }
+}
+
+// HTTP client implementation
+inline Client::Client(const char *host, int port, time_t timeout_sec)
+    : host_(host), port_(port),
+      host_and_port_(host_ + ":" + std::to_string(port_)),
+      connect_timeout_msec_(timeout_sec * 1000),
+      tls_handshake_timeout_msec_(CPPHTTPLIB_SSL_HANDSHAKE_TIMEOUT_SECOND *
+                                  1000),
+      first_byte_timeout_msec_(CPPHTTPLIB_READ_TIMEOUT_SECOND * 1000 +
+                               CPPHTTPLIB_READ_TIMEOUT_USECOND / 1000),
+      read_timeout_msec_(first_byte_timeout_msec_), total_timeout_msec_(0),
+      adaptive_timeouts_(false),
+      keep_alive_max_idle_count_(CPPHTTPLIB_CLIENT_KEEPALIVE_MAX_IDLE_COUNT),
+      keep_alive_idle_timeout_sec_(
+          CPPHTTPLIB_CLIENT_KEEPALIVE_IDLE_TIMEOUT_SECOND),
+      dns_cache_(DnsCache::default_instance()),
+      body_reserve_max_length_(CPPHTTPLIB_BODY_RESERVE_MAX_LENGTH),
+      hedging_(std::make_shared<detail::HedgingPolicy>()),
+      async_calls_(std::make_shared<detail::ClientAsyncCalls>()) {}
+
+inline Client::~Client() { async_calls_->cancel_and_wait(); }
+
+inline bool Client::is_valid() const { return true; }
+
+inline socket_t
+Client::create_client_socket(const detail::ClientTimeouts &timeouts,
+                             ResponseTiming &timing) const {
+  std::vector<struct sockaddr_storage> addrs;
+  if (!resolve_host(addrs, timing)) { return INVALID_SOCKET; }
+
+  auto timeout_msec =
+      detail::get_remaining_msec(timeouts.connect_msec, timeouts.deadline);
+  if (timeout_msec < 0) { return INVALID_SOCKET; }
+
+  auto start = std::chrono::steady_clock::now();
+  auto sock = detail::connect_to_any_address(
+      addrs, timeout_msec, CPPHTTPLIB_CONNECTION_ATTEMPT_DELAY_MSECOND,
+      timeouts.cancellation);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  timing.connect = elapsed;
+
+  if (detail::is_cancelled(timeouts.cancellation)) {
+    if (sock != INVALID_SOCKET) { detail::close_socket(sock); }
+    return INVALID_SOCKET;
+  }
+
+  record_connect(sock, timeouts, timeout_msec, elapsed);
+  return sock;
+}
+
+inline bool Client::resolve_host(std::vector<struct sockaddr_storage> &addrs,
+                                 ResponseTiming &timing) const {
+  auto start = std::chrono::steady_clock::now();
+  auto resolved = dns_cache_ ? dns_cache_->resolve(host_, port_, addrs)
+                             : detail::resolve_address(host_, port_, addrs);
+  timing.dns = std::chrono::steady_clock::now() - start;
+  return resolved;
+}
+
+inline void
+Client::record_connect(socket_t sock, const detail::ClientTimeouts &timeouts,
+                       time_t timeout_msec,
+                       std::chrono::steady_clock::duration elapsed) const {
+  if (timeouts.adaptive) {
+    auto &rtt_cache = detail::OriginRttCache::get();
+    if (sock != INVALID_SOCKET) {
+      rtt_cache.add(host_and_port_, false, elapsed);
+    } else if (timeout_msec &&
+               elapsed >= std::chrono::milliseconds(timeout_msec)) {
+      rtt_cache.back_off(host_and_port_, false);
+    }
+  }
+
+  // The host may have moved since its addresses were cached.
+  if (sock == INVALID_SOCKET && dns_cache_) {
+    dns_cache_->remove(host_, port_);
+  }
+}
+
+inline detail::ClientTimeouts Client::get_timeouts() const {
+  detail::ClientTimeouts timeouts;
+  timeouts.connect_msec = connect_timeout_msec_;
+  timeouts.tls_handshake_msec = tls_handshake_timeout_msec_;
+  timeouts.first_byte_msec = first_byte_timeout_msec_;
+  timeouts.read_msec = read_timeout_msec_;
+  if (total_timeout_msec_) {
+    timeouts.deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(total_timeout_msec_);
+  }
+
+  if (adaptive_timeouts_) {
+    auto rtt = detail::OriginRttCache::get().lookup(host_and_port_);
+    double factor = CPPHTTPLIB_ADAPTIVE_TIMEOUT_RTT_FACTOR;
+    time_t min_msec = CPPHTTPLIB_ADAPTIVE_TIMEOUT_MIN_MSECOND;
+
+    // A full TLS handshake takes two round trips, one with TLS 1.3.
+    timeouts.connect_msec =
+        rtt.connect.get_timeout_msec(factor, min_msec, connect_timeout_msec_);
+    timeouts.tls_handshake_msec = rtt.connect.get_timeout_msec(
+        2 * factor, min_msec, tls_handshake_timeout_msec_);
+
+    // The time to the first byte includes the server's, which varies far
+    // more than the network's, so it only cuts short a wait much longer
+    // than usual. It stays above a few lost segments' worth of TCP
+    // retransmission timeouts. Reads keep the timeout set.
+    timeouts.first_byte_msec = rtt.first_byte.get_timeout_msec(
+        CPPHTTPLIB_ADAPTIVE_FIRST_BYTE_TIMEOUT_FACTOR,
+        CPPHTTPLIB_ADAPTIVE_FIRST_BYTE_TIMEOUT_MIN_MSECOND,
+        first_byte_timeout_msec_);
+    timeouts.adaptive = true;
+  }
+  return timeouts;
+}
+
+inline bool Client::read_response_line(Stream &strm, Response &res) {
+  const auto bufsiz = 2048;
+  char buf[bufsiz];
+
+  detail::stream_line_reader reader(strm, buf, bufsiz);
+
+  if (!reader.getline()) { return false; }
+
+  const static std::regex re("(HTTP/1\\.[01]) (\\d+?) .*\r\n");
+
+  std::cmatch m;
+  if (std::regex_match(reader.ptr(), m, re)) {
+    res.version = std::string(m[1]);
+    res.status = std::stoi(std::string(m[2]));
+  }
+
+  return true;
+}
+
+inline void Client::set_keep_alive_max_idle_count(size_t count) {
+  keep_alive_max_idle_count_ = count;
+}
+
+inline void Client::set_keep_alive_idle_timeout(time_t sec) {
+  keep_alive_idle_timeout_sec_ = sec;
+}
+
+inline void Client::set_dns_cache(std::shared_ptr<DnsCache> dns_cache) {
+  dns_cache_ = dns_cache;
+}
+
+inline void Client::set_body_reserve_max_length(size_t length) {
+  body_reserve_max_length_ = length;
+}
+
+inline void
+Client::set_request_coalescer(std::shared_ptr<RequestCoalescer> coalescer) {
+  request_coalescer_ = coalescer;
+}
+
+inline void Client::set_response_cache(std::shared_ptr<ResponseCache> cache) {
+  response_cache_ = cache;
+}
+
+inline void Client::enable_hedging(bool enabled, double percentile,
+                                   double budget) {
+  hedging_->enable(enabled, percentile, budget);
+}
+
+inline void Client::set_connect_timeout(time_t msec) {
+  connect_timeout_msec_ = msec;
+}
+
+inline void Client::set_tls_handshake_timeout(time_t msec) {
+  tls_handshake_timeout_msec_ = msec;
+}
+
+inline void Client::set_first_byte_timeout(time_t msec) {
+  first_byte_timeout_msec_ = msec;
+}
+
+inline void Client::set_read_timeout(time_t msec) { read_timeout_msec_ = msec; }
+
+inline void Client::set_total_timeout(time_t msec) {
+  total_timeout_msec_ = msec;
+}
+
+inline void Client::enable_adaptive_timeouts(bool enabled) {
+  adaptive_timeouts_ = enabled;
+}
+
+inline bool Client::send(Request &req, Response &res) {
+  if (req.path.empty()) { return false; }
+
+  auto start = std::chrono::steady_clock::now();
+  res.timing = ResponseTiming();
+
+  if (response_cache_ && req.method == "GET" && !res.content_receiver &&
+      !res.receive_buffer && res.receive_fd == -1 &&
+      !req.has_header("Range") && !req.has_header("If-Range") &&
+      !req.has_header("If-Match") && !req.has_header("If-None-Match") &&
+      !req.has_header("If-Modified-Since") &&
+      !req.has_header("If-Unmodified-Since") &&
+      !detail::get_cache_directive(req.headers, "no-store")) {
+    auto ret = send_cached(req, res);
+    res.timing.total = std::chrono::steady_clock::now() - start;
+    return ret;
+  }
+
+  auto ret = send_coalesced(req, res);
+  res.timing.total = std::chrono::steady_clock::now() - start;
+
+  if (ret && response_cache_ && res.status < 400 && req.method != "GET" &&
+      req.method != "HEAD" && req.method != "OPTIONS") {
+    response_cache_->remove(
+        detail::make_request_key(connection_pool_key(), "GET", req.path));
+  }
+  return ret;
+}
+
+inline bool Client::send_cached(Request &req, Response &res) {
+  auto key = detail::make_request_key(connection_pool_key(), req);
+
+  Headers conditions;
+  if (response_cache_->get(key, req, res, conditions)) { return true; }
+
+  if (!conditions.empty()) {
+    auto conditional = req;
+    conditional.headers.insert(conditions.begin(), conditions.end());
+    if (!send_coalesced(conditional, res)) { return false; }
+    if (res.status != 304) {
+      response_cache_->put(key, req, res);
+      return true;
+    }
+    if (response_cache_->refresh(key, req, res)) { return true; }
+
+    // The stored response is gone, so the request goes out as it was.
+    res.status = -1;
+    res.headers.clear();
+    res.body.clear();
+  }
+
+  if (!send_coalesced(req, res)) { return false; }
+  response_cache_->put(key, req, res);
+  return true;
+}
+
+inline bool Client::send_coalesced(Request &req, Response &res) {
+  if (request_coalescer_ && (req.method == "GET" || req.method == "HEAD") &&
+      !res.content_receiver && !res.progress && !res.receive_buffer &&
+      res.receive_fd == -1) {
+    auto key = detail::make_request_key(connection_pool_key(), req);
+    return request_coalescer_->send(
+        key, req, res, [&](Response &res) { return send_hedged(req, res); });
+  }
+
+  return send_hedged(req, res);
+}
+
+// The first attempt runs on the caller's thread. The second one is started
+// by a timer in the readiness loop, unless the first has completed by then,
+// and goes through the event loop. Whichever loses is cancelled.
+inline bool Client::send_hedged(Request &req, Response &res) {
+  if (!hedging_->is_enabled() || !detail::is_idempotent_method(req.method) ||
+      req.content_provider || res.content_receiver || res.progress ||
+      res.receive_buffer || res.receive_fd != -1) {
+    return send_request(req, res, nullptr);
+  }
+
+  struct Attempts {
+    std::mutex mutex;
+    std::condition_variable cond;
+    detail::ClientCancellation first;
+    bool first_done = false;
+    std::shared_ptr<detail::ClientAsyncCall> second;
+    bool second_done = false;
+    std::shared_ptr<Response> res;
+  };
+  auto attempts = std::make_shared<Attempts>();
+  auto hedging = hedging_;
+
+  auto &readiness_loop = detail::ClientEventLoop::get().readiness_loop();
+  auto start = std::chrono::steady_clock::now();
+  uint64_t timer = 0;
+  std::chrono::steady_clock::duration delay;
+  if (hedging->get_delay(delay)) {
+    // `req` and the client are only used while the first attempt runs.
+    timer = readiness_loop.schedule(
+        start + delay, [this, attempts, hedging, &req]() {
+          std::lock_guard<std::mutex> guard(attempts->mutex);
+          if (attempts->first_done || !hedging->acquire()) { return; }
+
+          auto call = std::make_shared<detail::ClientAsyncCall>();
+          call->req = req;
+          call->res = std::make_shared<Response>();
+          call->hedged = true;
+          call->handler = [attempts](std::shared_ptr<Response> res) {
+            {
+              std::lock_guard<std::mutex> guard(attempts->mutex);
+              attempts->res = res;
+              attempts->second_done = true;
+              attempts->cond.notify_all();
+            }
+            if (res) { detail::cancel_request(attempts->first); }
+          };
+          attempts->second = call;
+          enqueue_async(call);
+        });
+  }
+
+  auto ret = send_request(req, res, &attempts->first);
+
+  std::unique_lock<std::mutex> lock(attempts->mutex);
+  attempts->first_done = true;
+  auto second = std::move(attempts->second);
+  if (!second) {
+    lock.unlock();
+    if (timer) { readiness_loop.cancel_wait(timer); }
+  } else if (ret && !detail::is_cancelled(&attempts->first)) {
+    // Destroying the client waits for the handler of the second attempt,
+    // which is called soon once it's cancelled.
+    lock.unlock();
+    detail::cancel_request(second->cancellation);
+  } else {
+    // The first attempt failed, or lost to the second one.
+    attempts->cond.wait(lock, [&] { return attempts->second_done; });
+    auto winner = attempts->res;
+    lock.unlock();
+    if (!winner) { return false; }
+
+    res.version = std::move(winner->version);
+    res.status = winner->status;
+    res.headers = std::move(winner->headers);
+    res.body = std::move(winner->body);
+    res.timing = winner->timing;
+    ret = true;
+  }
+
+  if (ret) { hedging->record(std::chrono::steady_clock::now() - start); }
+  return ret;
+}
+
+inline bool Client::send_request(Request &req, Response &res,
+                                 detail::ClientCancellation *cancellation) {
+  auto &pool = detail::ClientConnectionPool::get();
+  auto key = connection_pool_key();
+  auto keep_alive = keep_alive_max_idle_count_ > 0;
+
+  auto timeouts = get_timeouts();
+  timeouts.cancellation = cancellation;
+  detail::ClientConnection conn;
+  auto connection_close = !keep_alive;
+  auto request_sent = false;
+  auto reused = keep_alive && pool.acquire(key, conn);
+  if (!reused && !open_connection(conn, req, connection_close, request_sent,
+                                  timeouts)) {
+    return false;
+  }
+
+  auto sent_at = std::chrono::steady_clock::now();
+  auto ret = process_connection(conn, req, res, connection_close, request_sent,
+                                timeouts, sent_at);
+
+  // The server may close an idle connection just as a request is sent on it.
+  // Nothing was received then, so an idempotent request can be sent again.
+  // One which timed out may still be in progress on the server, though.
+  if (!ret && reused && res.status == -1 &&
+      detail::is_idempotent_method(req.method) &&
+      !detail::is_first_byte_timed_out(timeouts, sent_at) &&
+      !detail::is_cancelled(cancellation)) {
+    detail::close_client_connection(conn);
+    res.headers.clear();
+    res.body.clear();
+
+    connection_close = !keep_alive;
+    request_sent = false;
+    if (!open_connection(conn, req, connection_close, request_sent,
+                         timeouts)) {
+      return false;
+    }
+
+    ret = process_connection(conn, req, res, connection_close, request_sent,
+                             timeouts, std::chrono::steady_clock::now());
+  }
+
+  if (detail::is_cancelled(cancellation)) {
+    detail::abort_client_connection(conn);
+    return false;
+  }
+
+  release_connection(conn, !ret || connection_close);
+  return ret;
+}
+
+inline void Client::release_connection(detail::ClientConnection &conn,
+                                       bool connection_close) {
+  if (connection_close || keep_alive_max_idle_count_ == 0) {
+    detail::close_client_connection(conn);
+    return;
+  }
+
+  conn.expires = std::chrono::steady_clock::now() +
+                 std::chrono::seconds(keep_alive_idle_timeout_sec_);
+  detail::ClientConnectionPool::get().release(connection_pool_key(), conn,
+                                              keep_alive_max_idle_count_);
+}
+
+inline void Client::send_async(const Request &req,
+                               std::shared_ptr<Response> res,
+                               ResponseHandler handler) {
+  auto call = std::make_shared<detail::ClientAsyncCall>();
+  call->req = req;
+  call->res = res;
+
+  auto start = std::chrono::steady_clock::now();
+  call->handler = [handler, start](std::shared_ptr<Response> res) {
+    if (res) { res->timing.total = std::chrono::steady_clock::now() - start; }
+    handler(res);
+  };
+
+  enqueue_async(call);
+}
+
+inline void
+Client::enqueue_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  // Nothing of the client is used once the handler is called.
+  auto async_calls = async_calls_;
+  auto handler = call->handler;
+  auto key = call.get();
+  call->handler = [async_calls, handler, key](std::shared_ptr<Response> res) {
+    async_calls->remove(key);
+    handler(res);
+  };
+  async_calls->add(call);
+
+  detail::ClientEventLoop::get().task_queue().enqueue(
+      [this, call]() { start_async(call); });
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::send_async(const Request &req, std::shared_ptr<Response> res) {
+  auto promise = std::make_shared<std::promise<std::shared_ptr<Response>>>();
+  send_async(req, res, [promise](std::shared_ptr<Response> res) {
+    promise->set_value(res);
+  });
+  return promise->get_future();
+}
+
+inline std::vector<BatchResult>
+Client::send_batch(const std::vector<Request> &requests,
+                   size_t max_concurrency) {
+  std::vector<BatchResult> results(requests.size());
+  if (max_concurrency == 0) { max_concurrency = 1; }
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t next = 0;
+  size_t in_flight = 0;
+  size_t completed = 0;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (completed < requests.size()) {
+    if (next == requests.size() || in_flight == max_concurrency) {
+      cond.wait(lock);
+      continue;
+    }
+
+    auto i = next++;
+    in_flight++;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    send_async(requests[i], std::make_shared<Response>(),
+               [&, i, start](std::shared_ptr<Response> res) {
+                 auto elapsed = std::chrono::steady_clock::now() - start;
+                 std::lock_guard<std::mutex> guard(mutex);
+                 results[i].response = res;
+                 results[i].elapsed = elapsed;
+                 in_flight--;
+                 completed++;
+                 cond.notify_one();
+               });
+
+    lock.lock();
+  }
+
+  return results;
+}
+
+inline std::vector<BatchResult>
+Client::Get_batch(const std::vector<std::string> &paths,
+                  const Headers &headers, size_t max_concurrency) {
+  std::vector<Request> requests(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    requests[i].method = "GET";
+    requests[i].path = paths[i];
+    requests[i].headers = headers;
+  }
+
+  return send_batch(requests, max_concurrency);
+}
+
+// Sets up a connection unless one is reused, writes the request and reads
+// the response. Whenever the server is waited for, the call waits in the
+// readiness loop, so that it holds up no worker.
+inline void
+Client::start_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto &req = call->req;
+  if (req.path.empty() || detail::is_cancelled(&call->cancellation)) {
+    call->handler(nullptr);
+    return;
+  }
+
+  auto keep_alive = keep_alive_max_idle_count_ > 0;
+  call->connection_close = !keep_alive;
+  call->reused = keep_alive && !call->retried &&
+                 detail::ClientConnectionPool::get().acquire(
+                     connection_pool_key(), call->conn);
+
+  // A retry counts towards the total timeout of the first attempt.
+  if (!call->retried) {
+    call->timeouts = get_timeouts();
+    call->timeouts.cancellation = &call->cancellation;
+  }
+
+  if (call->reused) {
+    write_async(call, false);
+    return;
+  }
+
+  call->conn.timing = ResponseTiming();
+  if (dns_cache_ && dns_cache_->is_cached(host_, port_)) {
+    std::vector<struct sockaddr_storage> addrs;
+    if (!resolve_host(addrs, call->conn.timing)) {
+      call->handler(nullptr);
+      return;
+    }
+    connect_async(call, addrs);
+    return;
+  }
+
+  // Any other lookup can't be waited for in the readiness loop, so it is a
+  // job of the setup queue, shared by the calls to the same host. It uses
+  // nothing of the client, which may go before it is done.
+  auto dns_cache = dns_cache_;
+  auto host = host_;
+  auto port = port_;
+  auto key = "lookup " +
+             std::to_string(reinterpret_cast<uintptr_t>(dns_cache.get())) +
+             " " + host_and_port_;
+  auto start = std::chrono::steady_clock::now();
+  detail::ClientSetupQueue::get().wait(
+      key, call,
+      [dns_cache, host, port](detail::ClientCancellation &,
+                              std::vector<struct sockaddr_storage> &addrs) {
+        return dns_cache ? dns_cache->resolve(host, port, addrs)
+                         : detail::resolve_address(host, port, addrs);
+      },
+      [this, call, start](bool ok,
+                          const std::vector<struct sockaddr_storage> &addrs) {
+        call->conn.timing.dns = std::chrono::steady_clock::now() - start;
+        if (!ok) {
+          call->handler(nullptr);
+          return;
+        }
+        connect_async(call, addrs);
+      });
+}
+
+inline void
+Client::connect_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                     const std::vector<struct sockaddr_storage> &addrs) {
+  auto timeout_msec = detail::get_remaining_msec(call->timeouts.connect_msec,
+                                                 call->timeouts.deadline);
+  if (timeout_msec < 0) {
+    call->handler(nullptr);
+    return;
+  }
+
+  call->connect_timeout_msec = timeout_msec;
+  call->attempts.reset(new detail::ConnectionAttempts(
+      addrs, timeout_msec, CPPHTTPLIB_CONNECTION_ATTEMPT_DELAY_MSECOND));
+  call->setup_start = std::chrono::steady_clock::now();
+  step_connect_async(call);
+}
+
+inline void
+Client::step_connect_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto cancelled = detail::is_cancelled(&call->cancellation);
+  auto &attempts = *call->attempts;
+  if (!cancelled && !attempts.step()) {
+    auto next = [=]() { step_connect_async(call); };
+    wait_async(call, attempts.pending(), true, attempts.get_wake_time(), next,
+               next);
+    return;
+  }
+
+  auto sock = attempts.take();
+  call->attempts.reset();
+  auto elapsed = std::chrono::steady_clock::now() - call->setup_start;
+  call->conn.timing.connect = elapsed;
+
+  if (cancelled) {
+    if (sock != INVALID_SOCKET) { detail::close_socket(sock); }
+    call->handler(nullptr);
+    return;
+  }
+
+  record_connect(sock, call->timeouts, call->connect_timeout_msec, elapsed);
+  if (sock == INVALID_SOCKET) {
+    call->handler(nullptr);
+    return;
+  }
+
+  call->conn.sock = sock;
+  async_connected(call);
+}
+
+inline void
+Client::async_connected(std::shared_ptr<detail::ClientAsyncCall> call) {
+  write_async(call, false);
+}
+
+inline void Client::write_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                                bool request_sent) {
+  auto &req = call->req;
+  auto &timeouts = call->timeouts;
+
+  // Cancelling shuts the socket down, which ends a write blocked on it.
+  if (!detail::watch_socket(&call->cancellation, call->conn.sock)) {
+    release_connection(call->conn, request_sent || call->connection_close);
+    call->handler(nullptr);
+    return;
+  }
+
+  // The response takes the write's timing over along with the connection's.
+  auto &timing = call->conn.timing;
+  auto write_start = std::chrono::steady_clock::now();
+  auto pending = false;
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (call->conn.ssl) {
+    SSLSocketStream strm(call->conn.sock, call->conn.ssl);
+    if (!request_sent) { write_request(strm, req, call->connection_close); }
+    pending = strm.has_pending_data();
+    timing.bytes_sent += strm.get_bytes_written();
+  } else
+#endif
+  if (!request_sent) {
+    SocketStream strm(call->conn.sock);
+    write_request(strm, req, call->connection_close);
+    timing.bytes_sent += strm.get_bytes_written();
+  }
+
+  call->sent_at = std::chrono::steady_clock::now();
+  if (!request_sent) { timing.write = call->sent_at - write_start; }
+
+  if (!detail::unwatch_sockets(&call->cancellation)) {
+    detail::abort_client_connection(call->conn);
+    call->handler(nullptr);
+    return;
+  }
+
+  // Records read ahead during the handshake never wake up the loop.
+  if (pending) {
+    finish_async(call);
+    return;
+  }
+
+  auto deadline = timeouts.deadline;
+  if (timeouts.first_byte_msec) {
+    deadline = std::min(deadline,
+                        call->sent_at + std::chrono::milliseconds(
+                                            timeouts.first_byte_msec));
+  }
+
+  wait_async(call, std::vector<socket_t>(1, call->conn.sock), false, deadline,
+             [=]() { finish_async(call); },
+             [=]() {
+               detail::abort_client_connection(call->conn);
+               back_off_first_byte(call->timeouts, call->sent_at);
+               call->handler(nullptr);
+             });
+}
+
+inline void Client::wait_async(std::shared_ptr<detail::ClientAsyncCall> call,
+                               const std::vector<socket_t> &socks, bool write,
+                               std::chrono::steady_clock::time_point deadline,
+                               std::function<void()> ready,
+                               std::function<void()> expired) {
+  auto &event_loop = detail::ClientEventLoop::get();
+  auto &task_queue = event_loop.task_queue();
+
+  auto on_ready = [call, ready]() {
+    detail::clear_interrupt(&call->cancellation);
+    ready();
+  };
+  // The loop's own thread must not be held up by the call.
+  auto on_expired = [call, expired, &task_queue]() {
+    task_queue.enqueue([call, expired]() {
+      detail::clear_interrupt(&call->cancellation);
+      expired();
+    });
+  };
+
+  // The interrupt is set before the wait can end, so that it can't replace
+  // the one of a later wait.
+  auto &cancellation = call->cancellation;
+  std::lock_guard<std::mutex> guard(cancellation.mutex);
+  if (cancellation.cancelled) {
+    on_expired();
+    return;
+  }
+
+  auto &readiness_loop = event_loop.readiness_loop();
+  auto id = readiness_loop.wait(socks, write, deadline, on_ready, on_expired,
+                                &task_queue);
+  cancellation.interrupt = [&readiness_loop, id]() {
+    readiness_loop.cancel_wait(id);
+  };
+}
+
+inline void
+Client::finish_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto &req = call->req;
+  auto &res = *call->res;
+
+  auto ret = process_connection(call->conn, req, res, call->connection_close,
+                                true, call->timeouts, call->sent_at);
+
+  if (detail::is_cancelled(&call->cancellation)) {
+    detail::abort_client_connection(call->conn);
+    call->handler(nullptr);
+    return;
+  }
+
+  if (!ret && call->reused && res.status == -1 &&
+      detail::is_idempotent_method(req.method) &&
+      !detail::is_first_byte_timed_out(call->timeouts, call->sent_at)) {
+    detail::close_client_connection(call->conn);
+    res.headers.clear();
+    res.body.clear();
+
+    call->retried = true;
+    start_async(call);
+    return;
+  }
+
+  release_connection(call->conn, !ret || call->connection_close);
+  call->handler(ret ? call->res : nullptr);
+}
+
+inline bool Client::open_connection(detail::ClientConnection &conn,
+                                    Request & /*req*/,
+                                    bool /*close_connection*/,
+                                    bool & /*request_sent*/,
+                                    const detail::ClientTimeouts &timeouts) {
+  conn.timing = ResponseTiming();
+  conn.sock = create_client_socket(timeouts, conn.timing);
+  return conn.sock != INVALID_SOCKET;
+}
+
+inline std::string Client::connection_pool_key() const {
+  return "http://" + host_and_port_;
+}
+
+inline bool Client::process_connection(
+    detail::ClientConnection &conn, Request &req, Response &res,
+    bool &connection_close, bool request_sent,
+    const detail::ClientTimeouts &timeouts,
+    std::chrono::steady_clock::time_point sent_at) {
+  auto ret = false;
+  std::chrono::steady_clock::time_point first_byte_time;
+  res.timing = detail::take_connection_timing(conn);
+
+  // Cancelling shuts the socket down, which ends a read or write blocked on
+  // it.
+  if (!detail::watch_socket(timeouts.cancellation, conn.sock)) {
+    connection_close = true;
+    return false;
+  }
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+  if (conn.ssl) {
+    SSLSocketStream strm(conn.sock, conn.ssl);
+    strm.set_read_timeout(timeouts.first_byte_msec, timeouts.read_msec,
+                          timeouts.deadline);
+    ret = process_stream(strm, req, res, connection_close, request_sent,
+                         sent_at, first_byte_time);
+
+    // Decrypted data left over doesn't belong to any request.
+    if (strm.has_pending_data()) { connection_close = true; }
+  } else
+#endif
+  {
+    SocketStream strm(conn.sock);
+    strm.set_read_timeout(timeouts.first_byte_msec, timeouts.read_msec,
+                          timeouts.deadline);
+    ret = process_stream(strm, req, res, connection_close, request_sent,
+                         sent_at, first_byte_time);
+  }
+
+  if (!detail::unwatch_sockets(timeouts.cancellation)) { return false; }
+
+  if (timeouts.adaptive) {
+    auto &rtt_cache = detail::OriginRttCache::get();
+    if (first_byte_time != std::chrono::steady_clock::time_point()) {
+      rtt_cache.add(host_and_port_, true, first_byte_time - sent_at);
+    } else if (!ret) {
+      back_off_first_byte(timeouts, sent_at);
+    }
+  }
+  return ret;
+}
+
+// Writes the request unless it was sent already, and then reads the response,
+// timing both into `res.timing`.
+template <typename T>
+inline bool
+Client::process_stream(T &strm, Request &req, Response &res,
+                       bool &connection_close, bool request_sent,
+                       std::chrono::steady_clock::time_point &sent_at,
+                       std::chrono::steady_clock::time_point &first_byte_time) {
+  if (!request_sent) {
+    auto write_start = std::chrono::steady_clock::now();
+    write_request(strm, req, connection_close);
+    sent_at = std::chrono::steady_clock::now();
+    res.timing.write = sent_at - write_start;
+  }
+
+  auto ret = process_request(strm, req, res, connection_close, true);
+
+  first_byte_time = strm.get_first_byte_time();
+  if (first_byte_time != std::chrono::steady_clock::time_point()) {
+    res.timing.first_byte = first_byte_time - sent_at;
+    res.timing.transfer = std::chrono::steady_clock::now() - first_byte_time;
+  }
+  res.timing.bytes_sent += strm.get_bytes_written();
+  res.timing.bytes_received += strm.get_bytes_read();
+  return ret;
+}
+
+inline void
+Client::back_off_first_byte(const detail::ClientTimeouts &timeouts,
+                            std::chrono::steady_clock::time_point sent_at) {
+  if (timeouts.adaptive && detail::is_first_byte_timed_out(timeouts, sent_at)) {
+    detail::OriginRttCache::get().back_off(host_and_port_, true);
+  }
+}
+
+inline void Client::write_request(Stream &strm, const Request &req,
+                                  bool close_connection) {
+  // Kept by each thread, so that serializing the headers doesn't allocate
+  // once it has grown.
+  static thread_local std::string buf;
+  buf.clear();
+
+  // Request line
+  buf += req.method;
+  buf += ' ';
+  buf += detail::encode_url(req.path);
+  buf += " HTTP/1.1\r\n";
+
+  // Headers
+  auto append_header = [&](const std::string &key, const std::string &val) {
+    buf += key;
+    buf += ": ";
+    buf += val;
+    buf += "\r\n";
+  };
+
+  for (const auto &x : req.headers) {
+    append_header(x.first, x.second);
+  }
+  for_each_default_header(
+      req, close_connection,
+      [&](const std::string &key, const std::string &val) {
+        append_header(key, val);
+      });
+  buf += "\r\n";
+
+  // Body, which is sent from where it is
+  if (!req.content_provider) {
+    strm.writev(buf.data(), buf.size(), req.body.data(), req.body.size());
+    return;
+  }
+
+  if (!strm.writev(buf.data(), buf.size(), nullptr, 0)) { return; }
+
+  // A failed upload surfaces when the response can't be read.
+  if (req.content_fd != -1) {
+    strm.write_file(req.content_fd, req.content_fd_offset,
+                    req.content_provider_resource_length);
+  } else if (req.content_provider_resource_length) {
+    detail::write_content(strm, req.content_provider, 0,
+                          req.content_provider_resource_length);
+  } else {
+    detail::write_content_chunked(strm, req.content_provider);
+  }
+}
+
+inline void Client::for_each_default_header(
+    const Request &req, bool close_connection,
+    std::function<void(const std::string &key, const std::string &val)> fn)
+    const {
+  static const std::string host = "Host";
+  static const std::string accept = "Accept";
+  static const std::string user_agent = "User-Agent";
+  static const std::string content_type = "Content-Type";
+  static const std::string content_length = "Content-Length";
+  static const std::string transfer_encoding = "Transfer-Encoding";
+  static const std::string connection = "Connection";
+
+  if (!req.has_header("Host")) {
+    if (is_ssl()) {
+      fn(host, port_ == 443 ? host_ : host_and_port_);
+    } else {
+      fn(host, port_ == 80 ? host_ : host_and_port_);
+    }
+  }
+
+  if (!req.has_header("Accept")) { fn(accept, "*/*"); }
+
+  if (!req.has_header("User-Agent")) { fn(user_agent, "cpp-httplib/0.2"); }
+
+  if (req.content_provider) {
+    if (!req.has_header("Content-Type")) { fn(content_type, "text/plain"); }
+
+    if (req.content_provider_resource_length) {
+      if (!req.has_header("Content-Length")) {
+        fn(content_length,
+           std::to_string(req.content_provider_resource_length));
+      }
+    } else if (!req.has_header("Transfer-Encoding")) {
+      fn(transfer_encoding, "chunked");
+    }
+  } else if (req.body.empty()) {
+    if ((req.method == "POST" || req.method == "PUT" ||
+         req.method == "PATCH") &&
+        !req.has_header("Content-Length")) {
+      fn(content_length, "0");
+    }
+  } else {
+    if (!req.has_header("Content-Type")) { fn(content_type, "text/plain"); }
+
+    if (!req.has_header("Content-Length")) {
+      fn(content_length, std::to_string(req.body.size()));
+    }
+  }
+
+  if (close_connection && !req.has_header("Connection")) {
+    fn(connection, "close");
+  }
+}
+
+inline Headers Client::get_default_headers(const Request &req) const {
+  Headers headers;
+  for_each_default_header(
+      req, false, [&](const std::string &key, const std::string &val) {
+        headers.emplace(key, val);
+      });
+  return headers;
+}
+
+inline bool Client::process_request(Stream &strm, Request &req, Response &res,
+                                    bool &connection_close,
+                                    bool request_sent) {
+  // Send request
+  if (!request_sent) { write_request(strm, req, connection_close); }
+
+  if (req.get_header_value("Connection") == "close") {
+    connection_close = true;
+  }
+
+  // Receive response and headers
+  if (!read_response_line(strm, res) ||
+      !detail::read_headers(strm, res.headers)) {
+    return false;
+  }
+
+  if (res.get_header_value("Connection") == "close" ||
+      res.version == "HTTP/1.0") {
+    connection_close = true;
+  }
+
+  // Body
+  if (req.method != "HEAD" && res.status != 204 && res.status != 304) {
+    // Without a length, the body ends when the server closes the connection.
+    if (!detail::has_header(res.headers, "Content-Length") &&
+        !detail::is_chunked_transfer_encoding(res.headers)) {
+      connection_close = true;
+    }
+
+    if (!detail::read_response_body(strm, res, body_reserve_max_length_)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+inline bool Client::is_ssl() const { return false; }
+
+inline std::shared_ptr<Response> Client::Get(const char *path,
+                                             Progress progress) {
+  return Get(path, Headers(), progress);
+}
+
+inline std::shared_ptr<Response>
+Client::Get(const char *path, const Headers &headers, Progress progress) {
+  Request req;
+  req.method = "GET";
+  req.path = path;
+  req.headers = headers;
+
+  auto res = std::make_shared<Response>();
+  res->progress = progress;
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Get(const char *path,
+                                             ContentReceiver content_receiver,
+                                             Progress progress) {
+  return Get(path, Headers(), content_receiver, progress);
 }
 
-template <typename SToken, typename CToken, typename Content>
-bool process_multipart_ranges_data(const Request &req, Response &res,
-                                   const std::string &boundary,
-                                   const std::string &content_type,
-                                   SToken stoken, CToken ctoken,
-                                   Content content) {
-  for (size_t i = 0; i < req.ranges.size(); i++) {
-    ctoken("--");
-    stoken(boundary);
-    ctoken("\r\n");
-    if (!content_type.empty()) {
-      ctoken("Content-Type: ");
-      stoken(content_type);
-      ctoken("\r\n");
+inline std::shared_ptr<Response> Client::Get(const char *path,
+                                             const Headers &headers,
+                                             ContentReceiver content_receiver,
+                                             Progress progress) {
+  Request req;
+  req.method = "GET";
+  req.path = path;
+  req.headers = headers;
+
+  auto res = std::make_shared<Response>();
+  res->content_receiver = content_receiver;
+  res->progress = progress;
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Get_async(const char *path, Progress progress) {
+  return Get_async(path, Headers(), progress);
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Get_async(const char *path, const Headers &headers,
+                  Progress progress) {
+  return Get_async(path, headers, nullptr, progress);
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Get_async(const char *path, ContentReceiver content_receiver,
+                  Progress progress) {
+  return Get_async(path, Headers(), content_receiver, progress);
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Get_async(const char *path, const Headers &headers,
+                  ContentReceiver content_receiver, Progress progress) {
+  Request req;
+  req.method = "GET";
+  req.path = path;
+  req.headers = headers;
+
+  auto res = std::make_shared<Response>();
+  res->content_receiver = content_receiver;
+  res->progress = progress;
+
+  return send_async(req, res);
+}
+
+inline std::shared_ptr<Response> Client::Head(const char *path) {
+  return Head(path, Headers());
+}
+
+inline std::shared_ptr<Response> Client::Head(const char *path,
+                                              const Headers &headers) {
+  Request req;
+  req.method = "HEAD";
+  req.headers = headers;
+  req.path = path;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Post(const char *path,
+                                              const std::string &body,
+                                              const char *content_type) {
+  return Post(path, Headers(), body, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Post(const char *path,
+                                              const Headers &headers,
+                                              const std::string &body,
+                                              const char *content_type) {
+  Request req;
+  req.method = "POST";
+  req.headers = headers;
+  req.path = path;
+
+  req.headers.emplace("Content-Type", content_type);
+  req.body = body;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Post(
+    const char *path, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return Post(path, Headers(), content_length, content_provider, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Post(
+    const char *path, const Headers &headers, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return send_with_content_provider("POST", path, headers, content_length,
+                                    content_provider, content_type);
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Post_async(const char *path, const std::string &body,
+                   const char *content_type) {
+  return Post_async(path, Headers(), body, content_type);
+}
+
+inline std::future<std::shared_ptr<Response>>
+Client::Post_async(const char *path, const Headers &headers,
+                   const std::string &body, const char *content_type) {
+  Request req;
+  req.method = "POST";
+  req.headers = headers;
+  req.path = path;
+
+  req.headers.emplace("Content-Type", content_type);
+  req.body = body;
+
+  return send_async(req, std::make_shared<Response>());
+}
+
+inline std::shared_ptr<Response> Client::Post(const char *path,
+                                              const Params &params) {
+  return Post(path, Headers(), params);
+}
+
+inline std::shared_ptr<Response>
+Client::Post(const char *path, const Headers &headers, const Params &params) {
+  std::string query;
+  for (auto it = params.begin(); it != params.end(); ++it) {
+    if (it != params.begin()) { query += "&"; }
+    query += it->first;
+    query += "=";
+    query += detail::encode_url(it->second);
+  }
+
+  return Post(path, headers, query, "application/x-www-form-urlencoded");
+}
+
+inline std::shared_ptr<Response>
+Client::Post(const char *path, const MultipartFormDataItems &items) {
+  return Post(path, Headers(), items);
+}
+
+inline std::shared_ptr<Response>
+Client::Post(const char *path, const Headers &headers,
+             const MultipartFormDataItems &items) {
+  Request req;
+  req.method = "POST";
+  req.headers = headers;
+  req.path = path;
+
+  auto boundary = detail::make_multipart_data_boundary();
+
+  req.headers.emplace("Content-Type",
+                      "multipart/form-data; boundary=" + boundary);
+
+  for (const auto &item : items) {
+    req.body += "--" + boundary + "\r\n";
+    req.body += "Content-Disposition: form-data; name=\"" + item.name + "\"";
+    if (!item.filename.empty()) {
+      req.body += "; filename=\"" + item.filename + "\"";
+    }
+    req.body += "\r\n";
+    if (!item.content_type.empty()) {
+      req.body += "Content-Type: " + item.content_type + "\r\n";
     }
+    req.body += "\r\n";
+    req.body += item.content + "\r\n";
+  }
+
+  req.body += "--" + boundary + "--\r\n";
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Put(const char *path,
+                                             const std::string &body,
+                                             const char *content_type) {
+  return Put(path, Headers(), body, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Put(const char *path,
+                                             const Headers &headers,
+                                             const std::string &body,
+                                             const char *content_type) {
+  Request req;
+  req.method = "PUT";
+  req.headers = headers;
+  req.path = path;
+
+  req.headers.emplace("Content-Type", content_type);
+  req.body = body;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Put(
+    const char *path, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return Put(path, Headers(), content_length, content_provider, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Put(
+    const char *path, const Headers &headers, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return send_with_content_provider("PUT", path, headers, content_length,
+                                    content_provider, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Patch(const char *path,
+                                               const std::string &body,
+                                               const char *content_type) {
+  return Patch(path, Headers(), body, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Patch(const char *path,
+                                               const Headers &headers,
+                                               const std::string &body,
+                                               const char *content_type) {
+  Request req;
+  req.method = "PATCH";
+  req.headers = headers;
+  req.path = path;
+
+  req.headers.emplace("Content-Type", content_type);
+  req.body = body;
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Patch(
+    const char *path, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return Patch(path, Headers(), content_length, content_provider, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Patch(
+    const char *path, const Headers &headers, uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  return send_with_content_provider("PATCH", path, headers, content_length,
+                                    content_provider, content_type);
+}
+
+inline std::shared_ptr<Response> Client::send_with_content_provider(
+    const char *method, const char *path, const Headers &headers,
+    uint64_t content_length,
+    std::function<void(uint64_t offset, uint64_t length, Out out)>
+        content_provider,
+    const char *content_type) {
+  Request req;
+  req.method = method;
+  req.headers = headers;
+  req.path = path;
+
+  req.headers.emplace("Content-Type", content_type);
+  if (content_length) {
+    req.set_content_provider(content_length, content_provider);
+  }
+
+  auto res = std::make_shared<Response>();
+
+  return send(req, *res) ? res : nullptr;
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path,
+                                                const std::string &body,
+                                                const char *content_type) {
+  return Delete(path, Headers(), body, content_type);
+}
+
+inline std::shared_ptr<Response> Client::Delete(const char *path,
+                                                const Headers &headers,
+                                                const std::string &body,
+                                                const char *content_type) {
+  Request req;
+  req.method = "DELETE";
+  req.headers = headers;
+  req.path = path;
 
-    auto offsets = detail::get_range_offset_and_length(req, res.body.size(), i);
-    auto offset = offsets.first;
-    auto length = offsets.second;
+  if (content_type) { req.headers.emplace("Content-Type", content_type); }
+  req.body = body;
 
-    ctoken("Content-Range: ");
-    stoken(make_content_range_header_field(offset, length, res.body.size()));
-    ctoken("\r\n");
-    ctoken("\r\n");
-    if (!content(offset, length)) { return false; }
-    ctoken("\r\n");
-  }
+  auto res = std::make_shared<Response>();
 
-  ctoken("--");
-  stoken(boundary);
-  ctoken("--\r\n");
+  return send(req, *res) ? res : nullptr;
+}
 
-  return true;
+inline std::shared_ptr<Response> Client::Options(const char *path) {
+  return Options(path, Headers());
 }
 
-inline std::string make_multipart_ranges_data(const Request &req, Response &res,
-                                              const std::string &boundary,
-                                              const std::string &content_type) {
-  std::string data;
+inline std::shared_ptr<Response> Client::Options(const char *path,
+                                                 const Headers &headers) {
+  Request req;
+  req.method = "OPTIONS";
+  req.path = path;
+  req.headers = headers;
 
-  process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { data += token; },
-      [&](const char *token) { data += token; },
-      [&](uint64_t offset, uint64_t length) {
-        data += res.body.substr(offset, length);
-        return true;
-      });
+  auto res = std::make_shared<Response>();
 
-  return data;
+  return send(req, *res) ? res : nullptr;
 }
 
-inline uint64_t
-get_multipart_ranges_data_length(const Request &req, Response &res,
-                                 const std::string &boundary,
-                                 const std::string &content_type) {
-  uint64_t data_length = 0;
+/*
+ * SSL Implementation
+ */
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+namespace detail {
 
-  process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { data_length += token.size(); },
-      [&](const char *token) { data_length += strlen(token); },
-      [&](uint64_t /*offset*/, uint64_t length) {
-        data_length += length;
-        return true;
-      });
+template <typename T>
+inline bool process_socket_ssl(socket_t sock, SSL *ssl,
+                               size_t keep_alive_max_count,
+                               time_t keep_alive_timeout_sec,
+                               time_t keep_alive_timeout_usec,
+                               bool dynamic_record_sizing,
+                               const std::string &early_data, T callback) {
+  bool ret = false;
 
-  return data_length;
-}
+  // The stream outlives each request, since it may already hold the
+  // decrypted beginning of the next one.
+  SSLSocketStream strm(sock, ssl);
+  strm.enable_dynamic_record_sizing(dynamic_record_sizing);
+  if (!early_data.empty()) { strm.preload(early_data); }
 
-inline bool write_multipart_ranges_data(Stream &strm, const Request &req,
-                                        Response &res,
-                                        const std::string &boundary,
-                                        const std::string &content_type) {
-  return process_multipart_ranges_data(
-      req, res, boundary, content_type,
-      [&](const std::string &token) { strm.write(token); },
-      [&](const char *token) { strm.write(token); },
-      [&](uint64_t offset, uint64_t length) {
-        return detail::write_content(strm, res.content_provider, offset,
-                                     length) >= 0;
-      });
-}
+  if (keep_alive_max_count > 0) {
+    auto count = keep_alive_max_count;
+    while (count > 0 &&
+           (strm.has_pending_data() ||
+            detail::select_read(sock, keep_alive_timeout_sec,
+                                keep_alive_timeout_usec) > 0)) {
+      auto last_connection = count == 1;
+      auto connection_close = false;
 
-inline std::pair<uint64_t, uint64_t>
-get_range_offset_and_length(const Request &req, const Response &res,
-                            size_t index) {
-  auto r = req.ranges[index];
+      ret = callback(ssl, strm, last_connection, connection_close);
+      if (!ret || connection_close) { break; }
 
-  if (r.second == -1) { r.second = res.content_provider_resource_length - 1; }
+      count--;
+    }
+  } else {
+    auto dummy_connection_close = false;
+    ret = callback(ssl, strm, true, dummy_connection_close);
+  }
 
-  return std::make_pair(r.first, r.second - r.first + 1);
+  return ret;
 }
 
-#ifdef _WIN32
-class WSInit {
-public:
-  WSInit() {
-    WSADATA wsaData;
-    WSAStartup(0x0002, &wsaData);
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+inline bool is_http2_selected(const SSL *ssl) {
+  const unsigned char *proto = nullptr;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected(ssl, &proto, &len);
+  return len == 2 && !memcmp(proto, "h2", 2);
+}
+
+inline nghttp2_nv make_http2_nv(const std::string &name,
+                                const std::string &value) {
+  nghttp2_nv nv;
+  nv.name = reinterpret_cast<uint8_t *>(const_cast<char *>(name.data()));
+  nv.value = reinterpret_cast<uint8_t *>(const_cast<char *>(value.data()));
+  nv.namelen = name.size();
+  nv.valuelen = value.size();
+  nv.flags = NGHTTP2_NV_FLAG_NONE;
+  return nv;
+}
+
+// Appends `headers` to `nva` with lowercased names, leaving out the
+// connection-specific fields which are not allowed in HTTP/2. `names` keeps
+// the lowercased names alive until nghttp2 has copied them.
+inline void make_http2_nva(const Headers &headers,
+                           std::vector<std::string> &names,
+                           std::vector<nghttp2_nv> &nva) {
+  names.reserve(names.size() + headers.size());
+  nva.reserve(nva.size() + headers.size());
+
+  for (const auto &x : headers) {
+    auto name = to_lower(x.first.data(), x.first.data() + x.first.size());
+
+    if (name == "connection" || name == "keep-alive" || name == "host" ||
+        name == "transfer-encoding" || name == "upgrade" ||
+        name == "proxy-connection") {
+      continue;
+    }
+
+    names.emplace_back(std::move(name));
+    nva.push_back(make_http2_nv(names.back(), x.second));
   }
+}
 
-  ~WSInit() { WSACleanup(); }
+struct Http2Stream {
+  Request req;
+  Response res;
+  bool payload_too_large = false;
+  bool responded = false;
+
+  // Response body state
+  size_t body_offset = 0;
+  bool chunked_provider = false;
+  uint64_t provider_offset = 0;
+  uint64_t provider_end = 0;
+  std::string pending;
+  size_t pending_offset = 0;
+  bool eof = false;
 };
 
-static WSInit wsinit_;
-#endif
+// Serves the streams of one HTTP/2 connection. Requests are collected from
+// their frames, handed to `handler` once complete, and the responses are
+// multiplexed back over the connection as flow control allows.
+class Http2ServerSession {
+public:
+  typedef std::function<void(Http2Stream &stream)> StreamHandler;
 
-} // namespace detail
+  Http2ServerSession(SSLSocketStream &strm, socket_t sock,
+                     size_t payload_max_length, StreamHandler handler,
+                     Server::Logger logger)
+      : strm_(strm), sock_(sock), payload_max_length_(payload_max_length),
+        handler_(handler), logger_(logger), session_(nullptr) {}
 
-// Header utilities
-inline std::pair<std::string, std::string> make_range_header(Ranges ranges) {
-  std::string field = "bytes=";
-  auto i = 0;
-  for (auto r : ranges) {
-    if (i != 0) { field += ", "; }
-    if (r.first != -1) { field += std::to_string(r.first); }
-    field += '-';
-    if (r.second != -1) { field += std::to_string(r.second); }
-    i++;
+  ~Http2ServerSession() {
+    if (session_) { nghttp2_session_del(session_); }
   }
-  return std::make_pair("Range", field);
-}
 
-inline std::pair<std::string, std::string>
-make_basic_authentication_header(const std::string &username,
-                                 const std::string &password) {
-  auto field = "Basic " + detail::base64_encode(username + ":" + password);
-  return std::make_pair("Authorization", field);
-}
+  bool run(time_t idle_timeout_sec, time_t idle_timeout_usec) {
+    nghttp2_session_callbacks *callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) { return false; }
+
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,
+                                                            on_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+        callbacks, on_data_chunk_recv);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks,
+                                                         on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                           on_stream_close);
+
+    auto rv = nghttp2_session_server_new(&session_, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    if (rv != 0) { return false; }
+
+    nghttp2_settings_entry iv[] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+                                    CPPHTTPLIB_HTTP2_MAX_CONCURRENT_STREAMS}};
+    if (nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, iv, 1) != 0) {
+      return false;
+    }
 
-// Request implementation
-inline bool Request::has_header(const char *key) const {
-  return detail::has_header(headers, key);
-}
+    char buf[CPPHTTPLIB_SSL_RECV_BUFSIZ];
 
-inline std::string Request::get_header_value(const char *key, size_t id) const {
-  return detail::get_header_value(headers, key, id, "");
-}
+    while (true) {
+      if (!flush()) { return false; }
 
-inline size_t Request::get_header_value_count(const char *key) const {
-  auto r = headers.equal_range(key);
-  return std::distance(r.first, r.second);
-}
+      if (!nghttp2_session_want_read(session_) &&
+          !nghttp2_session_want_write(session_)) {
+        return true;
+      }
 
-inline void Request::set_header(const char *key, const char *val) {
-  headers.emplace(key, val);
-}
+      auto idle = streams_.empty();
 
-inline void Request::set_header(const char *key, const std::string &val) {
-  headers.emplace(key, val);
-}
+      if (!strm_.has_pending_data()) {
+        auto ret = idle ? select_read(sock_, idle_timeout_sec,
+                                      idle_timeout_usec)
+                        : select_read(sock_, CPPHTTPLIB_READ_TIMEOUT_SECOND,
+                                      CPPHTTPLIB_READ_TIMEOUT_USECOND);
+        if (ret <= 0) {
+          if (!idle) { return false; }
 
-inline bool Request::has_param(const char *key) const {
-  return params.find(key) != params.end();
-}
+          nghttp2_session_terminate_session(session_, NGHTTP2_NO_ERROR);
+          return flush();
+        }
+      }
 
-inline std::string Request::get_param_value(const char *key, size_t id) const {
-  auto it = params.find(key);
-  std::advance(it, id);
-  if (it != params.end()) { return it->second; }
-  return std::string();
-}
+      auto n = strm_.read(buf, sizeof(buf));
+      if (n <= 0) { return idle; }
 
-inline size_t Request::get_param_value_count(const char *key) const {
-  auto r = params.equal_range(key);
-  return std::distance(r.first, r.second);
-}
+      if (nghttp2_session_mem_recv(session_,
+                                   reinterpret_cast<const uint8_t *>(buf),
+                                   static_cast<size_t>(n)) < 0) {
+        return false;
+      }
 
-inline bool Request::has_file(const char *key) const {
-  return files.find(key) != files.end();
-}
+      // Run the handlers of the requests completed by this read, so that
+      // their responses go out together with the next flush.
+      for (auto stream_id : completed_) {
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end()) { continue; }
 
-inline MultipartFile Request::get_file_value(const char *key) const {
-  auto it = files.find(key);
-  if (it != files.end()) { return it->second; }
-  return MultipartFile();
-}
+        auto &stream = *it->second;
+        handler_(stream);
+        if (!submit_response(stream_id, stream)) { return false; }
+        stream.responded = true;
+      }
+      completed_.clear();
+    }
+  }
 
-// Response implementation
-inline bool Response::has_header(const char *key) const {
-  return headers.find(key) != headers.end();
-}
+private:
+  bool flush() {
+    while (true) {
+      const uint8_t *data = nullptr;
+      auto n = nghttp2_session_mem_send(session_, &data);
+      if (n < 0) { return false; }
+      if (n == 0) { break; }
+
+      send_buf_.append(reinterpret_cast<const char *>(data),
+                       static_cast<size_t>(n));
+
+      if (send_buf_.size() >= CPPHTTPLIB_SSL_RECV_BUFSIZ * 4 &&
+          !write_send_buf()) {
+        return false;
+      }
+    }
+    return write_send_buf();
+  }
 
-inline std::string Response::get_header_value(const char *key,
-                                              size_t id) const {
-  return detail::get_header_value(headers, key, id, "");
-}
+  bool write_send_buf() {
+    if (send_buf_.empty()) { return true; }
+    auto n = strm_.write(send_buf_);
+    auto ret = n > 0 && static_cast<size_t>(n) == send_buf_.size();
+    send_buf_.clear();
+    return ret;
+  }
 
-inline size_t Response::get_header_value_count(const char *key) const {
-  auto r = headers.equal_range(key);
-  return std::distance(r.first, r.second);
-}
+  bool submit_response(int32_t stream_id, Http2Stream &stream) {
+    const auto &res = stream.res;
 
-inline void Response::set_header(const char *key, const char *val) {
-  headers.emplace(key, val);
-}
+    static const std::string status_name = ":status";
+    auto status = std::to_string(res.status);
 
-inline void Response::set_header(const char *key, const std::string &val) {
-  headers.emplace(key, val);
-}
+    std::vector<std::string> names;
+    std::vector<nghttp2_nv> nva;
+    nva.push_back(make_http2_nv(status_name, status));
+    make_http2_nva(res.headers, names, nva);
 
-inline void Response::set_redirect(const char *url) {
-  set_header("Location", url);
-  status = 302;
-}
+    auto has_body = stream.req.method != "HEAD" &&
+                    (!res.body.empty() || res.content_provider);
 
-inline void Response::set_content(const char *s, size_t n,
-                                  const char *content_type) {
-  body.assign(s, n);
-  set_header("Content-Type", content_type);
-}
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = &stream;
+    data_prd.read_callback = read_body;
 
-inline void Response::set_content(const std::string &s,
-                                  const char *content_type) {
-  body = s;
-  set_header("Content-Type", content_type);
-}
+    return nghttp2_submit_response(session_, stream_id, nva.data(), nva.size(),
+                                   has_body ? &data_prd : nullptr) == 0;
+  }
 
-inline void Response::set_content_provider(
-    uint64_t length,
-    std::function<void(uint64_t offset, uint64_t length, Out out)> provider,
-    std::function<void()> resource_releaser) {
-  assert(length > 0);
-  content_provider_resource_length = length;
-  content_provider = [provider](uint64_t offset, uint64_t length, Out out,
-                                Done) { provider(offset, length, out); };
-  content_provider_resource_releaser = resource_releaser;
-}
+  static ssize_t read_body(nghttp2_session * /*session*/, int32_t /*id*/,
+                           uint8_t *buf, size_t length, uint32_t *data_flags,
+                           nghttp2_data_source *source, void * /*user_data*/) {
+    auto &stream = *static_cast<Http2Stream *>(source->ptr);
+    auto &res = stream.res;
 
-inline void Response::set_chunked_content_provider(
-    std::function<void(uint64_t offset, Out out, Done done)> provider,
-    std::function<void()> resource_releaser) {
-  content_provider_resource_length = 0;
-  content_provider = [provider](uint64_t offset, uint64_t, Out out, Done done) {
-    provider(offset, out, done);
-  };
-  content_provider_resource_releaser = resource_releaser;
-}
+    if (!res.body.empty()) {
+      auto n = std::min(length, res.body.size() - stream.body_offset);
+      memcpy(buf, res.body.data() + stream.body_offset, n);
+      stream.body_offset += n;
+      if (stream.body_offset == res.body.size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+      }
+      return static_cast<ssize_t>(n);
+    }
 
-// Rstream implementation
-template <typename... Args>
-inline int Stream::write_format(const char *fmt, const Args &... args) {
-  const auto bufsiz = 2048;
-  char buf[bufsiz];
+    // Drop what was sent already, so that the buffer stays bounded.
+    if (stream.pending_offset > 0 &&
+        stream.pending.size() - stream.pending_offset < length &&
+        !stream.eof) {
+      stream.pending.erase(0, stream.pending_offset);
+      stream.pending_offset = 0;
+    }
+
+    auto aborted = false;
+    while (stream.pending.size() - stream.pending_offset < length &&
+           !stream.eof) {
+      if (stream.chunked_provider) {
+        res.content_provider(
+            stream.provider_offset, 0,
+            [&](const char *d, uint64_t l) {
+              if (!l) { stream.eof = true; }
+              stream.pending.append(d, static_cast<size_t>(l));
+              stream.provider_offset += l;
+            },
+            [&]() { stream.eof = true; });
+      } else {
+        res.content_provider(
+            stream.provider_offset,
+            stream.provider_end - stream.provider_offset,
+            [&](const char *d, uint64_t l) {
+              stream.pending.append(d, static_cast<size_t>(l));
+              stream.provider_offset += l;
+            },
+            [&]() { aborted = true; });
+
+        if (aborted) { return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE; }
+        if (stream.provider_offset >= stream.provider_end) {
+          stream.eof = true;
+        }
+      }
+    }
 
-#if defined(_MSC_VER) && _MSC_VER < 1900
-  auto n = _snprintf_s(buf, bufsiz, bufsiz - 1, fmt, args...);
-#else
-  auto n = snprintf(buf, bufsiz - 1, fmt, args...);
-#endif
-  if (n <= 0) { return n; }
+    auto n = std::min(length, stream.pending.size() - stream.pending_offset);
+    memcpy(buf, stream.pending.data() + stream.pending_offset, n);
+    stream.pending_offset += n;
 
-  if (n >= bufsiz - 1) {
-    std::vector<char> glowable_buf(bufsiz);
+    if (stream.pending_offset == stream.pending.size()) {
+      stream.pending.clear();
+      stream.pending_offset = 0;
+      if (stream.eof) { *data_flags |= NGHTTP2_DATA_FLAG_EOF; }
+    }
+    return static_cast<ssize_t>(n);
+  }
 
-    while (n >= static_cast<int>(glowable_buf.size() - 1)) {
-      glowable_buf.resize(glowable_buf.size() * 2);
-#if defined(_MSC_VER) && _MSC_VER < 1900
-      n = _snprintf_s(&glowable_buf[0], glowable_buf.size(),
-                      glowable_buf.size() - 1, fmt, args...);
-#else
-      n = snprintf(&glowable_buf[0], glowable_buf.size() - 1, fmt, args...);
-#endif
+  static Http2Stream *get_stream(nghttp2_session *session, int32_t id) {
+    return static_cast<Http2Stream *>(
+        nghttp2_session_get_stream_user_data(session, id));
+  }
+
+  static int on_begin_headers(nghttp2_session *session,
+                              const nghttp2_frame *frame, void *user_data) {
+    auto self = static_cast<Http2ServerSession *>(user_data);
+
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+      return 0;
     }
-    return write(&glowable_buf[0], n);
-  } else {
-    return write(buf, n);
+
+    auto stream = new Http2Stream();
+    stream->req.version = "HTTP/2";
+    self->streams_[frame->hd.stream_id].reset(stream);
+    nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+    return 0;
   }
-}
 
-// Socket stream implementation
-inline SocketStream::SocketStream(socket_t sock) : sock_(sock) {}
+  static int on_header(nghttp2_session *session, const nghttp2_frame *frame,
+                       const uint8_t *name, size_t namelen,
+                       const uint8_t *value, size_t valuelen,
+                       uint8_t /*flags*/, void * /*user_data*/) {
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+      return 0;
+    }
 
-inline SocketStream::~SocketStream() {}
+    auto stream = get_stream(session, frame->hd.stream_id);
+    if (!stream) { return 0; }
 
-inline int SocketStream::read(char *ptr, size_t size) {
-  if (detail::select_read(sock_, CPPHTTPLIB_READ_TIMEOUT_SECOND,
-                          CPPHTTPLIB_READ_TIMEOUT_USECOND) > 0) {
-    return recv(sock_, ptr, static_cast<int>(size), 0);
+    auto &req = stream->req;
+    std::string key(reinterpret_cast<const char *>(name), namelen);
+    std::string val(reinterpret_cast<const char *>(value), valuelen);
+
+    if (key == ":method") {
+      req.method = val;
+    } else if (key == ":path") {
+      req.target = val;
+
+      auto pos = val.find('?');
+      req.path = decode_url(val.substr(0, pos));
+      if (pos != std::string::npos && pos + 1 < val.size()) {
+        parse_query_text(val.substr(pos + 1), req.params);
+      }
+    } else if (key == ":authority") {
+      req.headers.emplace("Host", val);
+    } else if (key[0] != ':') {
+      req.headers.emplace(key, val);
+    }
+    return 0;
   }
-  return -1;
-}
 
-inline int SocketStream::write(const char *ptr, size_t size) {
-  return send(sock_, ptr, static_cast<int>(size), 0);
-}
+  static int on_data_chunk_recv(nghttp2_session *session, uint8_t /*flags*/,
+                                int32_t stream_id, const uint8_t *data,
+                                size_t len, void *user_data) {
+    auto self = static_cast<Http2ServerSession *>(user_data);
 
-inline int SocketStream::write(const char *ptr) {
-  return write(ptr, strlen(ptr));
-}
+    auto stream = get_stream(session, stream_id);
+    if (!stream || stream->payload_too_large) { return 0; }
 
-inline int SocketStream::write(const std::string &s) {
-  return write(s.data(), s.size());
-}
+    if (stream->req.body.size() + len > self->payload_max_length_) {
+      stream->payload_too_large = true;
+      std::string().swap(stream->req.body);
+      return 0;
+    }
 
-inline std::string SocketStream::get_remote_addr() const {
-  return detail::get_remote_addr(sock_);
-}
+    stream->req.body.append(reinterpret_cast<const char *>(data), len);
+    return 0;
+  }
 
-// Buffer stream implementation
-inline int BufferStream::read(char *ptr, size_t size) {
-#if defined(_MSC_VER) && _MSC_VER < 1900
-  return static_cast<int>(buffer._Copy_s(ptr, size, size));
-#else
-  return static_cast<int>(buffer.copy(ptr, size));
-#endif
-}
+  static int on_frame_recv(nghttp2_session *session,
+                           const nghttp2_frame *frame, void *user_data) {
+    auto self = static_cast<Http2ServerSession *>(user_data);
 
-inline int BufferStream::write(const char *ptr, size_t size) {
-  buffer.append(ptr, size);
-  return static_cast<int>(size);
-}
+    if ((frame->hd.type == NGHTTP2_HEADERS ||
+         frame->hd.type == NGHTTP2_DATA) &&
+        (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) &&
+        get_stream(session, frame->hd.stream_id)) {
+      self->completed_.push_back(frame->hd.stream_id);
+    }
+    return 0;
+  }
 
-inline int BufferStream::write(const char *ptr) {
-  return write(ptr, strlen(ptr));
-}
+  static int on_stream_close(nghttp2_session * /*session*/, int32_t stream_id,
+                             uint32_t error_code, void *user_data) {
+    auto self = static_cast<Http2ServerSession *>(user_data);
 
-inline int BufferStream::write(const std::string &s) {
-  return write(s.data(), s.size());
-}
+    auto it = self->streams_.find(stream_id);
+    if (it == self->streams_.end()) { return 0; }
 
-inline std::string BufferStream::get_remote_addr() const { return ""; }
+    const auto &stream = *it->second;
+    if (stream.responded && error_code == NGHTTP2_NO_ERROR && self->logger_) {
+      self->logger_(stream.req, stream.res);
+    }
 
-inline const std::string &BufferStream::get_buffer() const { return buffer; }
+    self->streams_.erase(it);
+    return 0;
+  }
 
-// HTTP server implementation
-inline Server::Server()
-    : keep_alive_max_count_(CPPHTTPLIB_KEEPALIVE_MAX_COUNT),
-      payload_max_length_(CPPHTTPLIB_PAYLOAD_MAX_LENGTH), is_running_(false),
-      svr_sock_(INVALID_SOCKET) {
-#ifndef _WIN32
-  signal(SIGPIPE, SIG_IGN);
+  SSLSocketStream &strm_;
+  socket_t sock_;
+  size_t payload_max_length_;
+  StreamHandler handler_;
+  Server::Logger logger_;
+  nghttp2_session *session_;
+  std::map<int32_t, std::unique_ptr<Http2Stream>> streams_;
+  std::vector<int32_t> completed_;
+  std::string send_buf_;
+};
+
+struct Http2ClientStream {
+  Request *req = nullptr;
+  Response *res = nullptr;
+  size_t body_offset = 0;
+  std::string pending;
+  size_t pending_offset = 0;
+  uint64_t provider_offset = 0;
+  bool eof = false;
+  uint64_t received = 0;
+  uint64_t sent = 0;
+  ContentReceiverCore out;
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+  std::unique_ptr<decompressor> decomp;
 #endif
-  new_task_queue = [] {
-#if CPPHTTPLIB_THREAD_POOL_COUNT > 0
-    return new ThreadPool(CPPHTTPLIB_THREAD_POOL_COUNT);
-#else
-    return new Threads();
+  ClientTimeouts timeouts;
+  std::chrono::steady_clock::time_point active_at;
+  std::chrono::steady_clock::time_point first_byte_at;
+  std::function<void(bool ok, bool retry)> done;
+  bool headers_received = false;
+  bool aborted = false;
+  bool refused = false;
+  bool closed = false;
+  bool abandoned = false;
+  bool ok = false;
+};
+
+// Multiplexes the requests of several threads over one HTTP/2 connection.
+// A dedicated thread owns the socket and drives the nghttp2 session, while
+// `send` submits a stream and waits until it is closed.
+class Http2ClientSession
+    : public std::enable_shared_from_this<Http2ClientSession> {
+public:
+  // `origin` keys the response times measured for adaptive timeouts, and
+  // `timing` is how the connection was set up.
+  Http2ClientSession(socket_t sock, SSL *ssl, size_t body_reserve_max_length,
+                     const std::string &origin, const ResponseTiming &timing)
+      : sock_(sock), ssl_(ssl), strm_(sock, ssl), session_(nullptr),
+        alive_(false), closing_(false),
+        body_reserve_max_length_(body_reserve_max_length), origin_(origin),
+        timing_(timing) {
+#ifndef _WIN32
+    wakeup_[0] = wakeup_[1] = INVALID_SOCKET;
 #endif
-  };
-}
+  }
 
-inline Server::~Server() {}
+  Http2ClientSession(const Http2ClientSession &) = delete;
 
-inline Server &Server::Get(const char *pattern, Handler handler) {
-  get_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+  ~Http2ClientSession() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      closing_ = true;
+    }
+    wakeup();
+    if (thread_.joinable()) { thread_.join(); }
 
-inline Server &Server::Post(const char *pattern, Handler handler) {
-  post_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+    if (session_) { nghttp2_session_del(session_); }
 
-inline Server &Server::Put(const char *pattern, Handler handler) {
-  put_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+    SSL_shutdown(ssl_);
+    SSLPool::release(ssl_);
+    close_socket(sock_);
 
-inline Server &Server::Patch(const char *pattern, Handler handler) {
-  patch_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+#ifndef _WIN32
+    if (wakeup_[0] != INVALID_SOCKET) {
+      close(wakeup_[0]);
+      close(wakeup_[1]);
+    }
+#endif
+  }
 
-inline Server &Server::Delete(const char *pattern, Handler handler) {
-  delete_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+  bool start() {
+    nghttp2_session_callbacks *callbacks;
+    if (nghttp2_session_callbacks_new(&callbacks) != 0) { return false; }
 
-inline Server &Server::Options(const char *pattern, Handler handler) {
-  options_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
-  return *this;
-}
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+        callbacks, on_data_chunk_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+                                                           on_stream_close);
 
-inline bool Server::set_base_dir(const char *path) {
-  if (detail::is_dir(path)) {
-    base_dir_ = path;
+    auto rv = nghttp2_session_client_new(&session_, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+    if (rv != 0) { return false; }
+
+    nghttp2_settings_entry iv[] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0}};
+    if (nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, iv, 1) != 0) {
+      return false;
+    }
+
+#ifndef _WIN32
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup_) == -1) {
+      wakeup_[0] = wakeup_[1] = INVALID_SOCKET;
+    } else {
+      fcntl(wakeup_[0], F_SETFL, fcntl(wakeup_[0], F_GETFL, 0) | O_NONBLOCK);
+      fcntl(wakeup_[1], F_SETFL, fcntl(wakeup_[1], F_GETFL, 0) | O_NONBLOCK);
+    }
+#endif
+
+    alive_ = true;
+    thread_ = std::thread([this]() { run(); });
     return true;
   }
-  return false;
-}
 
-inline void Server::set_file_request_handler(Handler handler) {
-  file_request_handler_ = handler;
-}
+  // False once the connection is gone or the server has sent GOAWAY.
+  bool is_alive() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return alive_ && nghttp2_session_check_request_allowed(session_);
+  }
 
-inline void Server::set_error_handler(Handler handler) {
-  error_handler_ = handler;
-}
+  // Sends `req` as a new stream and waits for its response. `retry` tells
+  // whether the request may be sent again on a new connection, since the
+  // server is known not to have processed it (or it is idempotent).
+  // `default_headers` are sent along with those of `req`. Only the timeouts
+  // of reading and the total one apply to the stream.
+  bool send(Request &req, Response &res, const Headers &default_headers,
+            const ClientTimeouts &timeouts, bool &retry) {
+    retry = false;
+
+    auto stream = std::make_shared<Http2ClientStream>();
+    stream->req = &req;
+    stream->res = &res;
+    stream->timeouts = timeouts;
+    stream->active_at = std::chrono::steady_clock::now();
+
+    std::weak_ptr<Http2ClientSession> weak_self = shared_from_this();
+    std::weak_ptr<Http2ClientStream> weak_stream = stream;
+    if (!set_interrupt(timeouts.cancellation, [weak_self, weak_stream]() {
+          auto self = weak_self.lock();
+          auto stream = weak_stream.lock();
+          if (self && stream) { self->abandon(*stream); }
+        })) {
+      return false;
+    }
 
-inline void Server::set_logger(Logger logger) { logger_ = logger; }
+    auto ret = wait_for(stream, default_headers, retry);
+    clear_interrupt(timeouts.cancellation);
+    return ret;
+  }
 
-inline void Server::set_keep_alive_max_count(size_t count) {
-  keep_alive_max_count_ = count;
-}
+  // Like `send`, but returns right away. `done(ok, retry)` is called from
+  // the session's thread once the stream is closed, so it must not block.
+  // `req` and `res` must stay alive until then.
+  std::shared_ptr<Http2ClientStream>
+  send_async(Request &req, Response &res, const Headers &default_headers,
+             const ClientTimeouts &timeouts,
+             std::function<void(bool ok, bool retry)> done) {
+    auto stream = std::make_shared<Http2ClientStream>();
+    stream->req = &req;
+    stream->res = &res;
+    stream->done = done;
+    stream->timeouts = timeouts;
+    stream->active_at = std::chrono::steady_clock::now();
+
+    int32_t stream_id;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      stream_id = submit(stream, default_headers);
+      if (stream_id >= 0) { async_count_++; }
+    }
 
-inline void Server::set_payload_max_length(uint64_t length) {
-  payload_max_length_ = length;
-}
+    if (stream_id < 0) { done(false, true); }
+    return stream;
+  }
 
-inline int Server::bind_to_any_port(const char *host, int socket_flags) {
-  return bind_internal(host, 0, socket_flags);
-}
+  // Gives up on `stream`, which fails unless it has been closed already.
+  void abandon(Http2ClientStream &stream) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (stream.closed || stream.abandoned) { return; }
+    stream.abandoned = true;
+
+    for (auto &x : streams_) {
+      if (x.second.get() != &stream) { continue; }
+      if (stream.done) {
+        auto done = stream.done;
+        completed_.push_back([done]() { done(false, false); });
+        async_count_--;
+      }
+      cancel(x.first, stream);
+      break;
+    }
+    cond_.notify_all();
+  }
 
-inline bool Server::listen_after_bind() { return listen_internal(); }
+private:
+  // Submits `stream` and waits until it is closed, abandoned or timed out.
+  bool wait_for(const std::shared_ptr<Http2ClientStream> &stream,
+                const Headers &default_headers, bool &retry) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stream->abandoned) { return false; }
 
-inline bool Server::listen(const char *host, int port, int socket_flags) {
-  if (bind_internal(host, port, socket_flags) < 0) return false;
-  return listen_internal();
-}
+    auto stream_id = submit(stream, default_headers);
+    if (stream_id < 0) {
+      retry = true;
+      return false;
+    }
 
-inline bool Server::is_running() const { return is_running_; }
+    while (!stream->closed) {
+      if (stream->abandoned) { return false; }
 
-inline void Server::stop() {
-  if (is_running_) {
-    assert(svr_sock_ != INVALID_SOCKET);
-    std::atomic<socket_t> sock(svr_sock_.exchange(INVALID_SOCKET));
-    detail::shutdown_socket(sock);
-    detail::close_socket(sock);
+      auto deadline = get_deadline(*stream);
+      if (deadline == (std::chrono::steady_clock::time_point::max)()) {
+        cond_.wait(lock);
+      } else if (std::chrono::steady_clock::now() < deadline) {
+        cond_.wait_until(lock, deadline);
+      } else {
+        // Nothing arrived for this stream in time: give up on it.
+        back_off(*stream);
+        cancel(stream_id, *stream);
+        return false;
+      }
+    }
+
+    retry = can_retry(*stream);
+    return stream->ok;
   }
-}
 
-inline bool Server::parse_request_line(const char *s, Request &req) {
-  static std::regex re("(GET|HEAD|POST|PUT|PATCH|DELETE|OPTIONS) "
-                       "(([^?]+)(?:\\?(.+?))?) (HTTP/1\\.[01])\r\n");
+  // Submits `stream` and wakes up the session's thread to send it. The caller
+  // holds `mutex_`.
+  int32_t submit(const std::shared_ptr<Http2ClientStream> &stream,
+                 const Headers &default_headers) {
+    auto &req = *stream->req;
+
+    static const std::string method_name = ":method";
+    static const std::string scheme_name = ":scheme";
+    static const std::string scheme = "https";
+    static const std::string authority_name = ":authority";
+    static const std::string path_name = ":path";
+
+    std::string authority = get_header_value(
+        req.has_header("Host") ? req.headers : default_headers, "Host", 0, "");
+    auto path = encode_url(req.path);
+
+    // `nva` points into `names`, which must not be reallocated.
+    std::vector<std::string> names;
+    names.reserve(req.headers.size() + default_headers.size());
+
+    std::vector<nghttp2_nv> nva;
+    nva.push_back(make_http2_nv(method_name, req.method));
+    nva.push_back(make_http2_nv(scheme_name, scheme));
+    nva.push_back(make_http2_nv(authority_name, authority));
+    nva.push_back(make_http2_nv(path_name, path));
+    make_http2_nva(req.headers, names, nva);
+    make_http2_nva(default_headers, names, nva);
+
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = stream.get();
+    data_prd.read_callback = read_body;
+
+    auto stream_id = alive_ ? nghttp2_submit_request(
+                                  session_, nullptr, nva.data(), nva.size(),
+                                  req.body.empty() && !req.content_provider
+                                      ? nullptr
+                                      : &data_prd,
+                                  stream.get())
+                            : -1;
+    if (stream_id >= 0) {
+      // Only the first stream waited for the connection to be set up.
+      stream->res->timing = timing_;
+      timing_ = ResponseTiming();
+      timing_.connection_reused = true;
+
+      streams_[stream_id] = stream;
+      wakeup();
+    }
+    return stream_id;
+  }
 
-  std::cmatch m;
-  if (std::regex_match(s, m, re)) {
-    req.version = std::string(m[5]);
-    req.method = std::string(m[1]);
-    req.target = std::string(m[2]);
-    req.path = detail::decode_url(m[3]);
+  // Resets a stream which is no longer waited for. The caller holds `mutex_`.
+  void cancel(int32_t stream_id, Http2ClientStream &stream) {
+    stream.req = nullptr;
+    stream.res = nullptr;
+    stream.done = nullptr;
+    nghttp2_submit_rst_stream(session_, NGHTTP2_FLAG_NONE, stream_id,
+                              NGHTTP2_CANCEL);
+    wakeup();
+  }
 
-    // Parse query text
-    auto len = std::distance(m[4].first, m[4].second);
-    if (len > 0) { detail::parse_query_text(m[4], req.params); }
+  // Whether the server is known not to have processed the request of a
+  // failed stream (or it is safe to send again anyway).
+  static bool can_retry(const Http2ClientStream &stream) {
+    if (stream.ok || stream.aborted || !stream.req) { return false; }
+    const auto &method = stream.req->method;
+    return stream.refused ||
+           (!stream.headers_received &&
+            (method == "GET" || method == "HEAD" || method == "OPTIONS"));
+  }
 
-    return true;
+  // Queues the `done` callback of a closed asynchronous stream, which runs
+  // once `mutex_` is released. The caller holds `mutex_`.
+  void complete(const std::shared_ptr<Http2ClientStream> &stream) {
+    if (!stream->done) { return; }
+    completed_.push_back(
+        [stream]() { stream->done(stream->ok, can_retry(*stream)); });
+    async_count_--;
   }
 
-  return false;
-}
+  // When `stream` times out unless more of its response arrives.
+  static std::chrono::steady_clock::time_point
+  get_deadline(const Http2ClientStream &stream) {
+    auto msec = stream.headers_received ? stream.timeouts.read_msec
+                                        : stream.timeouts.first_byte_msec;
+    auto deadline = stream.timeouts.deadline;
+    if (msec) {
+      deadline = std::min(deadline, stream.active_at +
+                                        std::chrono::milliseconds(msec));
+    }
+    return deadline;
+  }
 
-inline bool Server::write_response(Stream &strm, bool last_connection,
-                                   const Request &req, Response &res) {
-  assert(res.status != -1);
+  // Lets later adaptive timeouts grow after `stream` timed out waiting for
+  // its response to start.
+  void back_off(const Http2ClientStream &stream) {
+    if (stream.timeouts.adaptive && !stream.headers_received &&
+        is_first_byte_timed_out(stream.timeouts, stream.active_at)) {
+      OriginRttCache::get().back_off(origin_, true);
+    }
+  }
 
-  if (400 <= res.status && error_handler_) { error_handler_(req, res); }
+  // Cancels asynchronous streams on which nothing arrived in time, and
+  // returns when the next one would time out. The caller holds `mutex_`.
+  std::chrono::steady_clock::time_point expire_async_streams() {
+    auto now = std::chrono::steady_clock::now();
+    auto next = (std::chrono::steady_clock::time_point::max)();
+    for (auto &x : streams_) {
+      auto &stream = *x.second;
+      if (!stream.done || stream.closed) { continue; }
+
+      auto deadline = get_deadline(stream);
+      if (deadline <= now) {
+        back_off(stream);
+        auto done = stream.done;
+        completed_.push_back([done]() { done(false, false); });
+        async_count_--;
+        cancel(x.first, stream);
+      } else if (deadline < next) {
+        next = deadline;
+      }
+    }
+    return next;
+  }
 
-  // Response line
-  if (!strm.write_format("HTTP/1.1 %d %s\r\n", res.status,
-                         detail::status_message(res.status))) {
-    return false;
+  void notify_completed(std::vector<std::function<void()>> &completed) {
+    for (auto &fn : completed) {
+      fn();
+    }
+    completed.clear();
   }
 
-  // Headers
-  if (last_connection || req.get_header_value("Connection") == "close") {
-    res.set_header("Connection", "close");
+  void wakeup() {
+#ifndef _WIN32
+    if (wakeup_[1] != INVALID_SOCKET) {
+      char c = 0;
+      auto ret = ::write(wakeup_[1], &c, 1);
+      (void)ret;
+    }
+#endif
+  }
+
+  bool wait_readable(int timeout_msec) {
+    struct pollfd fds[2];
+    fds[0].fd = sock_;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+#ifdef _WIN32
+    // Without a wakeup socket, new requests are picked up on the next short
+    // timeout.
+    WSAPoll(fds, 1, 10);
+#else
+    nfds_t count = 1;
+    auto timeout = 10;
+    if (wakeup_[0] != INVALID_SOCKET) {
+      fds[1].fd = wakeup_[0];
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+      count = 2;
+      timeout = timeout_msec;
+    }
+
+    poll(fds, count, timeout);
+
+    if (count > 1 && fds[1].revents) {
+      char buf[64];
+      while (read(wakeup_[0], buf, sizeof(buf)) > 0) {}
+    }
+#endif
+    return fds[0].revents != 0;
   }
 
-  if (!last_connection && req.get_header_value("Connection") == "Keep-Alive") {
-    res.set_header("Connection", "Keep-Alive");
-  }
+  void run() {
+    std::vector<char> buf(CPPHTTPLIB_SSL_RECV_BUFSIZ);
+    std::string out;
+    std::vector<std::function<void()>> completed;
+
+    while (true) {
+      out.clear();
+      auto timeout_msec = -1;
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (closing_) { break; }
+
+        // Asynchronous streams have no waiting thread to time them out.
+        if (async_count_) {
+          auto next = expire_async_streams();
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          next - std::chrono::steady_clock::now())
+                          .count();
+          timeout_msec = static_cast<int>(std::max<int64_t>(
+              1, std::min<int64_t>(left + 1, 1000)));
+        }
+
+        const uint8_t *data = nullptr;
+        ssize_t n;
+        while ((n = nghttp2_session_mem_send(session_, &data)) > 0) {
+          out.append(reinterpret_cast<const char *>(data),
+                     static_cast<size_t>(n));
+        }
+        completed.swap(completed_);
+        if (n < 0 || (!nghttp2_session_want_read(session_) &&
+                      !nghttp2_session_want_write(session_))) {
+          break;
+        }
+      }
+
+      notify_completed(completed);
 
-  if (!res.has_header("Content-Type")) {
-    res.set_header("Content-Type", "text/plain");
-  }
+      if (!out.empty() &&
+          strm_.write(out) != static_cast<int>(out.size())) {
+        break;
+      }
 
-  if (!res.has_header("Accept-Ranges")) {
-    res.set_header("Accept-Ranges", "bytes");
-  }
+      if (!strm_.has_pending_data() && !wait_readable(timeout_msec)) {
+        continue;
+      }
 
-  std::string content_type;
-  std::string boundary;
+      auto n = SSL_read(ssl_, buf.data(), static_cast<int>(buf.size()));
+      if (n <= 0) {
+        if (SSL_get_error(ssl_, n) == SSL_ERROR_WANT_READ) { continue; }
+        break;
+      }
 
-  if (req.ranges.size() > 1) {
-    boundary = detail::make_multipart_data_boundary();
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto data = reinterpret_cast<const uint8_t *>(buf.data());
+      auto size = static_cast<size_t>(n);
+      if (nghttp2_session_mem_recv(session_, data, size) < 0) { break; }
+    }
 
-    auto it = res.headers.find("Content-Type");
-    if (it != res.headers.end()) {
-      content_type = it->second;
-      res.headers.erase(it);
+    // The connection is gone: fail the streams still waiting on it.
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      alive_ = false;
+      for (auto &x : streams_) {
+        x.second->closed = true;
+        complete(x.second);
+      }
+      streams_.clear();
+      completed.insert(completed.end(), completed_.begin(), completed_.end());
+      completed_.clear();
+      cond_.notify_all();
     }
 
-    res.headers.emplace("Content-Type",
-                        "multipart/byteranges; boundary=" + boundary);
+    notify_completed(completed);
   }
 
-  if (res.body.empty()) {
-    if (res.content_provider_resource_length > 0) {
-      uint64_t length = 0;
-      if (req.ranges.empty()) {
-        length = res.content_provider_resource_length;
-      } else if (req.ranges.size() == 1) {
-        auto offsets = detail::get_range_offset_and_length(
-            req, res.content_provider_resource_length, 0);
-        auto offset = offsets.first;
-        length = offsets.second;
-        auto content_range = detail::make_content_range_header_field(
-            offset, length, res.content_provider_resource_length);
-        res.set_header("Content-Range", content_range);
-      } else {
-        length = detail::get_multipart_ranges_data_length(req, res, boundary,
-                                                          content_type);
-      }
-      res.set_header("Content-Length", std::to_string(length));
-    } else {
-      if (res.content_provider) {
-        res.set_header("Transfer-Encoding", "chunked");
-      } else {
-        res.set_header("Content-Length", "0");
+  static Http2ClientStream *get_stream(nghttp2_session *session, int32_t id) {
+    return static_cast<Http2ClientStream *>(
+        nghttp2_session_get_stream_user_data(session, id));
+  }
+
+  static ssize_t read_body(nghttp2_session * /*session*/, int32_t /*id*/,
+                           uint8_t *buf, size_t length, uint32_t *data_flags,
+                           nghttp2_data_source *source, void * /*user_data*/) {
+    auto &stream = *static_cast<Http2ClientStream *>(source->ptr);
+    if (!stream.req) { return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE; }
+
+    const auto &req = *stream.req;
+    if (!req.content_provider) {
+      const auto &body = req.body;
+      auto n = std::min(length, body.size() - stream.body_offset);
+      memcpy(buf, body.data() + stream.body_offset, n);
+      stream.body_offset += n;
+      stream.sent += n;
+      if (stream.body_offset == body.size()) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
       }
+      return static_cast<ssize_t>(n);
     }
-  } else {
-    if (req.ranges.empty()) {
-      ;
-    } else if (req.ranges.size() == 1) {
-      auto offsets =
-          detail::get_range_offset_and_length(req, res.body.size(), 0);
-      auto offset = offsets.first;
-      auto length = offsets.second;
-      auto content_range = detail::make_content_range_header_field(
-          offset, length, res.body.size());
-      res.set_header("Content-Range", content_range);
-      res.body = res.body.substr(offset, length);
-    } else {
-      res.body =
-          detail::make_multipart_ranges_data(req, res, boundary, content_type);
+
+    // Drop what was sent already, so that the buffer stays bounded.
+    if (stream.pending_offset > 0 &&
+        stream.pending.size() - stream.pending_offset < length &&
+        !stream.eof) {
+      stream.pending.erase(0, stream.pending_offset);
+      stream.pending_offset = 0;
     }
 
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-    // TODO: 'Accpet-Encoding' has gzip, not gzip;q=0
-    const auto &encodings = req.get_header_value("Accept-Encoding");
-    if (encodings.find("gzip") != std::string::npos &&
-        detail::can_compress(res.get_header_value("Content-Type"))) {
-      if (detail::compress(res.body)) {
-        res.set_header("Content-Encoding", "gzip");
+    auto aborted = false;
+    while (stream.pending.size() - stream.pending_offset < length &&
+           !stream.eof) {
+      if (!req.content_provider_resource_length) {
+        req.content_provider(
+            stream.provider_offset, 0,
+            [&](const char *d, uint64_t l) {
+              if (!l) { stream.eof = true; }
+              stream.pending.append(d, static_cast<size_t>(l));
+              stream.provider_offset += l;
+            },
+            [&]() { stream.eof = true; });
+      } else {
+        req.content_provider(
+            stream.provider_offset,
+            req.content_provider_resource_length - stream.provider_offset,
+            [&](const char *d, uint64_t l) {
+              stream.pending.append(d, static_cast<size_t>(l));
+              stream.provider_offset += l;
+            },
+            [&]() { aborted = true; });
+
+        if (aborted) { return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE; }
+        if (stream.provider_offset >= req.content_provider_resource_length) {
+          stream.eof = true;
+        }
       }
     }
-#endif
 
-    auto length = std::to_string(res.body.size());
-    res.set_header("Content-Length", length);
-  }
+    auto n = std::min(length, stream.pending.size() - stream.pending_offset);
+    memcpy(buf, stream.pending.data() + stream.pending_offset, n);
+    stream.pending_offset += n;
+    stream.sent += n;
 
-  if (!detail::write_headers(strm, res)) { return false; }
+    if (stream.pending_offset == stream.pending.size()) {
+      stream.pending.clear();
+      stream.pending_offset = 0;
+      if (stream.eof) { *data_flags |= NGHTTP2_DATA_FLAG_EOF; }
+    }
+    return static_cast<ssize_t>(n);
+  }
 
-  // Body
-  if (req.method != "HEAD") {
-    if (!res.body.empty()) {
-      if (!strm.write(res.body)) { return false; }
-    } else if (res.content_provider) {
-      if (!write_content_with_provider(strm, req, res, boundary,
-                                       content_type)) {
-        return false;
+  static int on_header(nghttp2_session *session, const nghttp2_frame *frame,
+                       const uint8_t *name, size_t namelen,
+                       const uint8_t *value, size_t valuelen,
+                       uint8_t /*flags*/, void *user_data) {
+    if (frame->hd.type != NGHTTP2_HEADERS) { return 0; }
+
+    auto stream = get_stream(session, frame->hd.stream_id);
+    if (!stream || !stream->res) { return 0; }
+
+    // Until the first header, `active_at` is when the stream was submitted.
+    auto &res = *stream->res;
+    if (!stream->headers_received) {
+      stream->first_byte_at = std::chrono::steady_clock::now();
+      res.timing.first_byte = stream->first_byte_at - stream->active_at;
+      if (stream->timeouts.adaptive) {
+        auto self = static_cast<Http2ClientSession *>(user_data);
+        OriginRttCache::get().add(self->origin_, true, res.timing.first_byte);
       }
     }
+
+    std::string key(reinterpret_cast<const char *>(name), namelen);
+    std::string val(reinterpret_cast<const char *>(value), valuelen);
+
+    if (key == ":status") {
+      res.version = "HTTP/2";
+      res.status = std::atoi(val.c_str());
+    } else if (key[0] != ':') {
+      res.headers.emplace(key, val);
+    }
+
+    stream->headers_received = true;
+    stream->active_at = std::chrono::steady_clock::now();
+    return 0;
   }
 
-  // Log
-  if (logger_) { logger_(req, res); }
+  static int on_data_chunk_recv(nghttp2_session *session, uint8_t /*flags*/,
+                                int32_t stream_id, const uint8_t *data,
+                                size_t len, void *user_data) {
+    auto stream = get_stream(session, stream_id);
+    if (!stream || !stream->res || stream->aborted) { return 0; }
 
-  return true;
-}
+    auto &res = *stream->res;
+    stream->active_at = std::chrono::steady_clock::now();
 
-inline bool
-Server::write_content_with_provider(Stream &strm, const Request &req,
-                                    Response &res, const std::string &boundary,
-                                    const std::string &content_type) {
-  if (res.content_provider_resource_length) {
-    if (req.ranges.empty()) {
-      if (detail::write_content(strm, res.content_provider, 0,
-                                res.content_provider_resource_length) < 0) {
-        return false;
-      }
-    } else if (req.ranges.size() == 1) {
-      auto offsets = detail::get_range_offset_and_length(
-          req, res.content_provider_resource_length, 0);
-      auto offset = offsets.first;
-      auto length = offsets.second;
-      if (detail::write_content(strm, res.content_provider, offset, length) <
-          0) {
-        return false;
-      }
-    } else {
-      if (!detail::write_multipart_ranges_data(strm, req, res, boundary,
-                                               content_type)) {
-        return false;
+    if (!stream->out) {
+      auto self = static_cast<Http2ClientSession *>(user_data);
+      stream->out = make_content_receiver(res, self->body_reserve_max_length_);
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      if (res.get_header_value("Content-Encoding") == "gzip") {
+        stream->decomp.reset(new decompressor());
+        auto decomp = stream->decomp.get();
+        auto out = stream->out;
+        stream->out = [decomp, out](const char *buf, size_t n) {
+          return decomp->is_valid() &&
+                 decomp->decompress(buf, n, [&](const char *buf, size_t n) {
+                   return out(buf, n);
+                 });
+        };
       }
+#endif
     }
-  } else {
-    if (detail::write_content_chunked(strm, res.content_provider) < 0) {
-      return false;
-    }
-  }
-  return true;
-}
 
-inline bool Server::handle_file_request(Request &req, Response &res) {
-  if (!base_dir_.empty() && detail::is_valid_path(req.path)) {
-    std::string path = base_dir_ + req.path;
+    stream->received += len;
+    auto length = get_header_value_uint64(res.headers, "Content-Length", 0);
 
-    if (!path.empty() && path.back() == '/') { path += "index.html"; }
+    if (!stream->out(reinterpret_cast<const char *>(data), len) ||
+        (res.progress && !res.progress(stream->received, length))) {
+      stream->aborted = true;
+      nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id,
+                                NGHTTP2_CANCEL);
+    }
+    return 0;
+  }
 
-    if (detail::is_file(path)) {
-      detail::read_file(path, res.body);
-      auto type = detail::find_content_type(path);
-      if (type) { res.set_header("Content-Type", type); }
-      res.status = 200;
-      if (file_request_handler_) {
-        file_request_handler_(req, res);
+  static int on_stream_close(nghttp2_session * /*session*/, int32_t stream_id,
+                             uint32_t error_code, void *user_data) {
+    auto self = static_cast<Http2ClientSession *>(user_data);
+
+    auto it = self->streams_.find(stream_id);
+    if (it == self->streams_.end()) { return 0; }
+
+    auto &stream = *it->second;
+    if (stream.res) {
+      auto &timing = stream.res->timing;
+      timing.bytes_sent += stream.sent;
+      timing.bytes_received += stream.received;
+      if (stream.headers_received) {
+        timing.transfer =
+            std::chrono::steady_clock::now() - stream.first_byte_at;
       }
-      return true;
     }
+    stream.closed = true;
+    stream.refused = error_code == NGHTTP2_REFUSED_STREAM;
+    stream.ok = error_code == NGHTTP2_NO_ERROR && stream.headers_received &&
+                !stream.aborted;
+
+    self->complete(it->second);
+    self->streams_.erase(it);
+    self->cond_.notify_all();
+    return 0;
   }
 
-  return false;
-}
+  socket_t sock_;
+  SSL *ssl_;
+  SSLSocketStream strm_;
+  nghttp2_session *session_;
+  bool alive_;
+  bool closing_;
+  size_t body_reserve_max_length_;
+  std::string origin_;
+  ResponseTiming timing_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::map<int32_t, std::shared_ptr<Http2ClientStream>> streams_;
+  std::vector<std::function<void()>> completed_;
+  size_t async_count_ = 0;
+#ifndef _WIN32
+  socket_t wakeup_[2];
+#endif
+};
+#endif
 
-inline socket_t Server::create_server_socket(const char *host, int port,
-                                             int socket_flags) const {
-  return detail::create_socket(
-      host, port,
-      [](socket_t sock, struct addrinfo &ai) -> bool {
-        if (::bind(sock, ai.ai_addr, static_cast<int>(ai.ai_addrlen))) {
-          return false;
-        }
-        if (::listen(sock, 5)) { // Listen through 5 channels
-          return false;
-        }
-        return true;
-      },
-      socket_flags);
-}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static std::shared_ptr<std::vector<std::mutex>> openSSL_locks_;
 
-inline int Server::bind_internal(const char *host, int port, int socket_flags) {
-  if (!is_valid()) { return -1; }
+class SSLThreadLocks {
+public:
+  SSLThreadLocks() {
+    openSSL_locks_ =
+        std::make_shared<std::vector<std::mutex>>(CRYPTO_num_locks());
+    CRYPTO_set_locking_callback(locking_callback);
+  }
 
-  svr_sock_ = create_server_socket(host, port, socket_flags);
-  if (svr_sock_ == INVALID_SOCKET) { return -1; }
+  ~SSLThreadLocks() { CRYPTO_set_locking_callback(nullptr); }
 
-  if (port == 0) {
-    struct sockaddr_storage address;
-    socklen_t len = sizeof(address);
-    if (getsockname(svr_sock_, reinterpret_cast<struct sockaddr *>(&address),
-                    &len) == -1) {
-      return -1;
-    }
-    if (address.ss_family == AF_INET) {
-      return ntohs(reinterpret_cast<struct sockaddr_in *>(&address)->sin_port);
-    } else if (address.ss_family == AF_INET6) {
-      return ntohs(
-          reinterpret_cast<struct sockaddr_in6 *>(&address)->sin6_port);
+private:
+  static void locking_callback(int mode, int type, const char * /*file*/,
+                               int /*line*/) {
+    auto &locks = *openSSL_locks_;
+    if (mode & CRYPTO_LOCK) {
+      locks[type].lock();
     } else {
-      return -1;
+      locks[type].unlock();
     }
-  } else {
-    return port;
   }
-}
+};
 
-inline bool Server::listen_internal() {
-  auto ret = true;
-  is_running_ = true;
+#endif
 
-  {
-    std::unique_ptr<TaskQueue> task_queue(new_task_queue());
+class SSLInit {
+public:
+  SSLInit() {
+    SSL_load_error_strings();
+    SSL_library_init();
+  }
 
-    for (;;) {
-      if (svr_sock_ == INVALID_SOCKET) {
-        // The server socket was closed by 'stop' method.
-        break;
-      }
+  ~SSLInit() { ERR_free_strings(); }
+
+private:
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  SSLThreadLocks thread_init_;
+#endif
+};
+
+static SSLInit sslinit_;
+
+} // namespace detail
+
+// SSL socket stream implementation
+inline SSLSocketStream::SSLSocketStream(socket_t sock, SSL *ssl)
+    : sock_(sock), ssl_(ssl) {}
+
+inline SSLSocketStream::~SSLSocketStream() {}
+
+// NOTE: Small reads, such as the 1 byte reads of `stream_line_reader`, are
+// served from a buffer holding a whole decrypted TLS record, instead of
+// going through `select` and `SSL_read` for every call.
+inline int SSLSocketStream::read(char *ptr, size_t size) {
+  read_since_write_ = true;
+
+  if (read_buff_off_ < read_buff_content_size_) {
+    auto n = std::min(size, read_buff_content_size_ - read_buff_off_);
+    memcpy(ptr, read_buff_.data() + read_buff_off_, n);
+    read_buff_off_ += n;
+    return static_cast<int>(n);
+  }
+
+  // The count read must fit the return value.
+  size = std::min(size, static_cast<size_t>(std::numeric_limits<int>::max()));
+
+  // OpenSSL already keeps the rest of a decrypted record for larger reads.
+  auto direct = size >= CPPHTTPLIB_RECV_BUFSIZ;
+  if (!direct) { read_buff_.resize(CPPHTTPLIB_SSL_RECV_BUFSIZ); }
+  auto buf = direct ? ptr : read_buff_.data();
+  auto buf_size = direct ? size : CPPHTTPLIB_SSL_RECV_BUFSIZ;
+
+  auto first = first_byte_time_ == std::chrono::steady_clock::time_point();
+  int n;
+  do {
+    if (!has_pending_data() &&
+        !detail::wait_readable(
+            sock_, first ? first_byte_timeout_msec_ : read_timeout_msec_,
+            deadline_)) {
+      return -1;
+    }
 
-      auto val = detail::select_read(svr_sock_, 0, 100000);
+    // Without SSL_MODE_AUTO_RETRY, a record without data leaves nothing to
+    // read yet.
+    n = SSL_read(ssl_, buf, static_cast<int>(buf_size));
+  } while (n <= 0 && SSL_get_error(ssl_, n) == SSL_ERROR_WANT_READ);
 
-      if (val == 0) { // Timeout
-        continue;
-      }
+  if (n <= 0) { return n; }
+  if (first) { first_byte_time_ = std::chrono::steady_clock::now(); }
+  bytes_read_ += static_cast<uint64_t>(n);
+  if (direct) { return n; }
 
-      socket_t sock = accept(svr_sock_, nullptr, nullptr);
+  auto len = std::min(size, static_cast<size_t>(n));
+  memcpy(ptr, read_buff_.data(), len);
+  read_buff_off_ = len;
+  read_buff_content_size_ = static_cast<size_t>(n);
+  return static_cast<int>(len);
+}
 
-      if (sock == INVALID_SOCKET) {
-        if (svr_sock_ != INVALID_SOCKET) {
-          detail::close_socket(svr_sock_);
-          ret = false;
-        } else {
-          ; // The server socket was closed by user.
-        }
-        break;
-      }
+inline void SSLSocketStream::set_read_timeout(
+    time_t first_byte_msec, time_t msec,
+    std::chrono::steady_clock::time_point deadline) {
+  first_byte_timeout_msec_ = first_byte_msec;
+  read_timeout_msec_ = msec;
+  deadline_ = deadline;
+}
 
-      task_queue->enqueue([=]() { read_and_close_socket(sock); });
-    }
+inline std::chrono::steady_clock::time_point
+SSLSocketStream::get_first_byte_time() const {
+  return first_byte_time_;
+}
 
-    task_queue->shutdown();
-  }
+inline uint64_t SSLSocketStream::get_bytes_read() const { return bytes_read_; }
 
-  is_running_ = false;
-  return ret;
+inline uint64_t SSLSocketStream::get_bytes_written() const {
+  return bytes_written_;
 }
 
-inline bool Server::routing(Request &req, Response &res) {
-  if (req.method == "GET" && handle_file_request(req, res)) { return true; }
+inline void SSLSocketStream::preload(const std::string &data) {
+  read_buff_.assign(data.begin(), data.end());
+  read_buff_off_ = 0;
+  read_buff_content_size_ = data.size();
+}
 
-  if (req.method == "GET" || req.method == "HEAD") {
-    return dispatch_request(req, res, get_handlers_);
-  } else if (req.method == "POST") {
-    return dispatch_request(req, res, post_handlers_);
-  } else if (req.method == "PUT") {
-    return dispatch_request(req, res, put_handlers_);
-  } else if (req.method == "PATCH") {
-    return dispatch_request(req, res, patch_handlers_);
-  } else if (req.method == "DELETE") {
-    return dispatch_request(req, res, delete_handlers_);
-  } else if (req.method == "OPTIONS") {
-    return dispatch_request(req, res, options_handlers_);
+inline void SSLSocketStream::enable_dynamic_record_sizing(bool enabled) {
+  if (enabled && !dynamic_record_sizing_) {
+    // Small records only help if they aren't held back by Nagle's algorithm.
+    int yes = 1;
+    setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, (char *)&yes, sizeof(yes));
   }
-  return false;
+  dynamic_record_sizing_ = enabled;
 }
 
-inline bool Server::dispatch_request(Request &req, Response &res,
-                                     Handlers &handlers) {
-  for (const auto &x : handlers) {
-    const auto &pattern = x.first;
-    const auto &handler = x.second;
+inline bool SSLSocketStream::has_pending_data() const {
+  if (read_buff_off_ < read_buff_content_size_) { return true; }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  return SSL_pending(ssl_) > 0;
+#else
+  // Unlike `SSL_pending`, this includes raw records read ahead.
+  return SSL_has_pending(ssl_) == 1;
+#endif
+}
 
-    if (std::regex_match(req.path, req.matches, pattern)) {
-      handler(req, res);
-      return true;
+// NOTE: With dynamic record sizing, the first bytes of a response (any write
+// after a read) or of a write after an idle period go out in records that
+// fit into one TCP segment, so the peer can decrypt them as soon as they
+// arrive. Records grow to the full size once the connection is busy.
+inline int SSLSocketStream::write(const char *ptr, size_t size) {
+  if (!dynamic_record_sizing_) {
+    auto n = SSL_write(ssl_, ptr, static_cast<int>(size));
+    if (n > 0) { bytes_written_ += static_cast<uint64_t>(n); }
+    return n;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (read_since_write_ ||
+      now - last_write_ >
+          std::chrono::milliseconds(CPPHTTPLIB_SSL_RECORD_IDLE_MSECOND)) {
+    written_since_reset_ = 0;
+  }
+  read_since_write_ = false;
+  last_write_ = now;
+
+  size_t written = 0;
+  while (written < size) {
+    auto len = size - written;
+    if (written_since_reset_ < CPPHTTPLIB_SSL_SMALL_RECORD_BYTES) {
+      len = std::min(len, CPPHTTPLIB_SSL_SMALL_RECORD_SIZE);
     }
+
+    auto n = SSL_write(ssl_, ptr + written, static_cast<int>(len));
+    if (n <= 0) { return written > 0 ? static_cast<int>(written) : n; }
+
+    written += static_cast<size_t>(n);
+    written_since_reset_ += static_cast<size_t>(n);
+    bytes_written_ += static_cast<uint64_t>(n);
   }
-  return false;
+
+  return static_cast<int>(written);
 }
 
-inline bool
-Server::process_request(Stream &strm, bool last_connection,
-                        bool &connection_close,
-                        std::function<void(Request &)> setup_request) {
-  const auto bufsiz = 2048;
-  char buf[bufsiz];
+inline int SSLSocketStream::write(const char *ptr) {
+  return write(ptr, strlen(ptr));
+}
 
-  detail::stream_line_reader reader(strm, buf, bufsiz);
+inline int SSLSocketStream::write(const std::string &s) {
+  return write(s.data(), s.size());
+}
 
-  // Connection has been closed on client
-  if (!reader.getline()) { return false; }
+inline std::string SSLSocketStream::get_remote_addr() const {
+  return detail::get_remote_addr(sock_);
+}
 
-  Request req;
-  Response res;
+// SSL HTTP server implementation
+inline SSLServer::SSLServer(const char *cert_path, const char *private_key_path,
+                            const char *client_ca_cert_file_path,
+                            const char *client_ca_cert_dir_path) {
+  ctx_ = SSL_CTX_new(SSLv23_server_method());
 
-  res.version = "HTTP/1.1";
+  if (ctx_) {
+    SSL_CTX_set_options(ctx_,
+                        SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+                            SSL_OP_NO_COMPRESSION |
+                            SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
 
-  // Check if the request URI doesn't exceed the limit
-  if (reader.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
-    Headers dummy;
-    detail::read_headers(strm, dummy);
-    res.status = 414;
-    return write_response(strm, last_connection, req, res);
-  }
+    SSL_CTX_set_app_data(ctx_, this);
 
-  // Request line and headers
-  if (!parse_request_line(reader.ptr(), req) ||
-      !detail::read_headers(strm, req.headers)) {
-    res.status = 400;
-    return write_response(strm, last_connection, req, res);
-  }
+    // Let OpenSSL pull whole records, and more, with each socket read.
+    SSL_CTX_set_read_ahead(ctx_, 1);
 
-  if (req.get_header_value("Connection") == "close") {
-    connection_close = true;
-  }
+    // Sessions are only resumed within the same context id, which OpenSSL
+    // requires as soon as client certificates are verified.
+    static const unsigned char sid_ctx[] = "cpp-httplib";
+    SSL_CTX_set_session_id_context(ctx_, sid_ctx, sizeof(sid_ctx) - 1);
+    set_session_cache(CPPHTTPLIB_SSL_SESSION_CACHE_SIZE);
 
-  if (req.version == "HTTP/1.0" &&
-      req.get_header_value("Connection") != "Keep-Alive") {
-    connection_close = true;
-  }
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+    SSL_CTX_set_alpn_select_cb(ctx_, alpn_select_callback, this);
+#endif
 
-  req.set_header("REMOTE_ADDR", strm.get_remote_addr());
+    // auto ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    // SSL_CTX_set_tmp_ecdh(ctx_, ecdh);
+    // EC_KEY_free(ecdh);
 
-  // Body
-  if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH") {
-    if (!detail::read_content(strm, req, payload_max_length_, res.status,
-                              Progress(), [&](const char *buf, size_t n) {
-                                req.body.append(buf, n);
-                                return true;
-                              })) {
-      return write_response(strm, last_connection, req, res);
-    }
+    if (SSL_CTX_use_certificate_chain_file(ctx_, cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx_, private_key_path, SSL_FILETYPE_PEM) !=
+            1) {
+      SSL_CTX_free(ctx_);
+      ctx_ = nullptr;
+    } else if (client_ca_cert_file_path || client_ca_cert_dir_path) {
+      // if (client_ca_cert_file_path) {
+      //   auto list = SSL_load_client_CA_file(client_ca_cert_file_path);
+      //   SSL_CTX_set_client_CA_list(ctx_, list);
+      // }
 
-    const auto &content_type = req.get_header_value("Content-Type");
+      SSL_CTX_load_verify_locations(ctx_, client_ca_cert_file_path,
+                                    client_ca_cert_dir_path);
 
-    if (!content_type.find("application/x-www-form-urlencoded")) {
-      detail::parse_query_text(req.body, req.params);
-    } else if (!content_type.find("multipart/form-data")) {
-      std::string boundary;
-      if (!detail::parse_multipart_boundary(content_type, boundary) ||
-          !detail::parse_multipart_formdata(boundary, req.body, req.files)) {
-        res.status = 400;
-        return write_response(strm, last_connection, req, res);
-      }
+      SSL_CTX_set_verify(
+          ctx_,
+          SSL_VERIFY_PEER |
+              SSL_VERIFY_FAIL_IF_NO_PEER_CERT, // SSL_VERIFY_CLIENT_ONCE,
+          nullptr);
     }
   }
+}
 
-  if (req.has_header("Range")) {
-    const auto &range_header_value = req.get_header_value("Range");
-    if (!detail::parse_range_header(range_header_value, req.ranges)) {
-      // TODO: error
-    }
+inline SSLServer::~SSLServer() {
+  if (crypto_queue_) { crypto_queue_->shutdown(); }
+  if (ctx_) {
+    detail::SSLPool::discard(ctx_);
+    SSL_CTX_free(ctx_);
   }
+}
 
-  if (setup_request) { setup_request(req); }
+inline bool SSLServer::is_valid() const { return ctx_; }
 
-  if (routing(req, res)) {
-    if (res.status == -1) { res.status = req.ranges.empty() ? 200 : 206; }
+inline void SSLServer::set_session_cache(long size, long timeout_sec) {
+  if (!ctx_) { return; }
+
+  session_cache_enabled_ = size > 0;
+  if (size > 0) {
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx_, size);
+    SSL_CTX_set_timeout(ctx_, timeout_sec);
   } else {
-    res.status = 404;
+    // Keep the server mode so that an external cache still gets called.
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER |
+                                             SSL_SESS_CACHE_NO_INTERNAL);
   }
 
-  return write_response(strm, last_connection, req, res);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (max_early_data_ > 0) { update_max_early_data(); }
+#endif
 }
 
-inline bool Server::is_valid() const { return true; }
+inline void SSLServer::enable_session_tickets(bool enabled) {
+  if (!ctx_) { return; }
 
-inline bool Server::read_and_close_socket(socket_t sock) {
-  return detail::read_and_close_socket(
-      sock, keep_alive_max_count_,
-      [this](Stream &strm, bool last_connection, bool &connection_close) {
-        return process_request(strm, last_connection, connection_close,
-                               nullptr);
-      });
+  if (enabled) {
+    SSL_CTX_clear_options(ctx_, SSL_OP_NO_TICKET);
+  } else {
+    SSL_CTX_set_options(ctx_, SSL_OP_NO_TICKET);
+  }
 }
 
-// HTTP client implementation
-inline Client::Client(const char *host, int port, time_t timeout_sec)
-    : host_(host), port_(port), timeout_sec_(timeout_sec),
-      host_and_port_(host_ + ":" + std::to_string(port_)) {}
+inline void
+SSLServer::set_session_ticket_key_rotation(time_t interval_sec,
+                                           size_t retired_key_count) {
+  if (!ctx_) { return; }
 
-inline Client::~Client() {}
+  {
+    std::lock_guard<std::mutex> guard(ticket_keys_mutex_);
+    ticket_key_rotation_interval_ = interval_sec;
+    retired_ticket_key_count_ = retired_key_count;
+    ticket_keys_.clear();
+  }
 
-inline bool Client::is_valid() const { return true; }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(
+      ctx_, interval_sec > 0 ? ticket_key_callback : nullptr);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(
+      ctx_, interval_sec > 0 ? ticket_key_callback : nullptr);
+#endif
+}
 
-inline socket_t Client::create_client_socket() const {
-  return detail::create_socket(
-      host_.c_str(), port_, [=](socket_t sock, struct addrinfo &ai) -> bool {
-        detail::set_nonblocking(sock, true);
-
-        auto ret = connect(sock, ai.ai_addr, static_cast<int>(ai.ai_addrlen));
-        if (ret < 0) {
-          if (detail::is_connection_error() ||
-              !detail::wait_until_socket_is_ready(sock, timeout_sec_, 0)) {
-            detail::close_socket(sock);
-            return false;
-          }
-        }
+inline void SSLServer::set_external_session_cache(SSLSessionStore store,
+                                                  SSLSessionLookup lookup,
+                                                  SSLSessionRemove remove) {
+  if (!ctx_) { return; }
 
-        detail::set_nonblocking(sock, false);
-        return true;
-      });
+  session_store_ = store;
+  session_lookup_ = lookup;
+  session_remove_ = remove;
+
+  SSL_CTX_sess_set_new_cb(ctx_, store ? new_session_callback : nullptr);
+  SSL_CTX_sess_set_get_cb(ctx_, lookup ? get_session_callback : nullptr);
+  SSL_CTX_sess_set_remove_cb(ctx_, remove ? remove_session_callback : nullptr);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (max_early_data_ > 0) { update_max_early_data(); }
+#endif
 }
 
-inline bool Client::read_response_line(Stream &strm, Response &res) {
-  const auto bufsiz = 2048;
-  char buf[bufsiz];
+inline void SSLServer::enable_crypto_thread_pool(size_t thread_count) {
+  if (crypto_queue_ || !thread_count) { return; }
 
-  detail::stream_line_reader reader(strm, buf, bufsiz);
+#if CPPHTTPLIB_THREAD_POOL_COUNT > 0
+  crypto_queue_.reset(new ThreadPool(thread_count));
+#else
+  crypto_queue_.reset(new Threads());
+#endif
+}
 
-  if (!reader.getline()) { return false; }
+inline void SSLServer::enable_dynamic_record_sizing(bool enabled) {
+  dynamic_record_sizing_ = enabled;
+}
 
-  const static std::regex re("(HTTP/1\\.[01]) (\\d+?) .*\r\n");
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+inline void SSLServer::set_max_early_data(uint32_t size) {
+  max_early_data_ = size;
+  if (ctx_) {
+    update_max_early_data();
+    SSL_CTX_clear_options(ctx_, SSL_OP_NO_ANTI_REPLAY);
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+    SSL_CTX_set_allow_early_data_cb(ctx_, allow_early_data_callback, nullptr);
+#endif
+  }
+}
 
-  std::cmatch m;
-  if (std::regex_match(reader.ptr(), m, re)) {
-    res.version = std::string(m[1]);
-    res.status = std::stoi(std::string(m[2]));
+// Tickets only offer early data while a session cache can tell replays, so
+// that clients don't send early data which would be rejected.
+inline void SSLServer::update_max_early_data() {
+  auto size = session_cache_enabled_ || session_remove_ ? max_early_data_ : 0;
+  SSL_CTX_set_max_early_data(ctx_, size);
+  SSL_CTX_set_recv_max_early_data(ctx_, size);
+}
+
+// Reads the client's early data, if any, then finishes the handshake.
+// Returns like SSL_accept, so that a blocked handshake can be resumed.
+inline int SSLServer::accept_with_early_data(SSL *ssl) {
+  auto &early_data = detail::SSLEarlyData::get(ssl);
+
+  while (!early_data.finished) {
+    char buf[CPPHTTPLIB_RECV_BUFSIZ];
+    size_t n = 0;
+    switch (SSL_read_early_data(ssl, buf, sizeof(buf), &n)) {
+    case SSL_READ_EARLY_DATA_SUCCESS: early_data.data.append(buf, n); break;
+    case SSL_READ_EARLY_DATA_FINISH: early_data.finished = true; break;
+    default: return -1;
+    }
   }
 
-  return true;
+  return SSL_accept(ssl);
 }
 
-inline bool Client::send(Request &req, Response &res) {
-  if (req.path.empty()) { return false; }
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+// HTTP/2 frames in early data can't be checked for safe requests.
+inline int SSLServer::allow_early_data_callback(SSL *ssl, void * /*arg*/) {
+  return detail::is_http2_selected(ssl) ? 0 : 1;
+}
+#endif
+#endif
 
-  auto sock = create_client_socket();
-  if (sock == INVALID_SOCKET) { return false; }
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+inline void SSLServer::enable_http2(bool enabled) { http2_ = enabled; }
+#endif
+
+// NOTE: Must be called with `ticket_keys_mutex_` held.
+inline bool SSLServer::rotate_session_ticket_keys() {
+  auto now = time(nullptr);
 
-  return read_and_close_socket(sock, req, res);
+  if (!ticket_keys_.empty() &&
+      now - ticket_keys_.front().created < ticket_key_rotation_interval_) {
+    return true;
+  }
+
+  detail::SSLTicketKey key;
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+      RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+      RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+    return false;
+  }
+  key.created = now;
+
+  // Retired keys can still decrypt tickets issued before the rotation.
+  ticket_keys_.insert(ticket_keys_.begin(), key);
+  if (ticket_keys_.size() > retired_ticket_key_count_ + 1) {
+    ticket_keys_.resize(retired_ticket_key_count_ + 1);
+  }
+  return true;
 }
 
-inline void Client::write_request(Stream &strm, Request &req) {
-  BufferStream bstrm;
+inline int SSLServer::new_session_callback(SSL *ssl, SSL_SESSION *session) {
+  auto self =
+      static_cast<SSLServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
 
-  // Request line
-  auto path = detail::encode_url(req.path);
+  unsigned int id_len = 0;
+  auto id = SSL_SESSION_get_id(session, &id_len);
 
-  bstrm.write_format("%s %s HTTP/1.1\r\n", req.method.c_str(), path.c_str());
+  auto len = i2d_SSL_SESSION(session, nullptr);
+  if (len <= 0) { return 0; }
 
-  // Headers
-  if (!req.has_header("Host")) {
-    if (is_ssl()) {
-      if (port_ == 443) {
-        req.set_header("Host", host_);
-      } else {
-        req.set_header("Host", host_and_port_);
-      }
-    } else {
-      if (port_ == 80) {
-        req.set_header("Host", host_);
-      } else {
-        req.set_header("Host", host_and_port_);
-      }
-    }
+  std::string data(static_cast<size_t>(len), '\0');
+  auto p = reinterpret_cast<unsigned char *>(&data[0]);
+  i2d_SSL_SESSION(session, &p);
+
+  self->session_store_(
+      std::string(reinterpret_cast<const char *>(id), id_len), data);
+
+  // The session is not retained here, so OpenSSL keeps the ownership.
+  return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+inline SSL_SESSION *SSLServer::get_session_callback(SSL *ssl,
+                                                    unsigned char *id,
+                                                    int id_len, int *copy) {
+#else
+inline SSL_SESSION *SSLServer::get_session_callback(SSL *ssl,
+                                                    const unsigned char *id,
+                                                    int id_len, int *copy) {
+#endif
+  auto self =
+      static_cast<SSLServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+
+  *copy = 0;
+
+  std::string data;
+  if (!self->session_lookup_(
+          std::string(reinterpret_cast<const char *>(id), id_len), data)) {
+    return nullptr;
   }
 
-  if (!req.has_header("Accept")) { req.set_header("Accept", "*/*"); }
+  auto p = reinterpret_cast<const unsigned char *>(data.data());
+  return d2i_SSL_SESSION(nullptr, &p, static_cast<long>(data.size()));
+}
+
+inline void SSLServer::remove_session_callback(SSL_CTX *ctx,
+                                               SSL_SESSION *session) {
+  auto self = static_cast<SSLServer *>(SSL_CTX_get_app_data(ctx));
+
+  unsigned int id_len = 0;
+  auto id = SSL_SESSION_get_id(session, &id_len);
 
-  if (!req.has_header("User-Agent")) {
-    req.set_header("User-Agent", "cpp-httplib/0.2");
-  }
+  self->session_remove_(
+      std::string(reinterpret_cast<const char *>(id), id_len));
+}
 
-  // TODO: Support KeepAlive connection
-  // if (!req.has_header("Connection")) {
-  req.set_header("Connection", "close");
-  // }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+inline int SSLServer::ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                          unsigned char *iv,
+                                          EVP_CIPHER_CTX *cipher_ctx,
+                                          EVP_MAC_CTX *hmac_ctx, int enc) {
+#else
+inline int SSLServer::ticket_key_callback(SSL *ssl, unsigned char *key_name,
+                                          unsigned char *iv,
+                                          EVP_CIPHER_CTX *cipher_ctx,
+                                          HMAC_CTX *hmac_ctx, int enc) {
+#endif
+  auto self =
+      static_cast<SSLServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
 
-  if (req.body.empty()) {
-    if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH") {
-      req.set_header("Content-Length", "0");
-    }
-  } else {
-    if (!req.has_header("Content-Type")) {
-      req.set_header("Content-Type", "text/plain");
-    }
+  std::lock_guard<std::mutex> guard(self->ticket_keys_mutex_);
 
-    if (!req.has_header("Content-Length")) {
-      auto length = std::to_string(req.body.size());
-      req.set_header("Content-Length", length);
+  if (!self->rotate_session_ticket_keys()) { return -1; }
+
+  if (enc) {
+    const auto &key = self->ticket_keys_.front();
+
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) { return -1; }
+
+    memcpy(key_name, key.name, sizeof(key.name));
+    if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                           key.aes_key, iv) != 1 ||
+        !detail::init_ticket_hmac(hmac_ctx, key.hmac_key,
+                                  sizeof(key.hmac_key))) {
+      return -1;
     }
+    return 1;
   }
 
-  detail::write_headers(bstrm, req);
+  for (size_t i = 0; i < self->ticket_keys_.size(); i++) {
+    const auto &key = self->ticket_keys_[i];
+    if (!memcmp(key_name, key.name, sizeof(key.name))) {
+      if (!detail::init_ticket_hmac(hmac_ctx, key.hmac_key,
+                                    sizeof(key.hmac_key)) ||
+          EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr,
+                             key.aes_key, iv) != 1) {
+        return -1;
+      }
 
-  // Body
-  if (!req.body.empty()) { bstrm.write(req.body); }
+      // Ask the client to replace tickets encrypted with a retired key.
+      return i == 0 ? 1 : 2;
+    }
+  }
 
-  // Flush buffer
-  auto &data = bstrm.get_buffer();
-  strm.write(data.data(), data.size());
+  // Unknown key: fall back to a full handshake.
+  return 0;
 }
 
-inline bool Client::process_request(Stream &strm, Request &req, Response &res,
-                                    bool &connection_close) {
-  // Send request
-  write_request(strm, req);
+inline bool SSLServer::read_and_close_socket(socket_t sock) {
+  auto ssl = detail::SSLPool::acquire(ctx_);
 
-  // Receive response and headers
-  if (!read_response_line(strm, res) ||
-      !detail::read_headers(strm, res.headers)) {
+  if (!ssl) {
+    detail::close_socket(sock);
+    active_connection_count_--;
     return false;
   }
 
-  if (res.get_header_value("Connection") == "close" ||
-      res.version == "HTTP/1.0") {
-    connection_close = true;
-  }
+  auto bio = BIO_new_socket(sock, BIO_NOCLOSE);
+  SSL_set_bio(ssl, bio, bio);
 
-  // Body
-  if (req.method != "HEAD") {
-    detail::ContentReceiverCore out = [&](const char *buf, size_t n) {
-      res.body.append(buf, n);
-      return true;
-    };
+  // The handshake runs on a non-blocking socket, so that a slow client
+  // doesn't hold this worker between its handshake messages.
+  detail::set_nonblocking(sock, true);
 
-    if (res.content_receiver) {
-      auto offset = std::make_shared<uint64_t>();
-      auto length = get_header_value_uint64(res.headers, "Content-Length", 0);
-      auto receiver = res.content_receiver;
-      out = [offset, length, receiver](const char *buf, size_t n) {
-        auto ret = receiver(buf, n, *offset, length);
-        (*offset) += n;
-        return ret;
-      };
-    }
+  auto deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::seconds(CPPHTTPLIB_SSL_HANDSHAKE_TIMEOUT_SECOND);
 
-    int dummy_status;
-    if (!detail::read_content(strm, res, std::numeric_limits<uint64_t>::max(),
-                              dummy_status, res.progress, out)) {
-      return false;
-    }
+  if (crypto_queue_) {
+    crypto_queue_->enqueue(
+        [=]() { accept_and_close_socket(sock, ssl, deadline); });
+    return true;
   }
 
-  return true;
+  return accept_and_close_socket(sock, ssl, deadline);
 }
 
-inline bool Client::read_and_close_socket(socket_t sock, Request &req,
-                                          Response &res) {
-  return detail::read_and_close_socket(
-      sock, 0,
-      [&](Stream &strm, bool /*last_connection*/, bool &connection_close) {
-        return process_request(strm, req, res, connection_close);
-      });
-}
+inline bool SSLServer::accept_and_close_socket(
+    socket_t sock, SSL *ssl, std::chrono::steady_clock::time_point deadline) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  auto ret =
+      max_early_data_ > 0 ? accept_with_early_data(ssl) : SSL_accept(ssl);
+#else
+  auto ret = SSL_accept(ssl);
+#endif
 
-inline bool Client::is_ssl() const { return false; }
+  if (ret != 1) {
+    auto err = SSL_get_error(ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      readiness_loop_.wait(
+          sock, err == SSL_ERROR_WANT_WRITE, deadline,
+          [=]() { accept_and_close_socket(sock, ssl, deadline); },
+          [=]() { close_socket(sock, ssl); }, crypto_queue_.get());
+      return true;
+    }
 
-inline std::shared_ptr<Response> Client::Get(const char *path,
-                                             Progress progress) {
-  return Get(path, Headers(), progress);
-}
+    close_socket(sock, ssl);
+    return false;
+  }
 
-inline std::shared_ptr<Response>
-Client::Get(const char *path, const Headers &headers, Progress progress) {
-  Request req;
-  req.method = "GET";
-  req.path = path;
-  req.headers = headers;
+  detail::set_nonblocking(sock, false);
 
-  auto res = std::make_shared<Response>();
-  res->progress = progress;
+  if (crypto_queue_) {
+    // Hand the established connection over to the request workers.
+    readiness_loop_.post([=]() { process_and_close_socket(sock, ssl); },
+                         [=]() { close_socket(sock, ssl); });
+    return true;
+  }
 
-  return send(req, *res) ? res : nullptr;
+  return process_and_close_socket(sock, ssl);
 }
 
-inline std::shared_ptr<Response> Client::Get(const char *path,
-                                             ContentReceiver content_receiver,
-                                             Progress progress) {
-  return Get(path, Headers(), content_receiver, progress);
-}
+inline bool SSLServer::process_and_close_socket(socket_t sock, SSL *ssl) {
+  std::string early_data;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (max_early_data_ > 0) {
+    early_data.swap(detail::SSLEarlyData::get(ssl).data);
 
-inline std::shared_ptr<Response> Client::Get(const char *path,
-                                             const Headers &headers,
-                                             ContentReceiver content_receiver,
-                                             Progress progress) {
-  Request req;
-  req.method = "GET";
-  req.path = path;
-  req.headers = headers;
+    if (!early_data.empty() && !detail::is_replay_safe_early_data(early_data)) {
+      SSLSocketStream strm(sock, ssl);
+      strm.write("HTTP/1.1 425 Too Early\r\nConnection: close\r\n"
+                 "Content-Length: 0\r\n\r\n");
 
-  auto res = std::make_shared<Response>();
-  res->content_receiver = content_receiver;
-  res->progress = progress;
+      SSL_shutdown(ssl);
+      close_socket(sock, ssl);
+      return false;
+    }
+  }
+#endif
 
-  return send(req, *res) ? res : nullptr;
-}
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  if (detail::is_http2_selected(ssl)) {
+    auto processed = process_http2(sock, ssl);
 
-inline std::shared_ptr<Response> Client::Head(const char *path) {
-  return Head(path, Headers());
-}
+    SSL_shutdown(ssl);
+    close_socket(sock, ssl);
 
-inline std::shared_ptr<Response> Client::Head(const char *path,
-                                              const Headers &headers) {
-  Request req;
-  req.method = "HEAD";
-  req.headers = headers;
-  req.path = path;
+    return processed;
+  }
+#endif
 
-  auto res = std::make_shared<Response>();
+  size_t keep_alive_max_count;
+  time_t keep_alive_timeout_sec;
+  time_t keep_alive_timeout_usec;
+  get_keep_alive_policy(keep_alive_max_count, keep_alive_timeout_sec,
+                        keep_alive_timeout_usec);
+
+  size_t connection_request_count = 0;
+
+  auto processed = detail::process_socket_ssl(
+      sock, ssl, keep_alive_max_count, keep_alive_timeout_sec,
+      keep_alive_timeout_usec, dynamic_record_sizing_, early_data,
+      [&](SSL *ssl, Stream &strm, bool last_connection,
+          bool &connection_close) {
+        return process_request(
+            strm, last_connection || is_keep_alive_under_pressure(),
+            connection_close, [&](Request &req) {
+              req.ssl = ssl;
+              count_request(req, connection_request_count);
+            });
+      });
 
-  return send(req, *res) ? res : nullptr;
-}
+  SSL_shutdown(ssl);
+  close_socket(sock, ssl);
 
-inline std::shared_ptr<Response> Client::Post(const char *path,
-                                              const std::string &body,
-                                              const char *content_type) {
-  return Post(path, Headers(), body, content_type);
+  return processed;
 }
 
-inline std::shared_ptr<Response> Client::Post(const char *path,
-                                              const Headers &headers,
-                                              const std::string &body,
-                                              const char *content_type) {
-  Request req;
-  req.method = "POST";
-  req.headers = headers;
-  req.path = path;
+inline void SSLServer::close_socket(socket_t sock, SSL *ssl) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // SSL_read_early_data has left an early data state which SSL_clear doesn't
+  // reset, also when the client sent none.
+  if (max_early_data_ > 0) {
+    SSL_free(ssl);
+  } else {
+    detail::SSLPool::release(ssl);
+  }
+#else
+  detail::SSLPool::release(ssl);
+#endif
+  detail::close_socket(sock);
+  active_connection_count_--;
+}
 
-  req.headers.emplace("Content-Type", content_type);
-  req.body = body;
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+inline bool SSLServer::process_http2(socket_t sock, SSL *ssl) {
+  size_t keep_alive_max_count;
+  time_t keep_alive_timeout_sec;
+  time_t keep_alive_timeout_usec;
+  get_keep_alive_policy(keep_alive_max_count, keep_alive_timeout_sec,
+                        keep_alive_timeout_usec);
 
-  auto res = std::make_shared<Response>();
+  SSLSocketStream strm(sock, ssl);
+  strm.enable_dynamic_record_sizing(dynamic_record_sizing_);
 
-  return send(req, *res) ? res : nullptr;
-}
+  auto remote_addr = strm.get_remote_addr();
+  size_t connection_request_count = 0;
 
-inline std::shared_ptr<Response> Client::Post(const char *path,
-                                              const Params &params) {
-  return Post(path, Headers(), params);
-}
+  detail::Http2ServerSession session(
+      strm, sock, payload_max_length_,
+      [&](detail::Http2Stream &stream) {
+        auto &req = stream.req;
+        auto &res = stream.res;
 
-inline std::shared_ptr<Response>
-Client::Post(const char *path, const Headers &headers, const Params &params) {
-  std::string query;
-  for (auto it = params.begin(); it != params.end(); ++it) {
-    if (it != params.begin()) { query += "&"; }
-    query += it->first;
-    query += "=";
-    query += detail::encode_url(it->second);
-  }
+        req.ssl = ssl;
+        req.set_header("REMOTE_ADDR", remote_addr);
 
-  return Post(path, headers, query, "application/x-www-form-urlencoded");
-}
+        if (stream.payload_too_large) {
+          res.status = 413;
+        } else {
+          handle_request(req, res, [&](Request &req) {
+            count_request(req, connection_request_count);
+          });
+        }
 
-inline std::shared_ptr<Response>
-Client::Post(const char *path, const MultipartFormDataItems &items) {
-  return Post(path, Headers(), items);
-}
+        if (400 <= res.status && error_handler_) { error_handler_(req, res); }
 
-inline std::shared_ptr<Response>
-Client::Post(const char *path, const Headers &headers,
-             const MultipartFormDataItems &items) {
-  Request req;
-  req.method = "POST";
-  req.headers = headers;
-  req.path = path;
+        std::string boundary;
+        std::string content_type;
+        prepare_response(req, res, boundary, content_type);
 
-  auto boundary = detail::make_multipart_data_boundary();
+        if (req.method == "HEAD" || !res.body.empty() ||
+            !res.content_provider) {
+          return;
+        }
 
-  req.headers.emplace("Content-Type",
-                      "multipart/form-data; boundary=" + boundary);
+        // The session pulls the body from the provider as the flow control
+        // windows allow, except for multipart ranges which are assembled
+        // up front.
+        auto length = res.content_provider_resource_length;
+        if (!length) {
+          stream.chunked_provider = true;
+        } else if (req.ranges.empty()) {
+          stream.provider_end = length;
+        } else if (req.ranges.size() == 1) {
+          auto offsets = detail::get_range_offset_and_length(req, length, 0);
+          stream.provider_offset = offsets.first;
+          stream.provider_end = offsets.first + offsets.second;
+        } else {
+          BufferStream bstrm;
+          write_content_with_provider(bstrm, req, res, boundary,
+                                      content_type);
+          res.body = bstrm.get_buffer();
+        }
+      },
+      logger_);
 
-  for (const auto &item : items) {
-    req.body += "--" + boundary + "\r\n";
-    req.body += "Content-Disposition: form-data; name=\"" + item.name + "\"";
-    if (!item.filename.empty()) {
-      req.body += "; filename=\"" + item.filename + "\"";
-    }
-    req.body += "\r\n";
-    if (!item.content_type.empty()) {
-      req.body += "Content-Type: " + item.content_type + "\r\n";
-    }
-    req.body += "\r\n";
-    req.body += item.content + "\r\n";
-  }
+  return session.run(keep_alive_timeout_sec, keep_alive_timeout_usec);
+}
 
-  req.body += "--" + boundary + "--\r\n";
+inline int SSLServer::alpn_select_callback(SSL *ssl, const unsigned char **out,
+                                           unsigned char *outlen,
+                                           const unsigned char *in,
+                                           unsigned int inlen, void *arg) {
+  auto self = static_cast<SSLServer *>(arg);
 
-  auto res = std::make_shared<Response>();
+  // HTTP/2 must not be negotiated below TLS 1.2 (RFC 7540, 9.2).
+  if (!self->http2_ || SSL_version(ssl) < TLS1_2_VERSION) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
 
-  return send(req, *res) ? res : nullptr;
+  static const unsigned char protos[] = "\x02h2\x08http/1.1";
+  if (SSL_select_next_proto(const_cast<unsigned char **>(out), outlen, protos,
+                            sizeof(protos) - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
 }
+#endif
 
-inline std::shared_ptr<Response> Client::Put(const char *path,
-                                             const std::string &body,
-                                             const char *content_type) {
-  return Put(path, Headers(), body, content_type);
-}
+// SSL HTTP client implementation
+inline SSLClient::SSLClient(const char *host, int port, time_t timeout_sec,
+                            const char *client_cert_path,
+                            const char *client_key_path)
+    : Client(host, port, timeout_sec) {
+  ctx_ = SSL_CTX_new(SSLv23_client_method());
+  if (ctx_) {
+    SSL_CTX_set_read_ahead(ctx_, 1);
 
-inline std::shared_ptr<Response> Client::Put(const char *path,
-                                             const Headers &headers,
-                                             const std::string &body,
-                                             const char *content_type) {
-  Request req;
-  req.method = "PUT";
-  req.headers = headers;
-  req.path = path;
+    // SSL_read returns after records without data, such as session tickets,
+    // instead of waiting for more without a timeout.
+    SSL_CTX_clear_mode(ctx_, SSL_MODE_AUTO_RETRY);
 
-  req.headers.emplace("Content-Type", content_type);
-  req.body = body;
+    // Sessions are kept in SSLClientSessionCache, shared by all clients.
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT |
+                                             SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx_, new_session_callback);
+  }
 
-  auto res = std::make_shared<Response>();
+  detail::split(&host_[0], &host_[host_.size()], '.',
+                [&](const char *b, const char *e) {
+                  host_components_.emplace_back(std::string(b, e));
+                });
+  if (client_cert_path && client_key_path) {
+    client_cert_path_ = client_cert_path;
+    client_key_path_ = client_key_path;
 
-  return send(req, *res) ? res : nullptr;
+    if (SSL_CTX_use_certificate_file(ctx_, client_cert_path,
+                                     SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx_, client_key_path, SSL_FILETYPE_PEM) !=
+            1) {
+      SSL_CTX_free(ctx_);
+      ctx_ = nullptr;
+    }
+  }
 }
 
-inline std::shared_ptr<Response> Client::Patch(const char *path,
-                                               const std::string &body,
-                                               const char *content_type) {
-  return Patch(path, Headers(), body, content_type);
+inline SSLClient::~SSLClient() {
+  async_calls_->cancel_and_wait();
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  http2_session_.reset();
+#endif
+  if (ctx_) {
+    detail::SSLPool::discard(ctx_);
+    SSL_CTX_free(ctx_);
+  }
 }
 
-inline std::shared_ptr<Response> Client::Patch(const char *path,
-                                               const Headers &headers,
-                                               const std::string &body,
-                                               const char *content_type) {
-  Request req;
-  req.method = "PATCH";
-  req.headers = headers;
-  req.path = path;
-
-  req.headers.emplace("Content-Type", content_type);
-  req.body = body;
-
-  auto res = std::make_shared<Response>();
-
-  return send(req, *res) ? res : nullptr;
-}
+inline bool SSLClient::is_valid() const { return ctx_; }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path,
-                                                const std::string &body,
-                                                const char *content_type) {
-  return Delete(path, Headers(), body, content_type);
+inline void SSLClient::set_ca_cert_path(const char *ca_cert_file_path,
+                                        const char *ca_cert_dir_path) {
+  if (ca_cert_file_path) { ca_cert_file_path_ = ca_cert_file_path; }
+  if (ca_cert_dir_path) { ca_cert_dir_path_ = ca_cert_dir_path; }
 }
 
-inline std::shared_ptr<Response> Client::Delete(const char *path,
-                                                const Headers &headers,
-                                                const std::string &body,
-                                                const char *content_type) {
-  Request req;
-  req.method = "DELETE";
-  req.headers = headers;
-  req.path = path;
-
-  if (content_type) { req.headers.emplace("Content-Type", content_type); }
-  req.body = body;
+inline void SSLClient::enable_server_certificate_verification(bool enabled) {
+  server_certificate_verification_ = enabled;
+}
 
-  auto res = std::make_shared<Response>();
+inline bool SSLClient::reload_ca_certs() {
+  return detail::CACertStoreCache::get().reload();
+}
 
-  return send(req, *res) ? res : nullptr;
+inline void SSLClient::enable_session_resumption(bool enabled) {
+  session_resumption_ = enabled;
 }
 
-inline std::shared_ptr<Response> Client::Options(const char *path) {
-  return Options(path, Headers());
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+inline void SSLClient::enable_early_data(bool enabled) {
+  early_data_ = enabled;
 }
+#endif
 
-inline std::shared_ptr<Response> Client::Options(const char *path,
-                                                 const Headers &headers) {
-  Request req;
-  req.method = "OPTIONS";
-  req.path = path;
-  req.headers = headers;
+inline int SSLClient::new_session_callback(SSL *ssl, SSL_SESSION *session) {
+  auto key = detail::SSLClientSessionCache::get_key(ssl);
+  if (!key || key->empty()) { return 0; }
 
-  auto res = std::make_shared<Response>();
+  detail::SSLClientSessionCache::get().store(*key, session);
+  return 1;
+}
 
-  return send(req, *res) ? res : nullptr;
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+inline void SSLClient::enable_http2(bool enabled) { http2_ = enabled; }
+#endif
+
+inline long SSLClient::get_openssl_verify_result() const {
+  return verify_result_;
 }
 
-/*
- * SSL Implementation
- */
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-namespace detail {
+inline bool SSLClient::send_request(Request &req, Response &res,
+                                    detail::ClientCancellation *cancellation) {
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  if (http2_ && is_valid() && !req.path.empty()) {
+    auto default_headers = get_default_headers(req);
+    auto timeouts = get_timeouts();
+    timeouts.cancellation = cancellation;
+
+    // A server may drop an idle connection at any moment, so a request
+    // which it never saw is sent once more on a new one.
+    for (auto attempt = 0; attempt < 2; attempt++) {
+      auto fallback = false;
+      auto session = get_http2_session(fallback, timeouts);
+      if (!session) {
+        if (fallback) { break; }
+        return false;
+      }
 
-template <typename U, typename V, typename T>
-inline bool
-read_and_close_socket_ssl(socket_t sock, size_t keep_alive_max_count,
-                          SSL_CTX *ctx, std::mutex &ctx_mutex,
-                          U SSL_connect_or_accept, V setup, T callback) {
-  SSL *ssl = nullptr;
-  {
-    std::lock_guard<std::mutex> guard(ctx_mutex);
-    ssl = SSL_new(ctx);
-  }
+      auto retry = false;
+      if (session->send(req, res, default_headers, timeouts, retry)) {
+        return true;
+      }
+      if (!retry || attempt > 0 || detail::is_cancelled(cancellation)) {
+        return false;
+      }
 
-  if (!ssl) {
-    close_socket(sock);
-    return false;
+      res.status = -1;
+      res.headers.clear();
+      res.body.clear();
+    }
   }
+#endif
 
-  auto bio = BIO_new_socket(sock, BIO_NOCLOSE);
-  SSL_set_bio(ssl, bio, bio);
+  return Client::send_request(req, res, cancellation);
+}
+
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+// Over HTTP/2, the session's thread waits for the response instead of the
+// readiness loop. A hedged attempt takes an HTTP/1.1 connection of its own.
+// Setting up the session is a job of the setup queue, which the calls
+// waiting for it share. The client waits for that job before it goes, and
+// the job is cancelled when no call waits for it any more.
+inline void
+SSLClient::start_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  if (http2_ && is_valid() && !call->req.path.empty() && !call->hedged) {
+    if (!call->retried) {
+      call->timeouts = get_timeouts();
+      call->timeouts.cancellation = &call->cancellation;
+    }
 
-  if (!setup(ssl)) {
-    SSL_shutdown(ssl);
-    {
-      std::lock_guard<std::mutex> guard(ctx_mutex);
-      SSL_free(ssl);
+    if (is_http2_session_ready()) {
+      send_http2_async(call);
+      return;
     }
 
-    close_socket(sock);
-    return false;
+    auto async_calls = async_calls_;
+    async_calls->hold();
+    std::shared_ptr<detail::ClientAsyncCalls> held(
+        async_calls.get(),
+        [async_calls](detail::ClientAsyncCalls *) { async_calls->release(); });
+
+    auto timeouts = call->timeouts;
+    auto key = "http2 " + std::to_string(reinterpret_cast<uintptr_t>(this));
+    detail::ClientSetupQueue::get().wait(
+        key, call,
+        [this, held, timeouts](detail::ClientCancellation &cancellation,
+                               std::vector<struct sockaddr_storage> &) {
+          auto job_timeouts = timeouts;
+          job_timeouts.cancellation = &cancellation;
+          auto fallback = false;
+          return get_http2_session(fallback, job_timeouts) || fallback;
+        },
+        [this, call](bool ok, const std::vector<struct sockaddr_storage> &) {
+          if (ok) {
+            send_http2_async(call);
+          } else {
+            call->handler(nullptr);
+          }
+        });
+    return;
   }
 
-  bool ret = false;
-
-  if (SSL_connect_or_accept(ssl) == 1) {
-    if (keep_alive_max_count > 0) {
-      auto count = keep_alive_max_count;
-      while (count > 0 &&
-             detail::select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                                 CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0) {
-        SSLSocketStream strm(sock, ssl);
-        auto last_connection = count == 1;
-        auto connection_close = false;
+  Client::start_async(call);
+}
 
-        ret = callback(ssl, strm, last_connection, connection_close);
-        if (!ret || connection_close) { break; }
+inline bool SSLClient::is_http2_session_ready() {
+  std::lock_guard<std::mutex> guard(http2_mutex_);
+  return !http2_connecting_ &&
+         (http2_unsupported_ || (http2_session_ && http2_session_->is_alive()));
+}
 
-        count--;
-      }
+inline void
+SSLClient::send_http2_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto fallback = false;
+  auto session = get_http2_session(fallback, call->timeouts);
+  if (!session) {
+    if (fallback) {
+      Client::start_async(call);
     } else {
-      SSLSocketStream strm(sock, ssl);
-      auto dummy_connection_close = false;
-      ret = callback(ssl, strm, true, dummy_connection_close);
+      call->handler(nullptr);
     }
+    return;
   }
 
-  SSL_shutdown(ssl);
-  {
-    std::lock_guard<std::mutex> guard(ctx_mutex);
-    SSL_free(ssl);
-  }
+  auto done = [this, call](bool ok, bool retry) {
+    auto &task_queue = detail::ClientEventLoop::get().task_queue();
+    if (ok) {
+      task_queue.enqueue([call]() {
+        detail::clear_interrupt(&call->cancellation);
+        call->handler(call->res);
+      });
+    } else if (retry && !call->retried &&
+               !detail::is_cancelled(&call->cancellation)) {
+      call->retried = true;
+      call->res->status = -1;
+      call->res->headers.clear();
+      call->res->body.clear();
+      task_queue.enqueue([this, call]() {
+        detail::clear_interrupt(&call->cancellation);
+        start_async(call);
+      });
+    } else {
+      task_queue.enqueue([call]() {
+        detail::clear_interrupt(&call->cancellation);
+        call->handler(nullptr);
+      });
+    }
+  };
 
-  close_socket(sock);
+  // The interrupt is set before the response can arrive, so that it can't
+  // replace the one of a retry.
+  auto &cancellation = call->cancellation;
+  std::unique_lock<std::mutex> lock(cancellation.mutex);
+  if (cancellation.cancelled) {
+    lock.unlock();
+    call->handler(nullptr);
+    return;
+  }
 
-  return ret;
+  auto stream =
+      session->send_async(call->req, *call->res, get_default_headers(call->req),
+                          call->timeouts, done);
+  std::weak_ptr<detail::Http2ClientSession> weak_session = session;
+  std::weak_ptr<detail::Http2ClientStream> weak_stream = stream;
+  cancellation.interrupt = [weak_session, weak_stream]() {
+    auto session = weak_session.lock();
+    auto stream = weak_stream.lock();
+    if (session && stream) { session->abandon(*stream); }
+  };
 }
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-static std::shared_ptr<std::vector<std::mutex>> openSSL_locks_;
+// Returns the connection shared by all requests, opening it when needed.
+// `fallback` is set when the server doesn't speak HTTP/2.
+inline std::shared_ptr<detail::Http2ClientSession>
+SSLClient::get_http2_session(bool &fallback,
+                             const detail::ClientTimeouts &timeouts) {
+  std::unique_lock<std::mutex> lock(http2_mutex_);
+  http2_cond_.wait(lock, [&] { return !http2_connecting_; });
 
-class SSLThreadLocks {
-public:
-  SSLThreadLocks() {
-    openSSL_locks_ =
-        std::make_shared<std::vector<std::mutex>>(CRYPTO_num_locks());
-    CRYPTO_set_locking_callback(locking_callback);
+  if (http2_unsupported_) {
+    fallback = true;
+    return nullptr;
   }
 
-  ~SSLThreadLocks() { CRYPTO_set_locking_callback(nullptr); }
+  if (http2_session_ && http2_session_->is_alive()) { return http2_session_; }
 
-private:
-  static void locking_callback(int mode, int type, const char * /*file*/,
-                               int /*line*/) {
-    auto &locks = *openSSL_locks_;
-    if (mode & CRYPTO_LOCK) {
-      locks[type].lock();
-    } else {
-      locks[type].unlock();
-    }
-  }
-};
+  // Only one thread connects; the others wait for its session above.
+  http2_connecting_ = true;
+  auto stale = std::move(http2_session_);
+  lock.unlock();
 
-#endif
+  stale.reset();
 
-class SSLInit {
-public:
-  SSLInit() {
-    SSL_load_error_strings();
-    SSL_library_init();
+  std::shared_ptr<detail::Http2ClientSession> session;
+  auto unsupported = false;
+
+  detail::ClientConnection conn;
+  if (open_ssl_connection(conn, true, timeouts)) {
+    if (detail::is_http2_selected(conn.ssl)) {
+      session = std::make_shared<detail::Http2ClientSession>(
+          conn.sock, conn.ssl, body_reserve_max_length_, host_and_port_,
+          detail::take_connection_timing(conn));
+      if (!session->start()) { session.reset(); }
+    } else {
+      // Keep the HTTP/1.1 connection for the request falling back to it.
+      unsupported = true;
+      release_connection(conn, false);
+    }
   }
 
-  ~SSLInit() { ERR_free_strings(); }
+  lock.lock();
+  http2_connecting_ = false;
+  http2_unsupported_ = unsupported;
+  http2_session_ = session;
+  http2_cond_.notify_all();
 
-private:
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-  SSLThreadLocks thread_init_;
+  fallback = unsupported;
+  return session;
+}
 #endif
-};
 
-static SSLInit sslinit_;
+inline bool SSLClient::open_connection(detail::ClientConnection &conn,
+                                       Request &req, bool close_connection,
+                                       bool &request_sent,
+                                       const detail::ClientTimeouts &timeouts) {
+  if (early_data_ && (req.method == "GET" || req.method == "HEAD") &&
+      !req.content_provider) {
+    BufferStream bstrm;
+    write_request(bstrm, req, close_connection);
+    return open_ssl_connection(conn, false, timeouts, &bstrm.get_buffer(),
+                               &request_sent);
+  }
 
-} // namespace detail
+  return open_ssl_connection(conn, false, timeouts);
+}
 
-// SSL socket stream implementation
-inline SSLSocketStream::SSLSocketStream(socket_t sock, SSL *ssl)
-    : sock_(sock), ssl_(ssl) {}
+inline bool SSLClient::open_ssl_connection(
+    detail::ClientConnection &conn, bool http2,
+    const detail::ClientTimeouts &timeouts, const std::string *early_data,
+    bool *early_data_accepted) {
+  if (!is_valid()) { return false; }
 
-inline SSLSocketStream::~SSLSocketStream() {}
+  ResponseTiming timing;
+  auto sock = create_client_socket(timeouts, timing);
+  if (sock == INVALID_SOCKET) { return false; }
 
-inline int SSLSocketStream::read(char *ptr, size_t size) {
-  if (SSL_pending(ssl_) > 0 ||
-      detail::select_read(sock_, CPPHTTPLIB_READ_TIMEOUT_SECOND,
-                          CPPHTTPLIB_READ_TIMEOUT_USECOND) > 0) {
-    return SSL_read(ssl_, ptr, size);
+  auto ssl = create_ssl(sock, http2, early_data);
+  if (!ssl) {
+    detail::close_socket(sock);
+    return false;
   }
-  return -1;
-}
-
-inline int SSLSocketStream::write(const char *ptr, size_t size) {
-  return SSL_write(ssl_, ptr, size);
-}
 
-inline int SSLSocketStream::write(const char *ptr) {
-  return write(ptr, strlen(ptr));
-}
+  // Cancelling shuts the socket down, which ends the handshake.
+  auto timeout_msec = detail::get_remaining_msec(timeouts.tls_handshake_msec,
+                                                 timeouts.deadline);
+  auto handshake_start = std::chrono::steady_clock::now();
+  auto connected =
+      timeout_msec >= 0 &&
+      detail::watch_socket(timeouts.cancellation, sock) &&
+      connect_and_verify(ssl, sock, timeout_msec, early_data,
+                         early_data_accepted);
+  if (!detail::unwatch_sockets(timeouts.cancellation) || !connected) {
+    // Nothing can be sent on a socket which was shut down.
+    if (connected || detail::is_cancelled(timeouts.cancellation)) {
+      SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    } else {
+      SSL_shutdown(ssl);
+    }
+    detail::SSLPool::release(ssl);
+    detail::close_socket(sock);
+    return false;
+  }
+  timing.tls_handshake = std::chrono::steady_clock::now() - handshake_start;
+  timing.tls_session_reused = SSL_session_reused(ssl) == 1;
+  if (early_data && early_data_accepted && *early_data_accepted) {
+    timing.bytes_sent = early_data->size();
+  }
 
-inline int SSLSocketStream::write(const std::string &s) {
-  return write(s.data(), s.size());
+  conn.sock = sock;
+  conn.ssl = ssl;
+  conn.timing = timing;
+  return true;
 }
 
-inline std::string SSLSocketStream::get_remote_addr() const {
-  return detail::get_remote_addr(sock_);
-}
+inline SSL *SSLClient::create_ssl(socket_t sock, bool http2,
+                                  const std::string *&early_data) {
+  auto ssl = detail::SSLPool::acquire(ctx_);
+  if (!ssl) { return nullptr; }
 
-// SSL HTTP server implementation
-inline SSLServer::SSLServer(const char *cert_path, const char *private_key_path,
-                            const char *client_ca_cert_file_path,
-                            const char *client_ca_cert_dir_path) {
-  ctx_ = SSL_CTX_new(SSLv23_server_method());
+  auto bio = BIO_new_socket(sock, BIO_NOCLOSE);
+  SSL_set_bio(ssl, bio, bio);
 
-  if (ctx_) {
-    SSL_CTX_set_options(ctx_,
-                        SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
-                            SSL_OP_NO_COMPRESSION |
-                            SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+  SSL_set_tlsext_host_name(ssl, host_.c_str());
 
-    // auto ecdh = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
-    // SSL_CTX_set_tmp_ecdh(ctx_, ecdh);
-    // EC_KEY_free(ecdh);
+  SSL_SESSION *session = nullptr;
+  if (session_resumption_) {
+    auto key = connection_pool_key();
+    session = detail::SSLClientSessionCache::get().acquire(key);
+    detail::SSLClientSessionCache::set_key(ssl, key);
+  } else {
+    detail::SSLClientSessionCache::set_key(ssl, std::string());
+  }
+  SSL_set_session(ssl, session);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // Early data must fit the server's limit and go to the same protocol that
+  // was negotiated for the session.
+  if (early_data) {
+    const unsigned char *alpn = nullptr;
+    size_t alpn_len = 0;
+    if (session) { SSL_SESSION_get0_alpn_selected(session, &alpn, &alpn_len); }
+
+    static const unsigned char http1[] = "\x08http/1.1";
+    auto same_protocol =
+        !alpn_len || (alpn_len == sizeof(http1) - 2 &&
+                      !memcmp(alpn, http1 + 1, alpn_len));
+
+    if (!session || http2 || !same_protocol ||
+        SSL_SESSION_get_max_early_data(session) < early_data->size()) {
+      early_data = nullptr;
+    } else if (alpn_len) {
+      SSL_set_alpn_protos(ssl, http1, sizeof(http1) - 1);
+    }
+  }
+#else
+  early_data = nullptr;
+#endif
 
-    if (SSL_CTX_use_certificate_chain_file(ctx_, cert_path) != 1 ||
-        SSL_CTX_use_PrivateKey_file(ctx_, private_key_path, SSL_FILETYPE_PEM) !=
-            1) {
-      SSL_CTX_free(ctx_);
-      ctx_ = nullptr;
-    } else if (client_ca_cert_file_path || client_ca_cert_dir_path) {
-      // if (client_ca_cert_file_path) {
-      //   auto list = SSL_load_client_CA_file(client_ca_cert_file_path);
-      //   SSL_CTX_set_client_CA_list(ctx_, list);
-      // }
+  if (session) { SSL_SESSION_free(session); }
 
-      SSL_CTX_load_verify_locations(ctx_, client_ca_cert_file_path,
-                                    client_ca_cert_dir_path);
+#ifdef CPPHTTPLIB_NGHTTP2_SUPPORT
+  if (http2) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    SSL_set_alpn_protos(ssl, protos, sizeof(protos) - 1);
+  }
+#else
+  (void)http2;
+#endif
 
-      SSL_CTX_set_verify(
-          ctx_,
-          SSL_VERIFY_PEER |
-              SSL_VERIFY_FAIL_IF_NO_PEER_CERT, // SSL_VERIFY_CLIENT_ONCE,
-          nullptr);
+  if (ca_cert_file_path_.empty() && ca_cert_dir_path_.empty()) {
+    SSL_set_verify(ssl, SSL_VERIFY_NONE, nullptr);
+  } else {
+    auto store = detail::CACertStoreCache::get().acquire(ca_cert_file_path_,
+                                                         ca_cert_dir_path_);
+    if (!store) {
+      detail::SSLPool::release(ssl);
+      return nullptr;
     }
+
+    // The SSL takes over the reference, also when it's recycled later.
+    SSL_set0_verify_cert_store(ssl, store);
+    SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
   }
+
+  return ssl;
 }
 
-inline SSLServer::~SSLServer() {
-  if (ctx_) { SSL_CTX_free(ctx_); }
+inline std::string SSLClient::connection_pool_key() const {
+  return "https://" + host_and_port_ + "|" + client_cert_path_ + "|" +
+         client_key_path_ + "|" + ca_cert_file_path_ + "|" +
+         ca_cert_dir_path_ + "|" +
+         (server_certificate_verification_ ? "verify" : "");
 }
 
-inline bool SSLServer::is_valid() const { return ctx_; }
+inline bool SSLClient::is_ssl() const { return true; }
 
-inline bool SSLServer::read_and_close_socket(socket_t sock) {
-  return detail::read_and_close_socket_ssl(
-      sock, keep_alive_max_count_, ctx_, ctx_mutex_, SSL_accept,
-      [](SSL * /*ssl*/) { return true; },
-      [this](SSL *ssl, Stream &strm, bool last_connection,
-             bool &connection_close) {
-        return process_request(strm, last_connection, connection_close,
-                               [&](Request &req) { req.ssl = ssl; });
-      });
+inline bool SSLClient::connect_and_verify(SSL *ssl, socket_t sock,
+                                          time_t timeout_msec,
+                                          const std::string *early_data,
+                                          bool *early_data_accepted) {
+  // The handshake runs on the non-blocking socket, so that it can time out.
+  auto deadline = timeout_msec ? std::chrono::steady_clock::now() +
+                                     std::chrono::milliseconds(timeout_msec)
+                               : (std::chrono::steady_clock::time_point::max)();
+  detail::set_nonblocking(sock, true);
+
+  auto data = early_data ? *early_data : std::string();
+  auto early_data_written = false;
+  auto ret = 0;
+  for (;;) {
+    auto want_write = false;
+    ret = detail::ssl_connect_step(ssl, data, early_data_written, want_write);
+    if (ret) { break; }
+
+    auto msec = detail::get_remaining_msec(0, deadline);
+    if (msec < 0 || detail::select_msec(sock, want_write, msec ? msec : -1) <=
+                        0) {
+      ret = -1;
+      break;
+    }
+  }
+  detail::set_nonblocking(sock, false);
+  if (ret < 0) { return false; }
+
+  return verify_connection(ssl, early_data, early_data_accepted);
 }
 
-// SSL HTTP client implementation
-inline SSLClient::SSLClient(const char *host, int port, time_t timeout_sec,
-                            const char *client_cert_path,
-                            const char *client_key_path)
-    : Client(host, port, timeout_sec) {
-  ctx_ = SSL_CTX_new(SSLv23_client_method());
+inline bool SSLClient::verify_connection(SSL *ssl,
+                                         const std::string *early_data,
+                                         bool *early_data_accepted) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  // A server refusing early data has dropped it, so it's sent again.
+  if (early_data && early_data_accepted) {
+    *early_data_accepted =
+        SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED;
+  }
+#else
+  (void)early_data;
+  (void)early_data_accepted;
+#endif
 
-  detail::split(&host_[0], &host_[host_.size()], '.',
-                [&](const char *b, const char *e) {
-                  host_components_.emplace_back(std::string(b, e));
-                });
-  if (client_cert_path && client_key_path) {
-    if (SSL_CTX_use_certificate_file(ctx_, client_cert_path,
-                                     SSL_FILETYPE_PEM) != 1 ||
-        SSL_CTX_use_PrivateKey_file(ctx_, client_key_path, SSL_FILETYPE_PEM) !=
-            1) {
-      SSL_CTX_free(ctx_);
-      ctx_ = nullptr;
+  if (server_certificate_verification_) {
+    verify_result_ = SSL_get_verify_result(ssl);
+
+    if (verify_result_ != X509_V_OK) { return false; }
+
+    auto server_cert = SSL_get_peer_certificate(ssl);
+
+    if (server_cert == nullptr) { return false; }
+
+    if (!verify_host(server_cert)) {
+      X509_free(server_cert);
+      return false;
     }
+    X509_free(server_cert);
   }
-}
 
-inline SSLClient::~SSLClient() {
-  if (ctx_) { SSL_CTX_free(ctx_); }
+  return true;
 }
 
-inline bool SSLClient::is_valid() const { return ctx_; }
+inline void
+SSLClient::async_connected(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto &req = call->req;
+  const std::string *early_data = nullptr;
+  if (early_data_ && (req.method == "GET" || req.method == "HEAD") &&
+      !req.content_provider) {
+    BufferStream bstrm;
+    write_request(bstrm, req, call->connection_close);
+    call->early_data = bstrm.get_buffer();
+    early_data = &call->early_data;
+  }
 
-inline void SSLClient::set_ca_cert_path(const char *ca_cert_file_path,
-                                        const char *ca_cert_dir_path) {
-  if (ca_cert_file_path) { ca_cert_file_path_ = ca_cert_file_path; }
-  if (ca_cert_dir_path) { ca_cert_dir_path_ = ca_cert_dir_path; }
-}
+  auto sock = call->conn.sock;
+  auto ssl = create_ssl(sock, false, early_data);
+  if (!ssl) {
+    detail::close_client_connection(call->conn);
+    call->handler(nullptr);
+    return;
+  }
+  if (!early_data) { call->early_data.clear(); }
+  call->early_data_written = false;
+  call->conn.ssl = ssl;
+
+  auto timeout_msec = detail::get_remaining_msec(
+      call->timeouts.tls_handshake_msec, call->timeouts.deadline);
+  if (timeout_msec < 0) {
+    detail::abort_client_connection(call->conn);
+    call->handler(nullptr);
+    return;
+  }
 
-inline void SSLClient::enable_server_certificate_verification(bool enabled) {
-  server_certificate_verification_ = enabled;
-}
+  call->handshake_deadline =
+      timeout_msec ? std::chrono::steady_clock::now() +
+                         std::chrono::milliseconds(timeout_msec)
+                   : (std::chrono::steady_clock::time_point::max)();
+  call->setup_start = std::chrono::steady_clock::now();
+  detail::set_nonblocking(sock, true);
+  step_handshake_async(call);
+}
+
+inline void
+SSLClient::step_handshake_async(std::shared_ptr<detail::ClientAsyncCall> call) {
+  auto ssl = call->conn.ssl;
+  auto sock = call->conn.sock;
+
+  auto want_write = false;
+  auto ret = detail::is_cancelled(&call->cancellation)
+                 ? -1
+                 : detail::ssl_connect_step(ssl, call->early_data,
+                                            call->early_data_written,
+                                            want_write);
+  if (!ret && std::chrono::steady_clock::now() < call->handshake_deadline) {
+    auto next = [=]() { step_handshake_async(call); };
+    wait_async(call, std::vector<socket_t>(1, sock), want_write,
+               call->handshake_deadline, next, next);
+    return;
+  }
 
-inline long SSLClient::get_openssl_verify_result() const {
-  return verify_result_;
-}
+  detail::set_nonblocking(sock, false);
+  auto early_data = call->early_data.empty() ? nullptr : &call->early_data;
+  auto early_data_accepted = false;
+  if (ret <= 0 || !verify_connection(ssl, early_data, &early_data_accepted)) {
+    detail::abort_client_connection(call->conn);
+    call->handler(nullptr);
+    return;
+  }
 
-inline bool SSLClient::read_and_close_socket(socket_t sock, Request &req,
-                                             Response &res) {
-
-  return is_valid() &&
-         detail::read_and_close_socket_ssl(
-             sock, 0, ctx_, ctx_mutex_,
-             [&](SSL *ssl) {
-               if (ca_cert_file_path_.empty()) {
-                 SSL_CTX_set_verify(ctx_, SSL_VERIFY_NONE, nullptr);
-               } else {
-                 if (!SSL_CTX_load_verify_locations(
-                         ctx_, ca_cert_file_path_.c_str(), nullptr)) {
-                   return false;
-                 }
-                 SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
-               }
-
-               if (SSL_connect(ssl) != 1) { return false; }
-
-               if (server_certificate_verification_) {
-                 verify_result_ = SSL_get_verify_result(ssl);
-
-                 if (verify_result_ != X509_V_OK) { return false; }
-
-                 auto server_cert = SSL_get_peer_certificate(ssl);
-
-                 if (server_cert == nullptr) { return false; }
-
-                 if (!verify_host(server_cert)) {
-                   X509_free(server_cert);
-                   return false;
-                 }
-                 X509_free(server_cert);
-               }
-
-               return true;
-             },
-             [&](SSL *ssl) {
-               SSL_set_tlsext_host_name(ssl, host_.c_str());
-               return true;
-             },
-             [&](SSL * /*ssl*/, Stream &strm, bool /*last_connection*/,
-                 bool &connection_close) {
-               return process_request(strm, req, res, connection_close);
-             });
-}
+  auto &timing = call->conn.timing;
+  timing.tls_handshake = std::chrono::steady_clock::now() - call->setup_start;
+  timing.tls_session_reused = SSL_session_reused(ssl) == 1;
+  if (early_data_accepted) { timing.bytes_sent = call->early_data.size(); }
 
-inline bool SSLClient::is_ssl() const { return true; }
+  write_async(call, early_data_accepted);
+}
 
 inline bool SSLClient::verify_host(X509 *server_cert) const {
   /* Quote from RFC2818 section 3.1 "Server Identity"